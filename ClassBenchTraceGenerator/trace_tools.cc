@@ -38,8 +38,8 @@ std::vector<Packet> header_gen(int d, std::vector<Rule>& filters, float a, float
     // printf("RandFilt = %d, a = %.4f, b = %.4f, Copies = %d\n",RandFilt,a,b,Copies);
 
     // Add to header list
-	std::vector<unsigned> temp;
-	for (int i = 0; i < d; i++) temp.push_back(new_hdr[i]);
+	Packet temp = {};
+	for (int i = 0; i < d; i++) temp[i] = new_hdr[i];
 	for (int i = 0; i < Copies; i++)  {
 		temp_packets.push_back(temp);
 	}
@@ -86,4 +86,29 @@ int MyPareto(float a, float b){
 std::vector<Packet> GeneratePacketsFromRuleset(std::vector<Rule>& filters, int num_packets){
 	if (filters.empty()) printf("warning there is no rule?\n");
 	return header_gen(filters[0].dim, filters, 1, 0.1f, num_packets);
+}
+
+// Grow (or cut) a filter set to num_rules filters
+// Extra filters are copies of random filters with fresh random bits under
+// their address prefixes, so prefix lengths keep the seed distribution
+// The seed filters keep their relative priorities, above the new ones
+std::vector<Rule> GenerateRulesFromRuleset(const std::vector<Rule>& filters, int num_rules){
+	if (filters.empty()) printf("warning there is no rule?\n");
+	int seeds = std::min<int>(filters.size(), num_rules);
+	std::vector<Rule> rules(filters.begin(), filters.begin() + seeds);
+	int extra = num_rules - seeds;
+	for (Rule& r : rules) r.priority += extra;
+
+	while ((int)rules.size() < num_rules){
+		Rule r = filters[Random::random_int(0, filters.size() - 1)];
+		for (int i = FieldSA; i <= FieldDA && i < r.dim; i++){
+			unsigned mask = r.prefix_length[i] == 0 ? 0u : ~0u << (32 - r.prefix_length[i]);
+			r.range[i][LowDim] = Random::random_unsigned_int() & mask;
+			r.range[i][HighDim] = r.range[i][LowDim] | ~mask;
+		}
+		r.priority = num_rules - rules.size();
+		r.id = rules.size();
+		rules.push_back(r);
+	}
+	return rules;
 }
\ No newline at end of file
@@ -13,3 +13,4 @@ std::vector<Packet> header_gen(int d, std::vector<Rule>& filters, float a, float
 void RandomCorner(int RandFilt, std::vector<Rule>& filts, unsigned* new_hdr, int d);
 int MyPareto(float a, float b);
 std::vector<Packet> GeneratePacketsFromRuleset(std::vector<Rule>& filters, int num_packets);
+std::vector<Rule> GenerateRulesFromRuleset(const std::vector<Rule>& filters, int num_rules);
@@ -46,13 +46,27 @@
  
 #define POINT_SIZE_BITS 32
 
+// Rules and packets have fixed storage for this many fields
+// Rulesets with more fields need to be built with a larger value
+#ifndef MAXDIMENSIONS
+#define MAXDIMENSIONS 5
+#endif
+
 typedef uint32_t Point;
-typedef std::vector<Point> Packet;
+typedef std::array<Point, MAXDIMENSIONS> Packet;
 
 struct Rule
 {
 	//Rule(){};
-	Rule(int dim = 5) : dim(dim), range(dim, { { 0, 0 } }), prefix_length(dim, 0){ markedDelete = 0; }
+	// Fields beyond dim cover the whole domain so that they match every packet
+	Rule(int dim = MAXDIMENSIONS) : dim(dim) {
+		markedDelete = 0;
+		prefix_length.fill(0);
+		range.fill({ { 0, 0 } });
+		for (int i = dim; i < MAXDIMENSIONS; i++) {
+			range[i][HighDim] = 0xFFFFFFFFu;
+		}
+	}
  
 	int dim;
 	int	priority;
@@ -61,19 +75,19 @@ struct Rule
 	int tag;
 	bool markedDelete = 0;
 
-	std::vector<unsigned> prefix_length;
+	std::array<unsigned, MAXDIMENSIONS> prefix_length;
 
-	std::vector<std::array<Point,2>> range;
+	std::array<std::array<Point,2>, MAXDIMENSIONS> range;
 
 	bool inline MatchesPacket(const Packet& p) const {
-		for (int i = 0; i < dim; i++) {
+		for (int i = 0; i < MAXDIMENSIONS; i++) {
 			if (p[i] < range[i][LowDim] || p[i] > range[i][HighDim]) return false;
 		}
 		return true;
 	}
 	
 	bool inline IntersectsRule(const Rule& r) const {
-		for (int i = 0; i < dim; i++) {
+		for (int i = 0; i < MAXDIMENSIONS; i++) {
 			if (range[i][HighDim] < r.range[i][LowDim] || range[i][LowDim] > r.range[i][HighDim]) return false;
 		}
 		return true;
@@ -199,7 +213,18 @@ enum TestMode {
 	ModeSizeAndMemoryAccess,
 	ModePartial,
 	ModePartitioning,
-	ModeValidation
+	ModeValidation,
+	ModeParallelClassification,
+	ModeConcurrentUpdate,
+	ModeConstruction,
+	ModeUpdateLatency,
+	ModeFlowCache,
+	ModeMegaflow,
+	ModeFilter,
+	ModeHash,
+	ModeSnapshot,
+	ModeCmap,
+	ModeCmapStress
 };
 
 enum PartitioningMode {
@@ -230,6 +255,7 @@ enum ClassifierTests {
 	TestForgePredict = 0x40000,
 	TestSplitSort = 0x80000,
 	TestBitCuts = 0x100000,
+	TestForgeImage = 0x200000,
 	TestAll = 0xFFFFFFFF
 };
 
@@ -55,14 +55,21 @@ std::vector<std::string> & InputReader::split(const std::string &s, char delim,
 	return elems;
 }
 
+void InputReader::CheckDimension(int d) {
+	if (d > MAXDIMENSIONS) {
+		printf("ERROR: filter set has %d fields but this build supports at most %d; rebuild with -DMAXDIMENSIONS=%d\n", d, MAXDIMENSIONS, d);
+		exit(1);
+	}
+}
+
 std::vector<std::string> InputReader::split(const std::string &s, char delim) {
 	std::vector<std::string> elems;
 	split(s, delim, elems);
 	return elems;
 }
 
-vector<vector<unsigned int>> InputReader::ReadPackets(const string& filename) {
-	vector<vector<unsigned int>> packets;
+vector<Packet> InputReader::ReadPackets(const string& filename) {
+	vector<Packet> packets;
 	ifstream input_file(filename);
 	if (!input_file.is_open())
 	{
@@ -76,9 +83,9 @@ vector<vector<unsigned int>> InputReader::ReadPackets(const string& filename) {
 	while (getline(input_file, content) && !content.empty()) {
 		istringstream iss(content);
 		vector<string> tokens{ istream_iterator < string > {iss}, istream_iterator < string > {} };
-		vector<unsigned int> one_packet;
+		Packet one_packet = {};
 		for (int i = 0; i < dim; i++) {
-			one_packet.push_back(atoui(tokens[i]));
+			one_packet[i] = atoui(tokens[i]);
 		}
 		packets.push_back(one_packet);
 		line_number++;
@@ -308,6 +315,7 @@ vector<Rule> InputReader::ReadFilterFileMSU(const string&  filename)
 	getline(input_file, content);
 	vector<string> split_comma = split(content, ',');
 	dim = split_comma.size();
+	CheckDimension(dim);
 
 	int priority = 0;
 	getline(input_file, content);
@@ -407,6 +415,7 @@ vector<Rule> InputReader::ReadFilterFile(const string&  filename) {
 		vector<string> split_semi = split(tokens.back(), ';');
 		reps = (atoi(split_semi.back().c_str()) + 1) / 5;
 		dim = reps * 5;
+		CheckDimension(dim);
 
 		return ReadFilterFileMSU(filename);
 
@@ -419,6 +428,7 @@ vector<Rule> InputReader::ReadFilterFile(const string&  filename) {
 		}
 		
 	    dim = reps * 5;
+		CheckDimension(dim);
 		return ReadFilterFileClassBench(filename);
 	} else {
 		cout << "ERROR: unknown input format please use either MSU format or ClassBench format" << endl;
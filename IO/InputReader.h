@@ -35,11 +35,12 @@ public:
 	static std::vector<Rule> ReadFilterFile(const std::string& filename);
 
 	static SQLiteData ExtractDatabaseInfo(const std::string&  filename, TestMode& mode, ClassifierTests& classifier);
-	static std::vector<std::vector<unsigned int>> ReadPackets(const std::string& filename);
+	static std::vector<Packet> ReadPackets(const std::string& filename);
 private:
 	static unsigned int inline atoui(const std::string& in);
 	static std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems);
 	static std::vector<std::string> split(const std::string &s, char delim);
+	static void CheckDimension(int d);
 
 //	static void ReadIPRange(vector<unsigned int>& IPrange, const string& token);
 	static void  ReadIPRange(std::array<unsigned int,2>& IPrange, unsigned int& prefix_length, const std::string& token);
@@ -156,7 +156,7 @@ bool OutputWriter::WriteCsvFile(const string& filename, const vector<string>& he
 	return out.good();
 }
 
-bool OutputWriter::WritePackets(const string& filename, const vector<vector<Point>>& packets) {
+bool OutputWriter::WritePackets(const string& filename, const vector<Packet>& packets) {
 	ofstream out(filename);
 	if (!out.good()) {
 		printf("Failed to open %s\n", filename.c_str());
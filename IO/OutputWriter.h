@@ -37,7 +37,7 @@ public:
 	static bool WriteToSQLite(const std::string& database_name, struct SQLiteData& sqldata, const std::vector<std::string>& header, const std::vector<std::map<std::string, std::string>>& data);
 	static bool WriteCsvFile(const std::string& filename, const std::vector<std::string>& header, const std::vector<std::map<std::string, std::string>>& data);
 
-	static bool WritePackets(const std::string& filename, const std::vector<std::vector<Point>>& packets);
+	static bool WritePackets(const std::string& filename, const std::vector<Packet>& packets);
 private:
 	static int Callback(void *NotUsed, int argc, char **argv, char **azColName);
 	static int CallBackCount(void* data, int count, char** rows, char**);
@@ -24,13 +24,9 @@
 #include "TupleSpaceSearch.h"
 #include "../TupleMerge/SlottedTable.h"
 
-// Values for Bernstein Hash
-#define HashBasis 5381
-#define HashMult 33
-
 void TupleTable::Insertion(const Rule& r) {
 
-	cmap_node * new_node = new cmap_node(r); /*key & rule*/
+	cmap_node * new_node = pool->make(r); /*key & rule*/
 	cmap_insert(&map_in_tuple, new_node, HashRule(r));
 
 	/*uint32_t key = HashRule(r);
@@ -39,6 +35,18 @@ void TupleTable::Insertion(const Rule& r) {
 	sort(rl.begin(), rl.end(), [](const Rule& rx, const Rule& ry) { return rx.priority >= ry.priority; });*/
 }
 
+void TupleTable::Insertion(const std::vector<Rule>& rl) {
+	std::vector<cmap_node *> nodes;
+	std::vector<uint32_t> hashes;
+	nodes.reserve(rl.size());
+	hashes.reserve(rl.size());
+	for (const Rule& r : rl) {
+		nodes.push_back(pool->make(r));
+		hashes.push_back(HashRule(r));
+	}
+	cmap_insert_bulk(&map_in_tuple, nodes.data(), hashes.data(), nodes.size());
+}
+
 void TupleTable::Deletion(const Rule& r) {
 	//find node containing the rule
 	unsigned int hash_r = HashRule(r);
@@ -46,9 +54,10 @@ void TupleTable::Deletion(const Rule& r) {
 	while (found_node != nullptr) {
 		if (found_node->priority == r.priority) {
 			cmap_remove(&map_in_tuple, found_node, hash_r);
+			delete found_node;
 			break;
 		}
-		found_node = found_node->next;
+		found_node = cmap_node_next_protected(found_node);
 	}
 
 	/*uint32_t key = HashRule(r);
@@ -63,15 +72,17 @@ int TupleTable::WorstAccesses() const {
 
 int TupleTable::ClassifyAPacket(const Packet& p)  {
 	
-	cmap_node * found_node = cmap_find(&map_in_tuple, HashPacket(p));
-	int priority = -1;
-	while (found_node != nullptr) {
-		if (found_node->rule_ptr->MatchesPacket(p)) {
-			priority = std::max(priority, found_node->priority);
+	const cmap_node * found_node = cmap_find(&map_in_tuple, HashPacket(p));
+	return MatchKernel::Run([&](auto k) __attribute__((always_inline)) {
+		int priority = -1;
+		while (found_node != nullptr) {
+			if (decltype(k)::Matches(p, *found_node)) {
+				priority = std::max(priority, found_node->priority);
+			}
+			found_node = cmap_node_next(found_node);
 		}
-		found_node = found_node->next;
-	}
-	return priority;
+		return priority;
+	});
 
 /*	auto ptr = table.find(HashPacket(p));
 	if (ptr != table.end()) {
@@ -93,37 +104,22 @@ bool inline TupleTable::IsPacketMatchToRule(const Packet& p, const Rule& r) {
 }
 
 uint32_t inline TupleTable::HashRule(const Rule& r) const {
-	uint32_t hash = 0;
+	TupleSpaceHash::State hash = TupleSpaceHash::Start();
 	for (size_t i = 0; i < dims.size(); i++) {
-		hash = hash_add(hash, r.range[dims[i]][LowDim] & TupleMergeUtils::Mask(tuple[dims[i]]));
-	}
-	return hash_finish(hash, 16);
-
-/*	uint32_t hash = HashBasis;
-	for (size_t d = 0; d < tuple.size(); d++) {
-		hash *= HashMult;
-		hash += r.range[d][LowDim] & ForgeUtils::Mask(tuple[d]);
+		hash = TupleSpaceHash::Add(hash, r.range[dims[i]][LowDim] & TupleMergeUtils::Mask(tuple[dims[i]]));
 	}
-	return hash;*/
-
+	return TupleSpaceHash::Finish(hash);
 }
 
 uint32_t inline TupleTable::HashPacket(const Packet& p) const {
-	uint32_t hash = 0;
+	TupleSpaceHash::State hash = TupleSpaceHash::Start();
 	uint32_t max_uint = 0xFFFFFFFF;
 
 	for (size_t i = 0; i < dims.size(); i++) {
 		uint32_t mask = lengths[i] != 32 ? ~(max_uint >> lengths[i]) : max_uint;
-		hash = hash_add(hash, p[dims[i]] & mask);
+		hash = TupleSpaceHash::Add(hash, p[dims[i]] & mask);
 	}
-	return hash_finish(hash, 16);
-
-	/*uint32_t hash = HashBasis;
-	for (size_t d = 0; d < tuple.size(); d++) {
-		hash *= HashMult;
-		hash += p[d] & ForgeUtils::Mask(tuple[d]);
-	}
-	return hash;*/
+	return TupleSpaceHash::Finish(hash);
 }
 
 void TupleSpaceSearch::ConstructClassifier(const std::vector<Rule>& r){
@@ -135,8 +131,18 @@ void TupleSpaceSearch::ConstructClassifier(const std::vector<Rule>& r){
 	dims.push_back(FieldSA);
 	dims.push_back(FieldDA);
 
-	for (const auto& Rule : r) {
-		InsertRule(Rule);
+	// Every tuple's rules are known up front, so each table is built in one go
+	std::unordered_map<uint64_t, std::vector<Rule>> tupleRules;
+	std::vector<uint64_t> keys;
+	for (const auto& rule : r) {
+		std::vector<Rule>& rl = tupleRules[KeyRulePrefix(rule)];
+		if (rl.empty()) {
+			keys.push_back(KeyRulePrefix(rule));
+		}
+		rl.push_back(rule);
+	}
+	for (uint64_t key : keys) {
+		InsertTuple(key, tupleRules[key]);
 	}
 
 	rules = r;
@@ -190,11 +196,15 @@ void TupleSpaceSearch::InsertRule(const Rule& rule) {
 		for (int d : dims) {
 			lengths.push_back(rule.prefix_length[d]);
 		}
-		all_tuples.insert(std::make_pair(KeyRulePrefix(rule), TupleTable(dims, lengths, rule)));
+		all_tuples.insert(std::make_pair(KeyRulePrefix(rule), TupleTable(dims, lengths, rule, pool)));
 	}
 	rules.push_back(rule);
 }
 
+void TupleSpaceSearch::InsertTuple(uint64_t key, const std::vector<Rule>& rl) {
+	all_tuples.insert(std::make_pair(key, TupleTable(dims, TupleLengths(rl[0]), rl, pool)));
+}
+
 int TupleSpaceSearch::WorstAccesses() const {
 	int cost = 0;
 	for (auto pair : all_tuples) {
@@ -255,11 +265,12 @@ void PriorityTupleSpaceSearch::DeleteRule(size_t i) {
 		hit->second->Deletion(rules[i], priority_change);
 		if (hit->second->IsEmpty()) {
 			//destroy tuple and erase from the map
-			
+			PriorityTuple* tuple = hit->second;
+			tuple->Destroy();
 			all_priority_tuples.erase(hit);
-			hit->second->Destroy();
 			RetainInvaraintOfPriorityVector();
 			priority_tuples_vector.pop_back();
+			delete tuple;
 
 		} else if (priority_change) {
 			//sort tuple again
@@ -291,7 +302,7 @@ void PriorityTupleSpaceSearch::InsertRule(const Rule& rule) {
 		for (int d : dims) {
 			lengths.push_back(rule.prefix_length[d]);
 		}
-		auto ptuple = new PriorityTuple(dims, lengths, rule);
+		auto ptuple = new PriorityTuple(dims, lengths, rule, pool);
 		all_priority_tuples.insert(std::make_pair(KeyRulePrefix(rule), ptuple));
 		// add to priority vector
 		priority_tuples_vector.push_back(ptuple);
@@ -301,6 +312,13 @@ void PriorityTupleSpaceSearch::InsertRule(const Rule& rule) {
 }
 
 
+void PriorityTupleSpaceSearch::InsertTuple(uint64_t key, const std::vector<Rule>& rl) {
+	auto ptuple = new PriorityTuple(dims, TupleLengths(rl[0]), rl, pool);
+	all_priority_tuples.insert(std::make_pair(key, ptuple));
+	priority_tuples_vector.push_back(ptuple);
+	RetainInvaraintOfPriorityVector();
+}
+
 int PriorityTupleSpaceSearch::WorstAccesses() const {
 	int cost = 0;
 	for (const PriorityTuple* t : priority_tuples_vector) {
@@ -33,15 +33,30 @@
 #include <fstream>
 struct TupleTable {
 public:
-	TupleTable(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, const Rule& r) : dims(dims), lengths(lengths) {
+	// Nodes come from pool, which is shared by the tables of a classifier
+	TupleTable(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, const Rule& r, cmap_node_pool& pool) : pool(&pool), dims(dims), lengths(lengths) {
 		for (int w : lengths) {
 			tuple.push_back(w);
 		}
 		cmap_init(&map_in_tuple);
 		Insertion(r);
 	}
+	// With all of its rules at once, as a classifier is constructed
+	TupleTable(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, const std::vector<Rule>& rl, cmap_node_pool& pool) : pool(&pool), dims(dims), lengths(lengths) {
+		for (int w : lengths) {
+			tuple.push_back(w);
+		}
+		cmap_init(&map_in_tuple);
+		Insertion(rl);
+	}
 	//~TupleTable() { Destroy(); }
 	void Destroy() {
+		cmap_cursor cursor = cmap_cursor_start(&map_in_tuple);
+		while (cursor.node != nullptr) {
+			cmap_node * node = cursor.node;
+			cmap_cursor_advance(&cursor);
+			delete node;
+		}
 		cmap_destroy(&map_in_tuple);
 	}
 
@@ -49,14 +64,16 @@ public:
 
 	int ClassifyAPacket(const Packet& p);
 	void Insertion(const Rule& r);
+	void Insertion(const std::vector<Rule>& rl);
 	void Deletion(const Rule& r);
 	int WorstAccesses() const;
 	int NumRules() const  {
 		return cmap_count(&map_in_tuple);
 	//	return  table.size();
 	}
-	Memory MemSizeBytes(Memory ruleSizeBytes) const {
-		return 	cmap_count(&map_in_tuple)* ruleSizeBytes + cmap_array_size(&map_in_tuple) * POINTER_SIZE_BYTES;
+	// Not counting the nodes, which the classifier counts with its pool
+	Memory MemSizeBytes() const {
+		return cmap_memory_size(&map_in_tuple);
 		//return table.size() * ruleSizeBytes + table.bucket_count() * POINTER_SIZE_BYTES;
 	}
 
@@ -68,6 +85,7 @@ protected:
 	unsigned int inline HashRule(const Rule& r) const;
 	unsigned int inline HashPacket(const Packet& p) const;
 	cmap map_in_tuple;
+	cmap_node_pool* pool;
 	//std::unordered_map<uint32_t, std::vector<Rule>> table;
 
 	std::vector<int> dims;
@@ -77,10 +95,16 @@ protected:
 
 struct PriorityTuple : public TupleTable {
 public:
-	PriorityTuple(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, const Rule& r) :TupleTable(dims, lengths, r){
+	PriorityTuple(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, const Rule& r, cmap_node_pool& pool) :TupleTable(dims, lengths, r, pool){
 		maxPriority = r.priority;
 		priority_container.insert(maxPriority);
 	}
+	PriorityTuple(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, const std::vector<Rule>& rl, cmap_node_pool& pool) :TupleTable(dims, lengths, rl, pool){
+		for (const Rule& r : rl) {
+			priority_container.insert(r.priority);
+		}
+		maxPriority = *priority_container.rbegin();
+	}
 	void Insertion(const Rule& r, bool& priority_change);
 	void Deletion(const Rule& r, bool& priority_change);
 
@@ -109,13 +133,12 @@ public:
 	}
 	virtual int WorstAccesses() const;
 	Memory MemSizeBytes() const {
-		int ruleSizeBytes = 19; // TODO variables sizes
 		int sizeBytes = 0;
 		for (auto& pair : all_tuples) {
-			sizeBytes += pair.second.MemSizeBytes(ruleSizeBytes);
+			sizeBytes += pair.second.MemSizeBytes();
 		}
 		int lookupSizeBytes = (all_tuples.bucket_count() + all_tuples.size()) * POINTER_SIZE_BYTES;
-		return sizeBytes + lookupSizeBytes;
+		return sizeBytes + lookupSizeBytes + pool.memory_size();
 	}
 	void PlotTupleDistribution() {
 
@@ -150,6 +173,15 @@ public:
 		return 0; //tables[index]->MaxPriority(); // TODO : assign some order
 	}
 protected:
+	// Adds the table for the tuple 'key', made from all of its rules at once
+	virtual void InsertTuple(uint64_t key, const std::vector<Rule>& rl);
+	std::vector<unsigned int> TupleLengths(const Rule& r) const {
+		std::vector<unsigned int> lengths;
+		for (int d : dims) {
+			lengths.push_back(r.prefix_length[d]);
+		}
+		return lengths;
+	}
 	uint64_t inline KeyRulePrefix(const Rule& r) {
 		int key = 0;
 		for (int d : dims) {
@@ -158,6 +190,7 @@ protected:
 		}
 		return key;
 	}
+	cmap_node_pool pool; // Nodes of all the tables
 	std::unordered_map<uint64_t, TupleTable> all_tuples;
 	//maintain rules for monitoring purpose
 	std::vector<Rule> rules;
@@ -175,11 +208,11 @@ public:
 		int ruleSizeBytes = 19; // TODO variables sizes
 		int sizeBytes = 0;
 		for (auto& tuple : priority_tuples_vector) {
-			sizeBytes += tuple->MemSizeBytes(ruleSizeBytes);
+			sizeBytes += tuple->MemSizeBytes();
 		}
 		int lookupSizeBytes = (all_priority_tuples.bucket_count() + all_priority_tuples.size()) * POINTER_SIZE_BYTES;
 		int arraySize = priority_tuples_vector.size() * POINTER_SIZE_BYTES;
-		return sizeBytes + rules.size()*ruleSizeBytes + lookupSizeBytes + arraySize;
+		return sizeBytes + rules.size()*ruleSizeBytes + lookupSizeBytes + arraySize + pool.memory_size();
 	}
 
 	int GetNumberOfTuples() const {
@@ -211,6 +244,8 @@ public:
 	size_t PriorityOfTable(size_t index) const {
 		return priority_tuples_vector[index]->maxPriority;
 	}
+protected:
+	void InsertTuple(uint64_t key, const std::vector<Rule>& rl);
 private:
 	void RetainInvaraintOfPriorityVector() {
 		std::sort(begin(priority_tuples_vector), end(priority_tuples_vector), []( PriorityTuple * lhs,  PriorityTuple * rhs) { return lhs->maxPriority > rhs->maxPriority; });
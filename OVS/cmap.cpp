@@ -85,9 +85,16 @@ size_t cache_line_size() {
 //#include <config.h>
 #include "cmap.h"
 #include "hash.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
-//#include "ovs-rcu.h"
+#include <vector>
+#include "ovs-rcu.h"
 #include "random.h"
+#include "../Utilities/HugePages.h"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 
 //#include "util.h"
@@ -156,6 +163,27 @@ size_t cache_line_size() {
 * this large.
 *
 *
+* Rehashing
+* =========
+*
+* Growing or shrinking the table, the writer does not move every node at
+* once, which would stall the update that crossed the threshold for as long
+* as the table is big.  Instead it publishes a new, empty impl that points
+* back at the old one, and every later insertion or removal moves the chains
+* of a few more old buckets across, until the old impl is empty and can go.
+* Meanwhile each chain is in exactly one of the two impls: new hash values go
+* into the new one, and updates to a chain still in the old one are made
+* there.
+*
+* A chain is moved by adding it to the new impl, then clearing its old slot,
+* so a reader that searches the old impl first and the new one second cannot
+* miss it.  Readers that found the old impl through 'cmap->impl' before the
+* new one was published search only the old one, so nothing leaves it until
+* they have all quiesced (see ovsrcu_grace_start()).  If the new impl fills
+* up, or cannot make room for a chain, before the move is done, the writer
+* falls back to rehashing everything into a third impl at once.
+*
+*
 * Handling Duplicates
 * ===================
 *
@@ -201,42 +229,18 @@ size_t cache_line_size() {
 /* Pad to make a bucket a full cache line in size: 4 on 32-bit, 0 on 64-bit. */
 #define CMAP_PADDING ((CACHE_LINE_SIZE - 4) - (CMAP_K * CMAP_ENTRY_SIZE))
 
+#define OVS_PREFETCH(ADDR) __builtin_prefetch(ADDR)
+
 #define MAX(a,b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
-static inline int
-raw_ctz(uint64_t n)
-{
-#ifdef _WIN64
-	unsigned long r = 0;
-	_BitScanForward64(&r, n);
-	return r;
-#elif defined(__linux__)
-	return __builtin_ctzll(n);
-#else
-	unsigned long low = n, high, r = 0;
-	if (_BitScanForward(&r, low)) {
-		return r;
-	}
-	high = n >> 32;
-	_BitScanForward(&r, high);
-	return r + 32;
-#endif
-}
-
 //#define MEM_ALIGN MAX(sizeof(void *), 8)
 //sizeof(void *) = 4 in Sorrachai's machine
 #define MEM_ALIGN 8
 #define DIV_ROUND_UP(X, Y) (((X) + ((Y) - 1)) / (Y))
 #define ROUND_UP(X, Y) (DIV_ROUND_UP(X, Y) * (Y))
-static inline uintmax_t
-	zero_rightmost_1bit(uintmax_t x)
-	{
-		    return x & (x - 1);
-		}
-
 void *
 xmalloc(size_t size)
 {
@@ -246,61 +250,31 @@ xmalloc(size_t size)
 	}
 	return p;
 }
-/* Like xmalloc_cacheline() but clears the allocated memory to all zero
-* bytes. */
+static void *xmalloc_cacheline__(size_t size, bool zero);
+
 void *
 xmalloc_cacheline(size_t size)
 {
-#ifdef HAVE_POSIX_MEMALIGN
-	void *p;
-	int error;
-
-	COVERAGE_INC(util_xalloc);
-	error = posix_memalign(&p, CACHE_LINE_SIZE, size ? size : 1);
-	if (error != 0) {
-		out_of_memory();
-	}
-	return p;
-#else
-	void **payload;
-	void *base;
-
-	/* Allocate room for:
-	*
-	*     - Up to CACHE_LINE_SIZE - 1 bytes before the payload, so that the
-	*       start of the payload doesn't potentially share a cache line.
-	*
-	*     - A payload consisting of a void *, followed by padding out to
-	*       MEM_ALIGN bytes, followed by 'size' bytes of user data.
-	*
-	*     - Space following the payload up to the end of the cache line, so
-	*       that the end of the payload doesn't potentially share a cache line
-	*       with some following block. */
-	base = xmalloc((CACHE_LINE_SIZE - 1) + ROUND_UP(MEM_ALIGN + size, CACHE_LINE_SIZE));
-
-	/* Locate the payload and store a pointer to the base at the beginning. */
-	payload = (void **)ROUND_UP((uintptr_t)base, CACHE_LINE_SIZE);
-	*payload = base;
-
-	return (char *)payload + MEM_ALIGN;
-#endif
+	return xmalloc_cacheline__(size, false);
 }
-/* More efficient access to a map of single ullong. */
-#define ULLONG_FOR_EACH_1(IDX, MAP)                 \
-    for (uint64_t map__ = (MAP);                    \
-         map__ && (((IDX) = raw_ctz(map__)), true); \
-         map__ = zero_rightmost_1bit(map__))
-
-#define ULLONG_SET0(MAP, OFFSET) ((MAP) &= ~(1ULL << (OFFSET)))
-#define ULLONG_SET1(MAP, OFFSET) ((MAP) |= 1ULL << (OFFSET))
-
 
+/* Like xmalloc_cacheline() but clears the allocated memory to all zero
+* bytes.  Big blocks come from calloc(), which gets them already zeroed from
+* the system, so that creating a big cmap_impl does not have to touch it
+* all. */
 void *
 xzalloc_cacheline(size_t size)
 {
-	void *p = xmalloc_cacheline(size);
-	memset(p, 0, size);
-	return p;
+	return xmalloc_cacheline__(size, true);
+}
+
+/* The blocks come from HugePages: on huge pages when the page policy asks for
+* them, otherwise from the heap with a cache line of bookkeeping in front, so
+* that the payload starts on a cache line of its own. */
+static void *
+xmalloc_cacheline__(size_t size, bool zero)
+{
+	return HugePages::Allocate(size, zero);
 }
 
 
@@ -308,7 +282,7 @@ xzalloc_cacheline(size_t size)
 * line long. */
 struct cmap_bucket {
 
-	uint32_t counter;
+	std::atomic<uint32_t> counter;
 
 	/* (hash, node) slots.  They are parallel arrays instead of an array of
 	* structs to reduce the amount of space lost to padding.
@@ -316,14 +290,16 @@ struct cmap_bucket {
 	* The slots are in no particular order.  A null pointer indicates that a
 	* pair is unused.  In-use slots are not necessarily in the earliest
 	* slots. */
-	uint32_t hashes[CMAP_K];
-	struct cmap_node nodes[CMAP_K];
+	std::atomic<uint32_t> hashes[CMAP_K];
+	std::atomic<struct cmap_node *> nodes[CMAP_K];
 
 	/* Padding to make cmap_bucket exactly one cache line long. */
 #if CMAP_PADDING > 0
 	uint8_t pad[CMAP_PADDING];
 #endif
 };
+static_assert(sizeof(struct cmap_bucket) == CACHE_LINE_SIZE,
+			  "atomics must not change the bucket layout");
 
 
 /* Default maximum load factor (as a fraction of UINT32_MAX + 1) before
@@ -339,33 +315,43 @@ struct cmap_bucket {
 void
 free_cacheline(void *p)
 {
-#ifdef HAVE_POSIX_MEMALIGN
-	free(p);
-#else
-	if (p) {
-		free(*(void **)((uintptr_t)p - MEM_ALIGN));
-	}
-#endif
+	HugePages::Free(p);
 }
 
 
 
+/* Old buckets whose chains each insertion or removal moves to the new impl
+* while a rehash is under way (see "Rehashing" above).  Shrinking, the new
+* impl has half as many buckets and may take as many insertions as there
+* are old buckets before it fills, so four per update leaves ample room. */
+#define CMAP_MIGRATE_STEP 4
+
 /* The implementation of a concurrent hash map. */
 struct cmap_impl {
-	unsigned int n;             /* Number of in-use elements. */
+	std::atomic<unsigned int> n; /* Number of in-use elements. */
 	unsigned int max_n;         /* Max elements before enlarging. */
 	unsigned int min_n;         /* Min elements before shrinking. */
 	uint32_t mask;              /* Number of 'buckets', minus one. */
 	uint32_t basis;             /* Basis for rehashing client's hash values. */
 
+	/* While a rehash is under way, the impl being emptied into this one,
+	* otherwise null.  Its buckets below 'migrated' have been moved.  Nothing
+	* leaves it before ovsrcu_grace_expired('grace'), and 'grace' is 0 once
+	* it has. */
+	uint32_t migrated;
+	std::atomic<struct cmap_impl *> old;
+	uint64_t grace;
+
 	/* Padding to make cmap_impl exactly one cache line long. */
-	uint8_t pad[CACHE_LINE_SIZE - sizeof(unsigned int) * 5];
+	uint8_t pad[CACHE_LINE_SIZE - sizeof(unsigned int) * 6 - sizeof(void *) - sizeof(uint64_t)];
 
 	struct cmap_bucket  buckets[];
 };
 
 
 static struct cmap_impl *cmap_rehash(struct cmap *, uint32_t mask);
+static struct cmap_impl *cmap_resize(struct cmap *, uint32_t mask);
+static void cmap_migrate(struct cmap *);
 
 /* Explicit inline keywords in utility functions seem to be necessary
 * to prevent performance regression on cmap_find(). */
@@ -387,11 +373,68 @@ rehash(const struct cmap_impl *impl, uint32_t hash)
 	return hash_finish(impl->basis, hash);
 }
 
-/* Not always without the inline keyword. */
+/* Accesses to the fields that readers share with the writer.
+*
+* Bucket slots are the usual seqlock recipe for C++ atomics: readers load them
+* relaxed between the acquire fences of read_counter() and counter_changed(),
+* which pair with the release fences in cmap_set_bucket().  Pointers that are
+* followed with no counter to check (the impl, the old impl, a slot taken
+* over without touching the counter, a chain's 'next') are published with
+* cmap_publish() and loaded with cmap_follow().  Everything else, including
+* the writer's reads of what only it changes, is relaxed. */
+template <class T>
+static inline T
+cmap_read(const std::atomic<T>& field)
+{
+	return field.load(std::memory_order_relaxed);
+}
+
+template <class T>
+static inline void
+cmap_write(std::atomic<T>& field, T value)
+{
+	field.store(value, std::memory_order_relaxed);
+}
+
+template <class T>
+static inline void
+cmap_publish(std::atomic<T>& field, T value)
+{
+	field.store(value, std::memory_order_release);
+}
+
+template <class T>
+static inline T
+cmap_follow(const std::atomic<T>& field)
+{
+	return field.load(std::memory_order_acquire);
+}
+
+/* Pairs with cmap_publish() in cmap_rehash() and cmap_resize(), so that the
+* buckets of a freshly published impl are seen fully built. */
 static inline struct cmap_impl *
 cmap_get_impl(const struct cmap *cmap)
 {
-	return cmap->impl;
+	return cmap_follow(cmap->impl);
+}
+
+/* The impl that 'impl' is still taking chains from, if any.  Pairs with
+* cmap_publish() in cmap_migrate(), so that a reader that sees the move
+* finished also sees every chain in the new impl. */
+static inline struct cmap_impl *
+cmap_get_old(const struct cmap_impl *impl)
+{
+	return cmap_follow(impl->old);
+}
+
+/* Only the writer changes the count, but anyone may read it. */
+static inline unsigned int
+cmap_add_n(struct cmap_impl *impl, int delta)
+{
+	unsigned int n = cmap_read(impl->n) + delta;
+
+	cmap_write(impl->n, n);
+	return n;
 }
 
 static uint32_t
@@ -416,20 +459,43 @@ cmap_impl_create(uint32_t mask)
 	impl = (struct cmap_impl *)xzalloc_cacheline(sizeof *impl
 							 + (mask + 1) * sizeof *impl->buckets);
 	
-	impl->n = 0;
+	cmap_write(impl->n, 0u);
 	impl->max_n = calc_max_n(mask);
 	impl->min_n = calc_min_n(mask);
 	impl->mask = mask;
 	impl->basis = random_uint32();
+	impl->migrated = 0;
+	cmap_write(impl->old, (struct cmap_impl *) nullptr);
+	impl->grace = 0;
 
 	return impl;
 }
 
+/* The smallest mask whose impl holds 'n' nodes without growing. */
+static uint32_t
+cmap_capacity_mask(size_t n)
+{
+	uint32_t mask = 0;
+
+	while (calc_max_n(mask) < n) {
+		mask = (mask << 1) | 1;
+	}
+	return mask;
+}
+
 /* Initializes 'cmap' as an empty concurrent hash map. */
 void
 cmap_init(struct cmap *cmap)
 {
-	cmap->impl = cmap_impl_create(0);
+	cmap_publish(cmap->impl, cmap_impl_create(0));
+}
+
+/* Initializes 'cmap' as an empty concurrent hash map with room for
+* 'capacity' nodes, so that inserting that many never has to rehash. */
+void
+cmap_init_with_capacity(struct cmap *cmap, size_t capacity)
+{
+	cmap_publish(cmap->impl, cmap_impl_create(cmap_capacity_mask(capacity)));
 }
 
 /* Destroys 'cmap'.
@@ -440,7 +506,10 @@ void
 cmap_destroy(struct cmap *cmap)
 {
 	if (cmap) {
-		free_cacheline(cmap_get_impl(cmap));
+		struct cmap_impl *impl = cmap_get_impl(cmap);
+
+		free_cacheline(cmap_read(impl->old));
+		free_cacheline(impl);
 	}
 }
 
@@ -448,7 +517,7 @@ cmap_destroy(struct cmap *cmap)
 size_t
 cmap_count(const struct cmap *cmap)
 {
-	return cmap_get_impl(cmap)->n;
+	return cmap_read(cmap_get_impl(cmap)->n);
 }
 
 /* Returns true if 'cmap' is empty, false otherwise. */
@@ -461,7 +530,11 @@ cmap_is_empty(const struct cmap *cmap)
 static inline uint32_t
 read_counter(const struct cmap_bucket *bucket_)
 {
-	return bucket_->counter;
+	uint32_t counter = cmap_read(bucket_->counter);
+
+	/* The reads of the bucket's slots must not move up before this. */
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return counter;
 }
 
 static inline uint32_t
@@ -479,53 +552,94 @@ read_even_counter(const struct cmap_bucket *bucket)
 static inline bool
 counter_changed(const struct cmap_bucket *b_, uint32_t c)
 {
-	struct cmap_bucket *b = (struct cmap_bucket *) b_;
-	uint32_t counter = b->counter;
-
 	/* Need to make sure the counter read is not moved up, before the hash and
 	* cmap_node_next().  Using atomic_read_explicit with memory_order_acquire
 	* would allow prior reads to be moved after the barrier.
 	* atomic_thread_fence prevents all following memory accesses from moving
-	* prior to preceding loads. 
-	atomic_thread_fence(memory_order_acquire);
-	atomic_read_relaxed(&b->counter, &counter*/
-	return counter != c;
+	* prior to preceding loads. */
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return cmap_read(b_->counter) != c;
 }
 
-static inline  struct cmap_node *
-cmap_find_in_bucket(const struct cmap_bucket *bucket, uint32_t hash)
+/* Returns a bitmap of the slots of 'bucket' whose hash is 'hash'.
+*
+* The counter and the CMAP_K hashes are the first 4 * (CMAP_K + 1) bytes of
+* the bucket, so with CMAP_K < 8 all of them fit in one 32-byte compare (two
+* 16-byte ones with plain SSE2).  Lane 0 is the counter and is shifted out.
+* The loads are ordered by the fences in read_counter() and counter_changed()
+* like the cmap_read()s they replace. */
+#if CMAP_K >= 8
+#error "cmap_bucket_match() assumes the hashes fit in 32 bytes"
+#endif
+static inline uint32_t
+cmap_bucket_match(const struct cmap_bucket *bucket, uint32_t hash)
 {
+	uint32_t m;
+
+#if defined(__AVX2__)
+	__m256i h = _mm256_set1_epi32(hash);
+	__m256i v = _mm256_loadu_si256((const __m256i *) bucket);
+
+	m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, h)));
+#elif defined(__SSE2__)
+	__m128i h = _mm_set1_epi32(hash);
+	__m128i lo = _mm_loadu_si128((const __m128i *) bucket);
+	__m128i hi = _mm_loadu_si128((const __m128i *) bucket + 1);
+
+	m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lo, h)))
+		| _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hi, h))) << 4;
+#else
+	m = 0;
 	for (int i = 0; i < CMAP_K; i++) {
-		if (bucket->hashes[i] == hash) {
-			return bucket->nodes[i].next;
+		m |= (uint32_t) (cmap_read(bucket->hashes[i]) == hash) << (i + 1);
+	}
+#endif
+	return (m >> 1) & ((1u << CMAP_K) - 1);
+}
+
+/* Returns the first node in the slots of 'match' in 'bucket'.  A slot whose
+* node has been removed keeps its hash, so a match may be empty. */
+static inline struct cmap_node *
+cmap_bucket_node(const struct cmap_bucket *bucket, uint32_t match)
+{
+	for (; match; match &= match - 1) {
+		struct cmap_node *node = cmap_read(bucket->nodes[raw_ctz(match)]);
+
+		if (node) {
+			return node;
 		}
 	}
 	return NULL;
 }
 
+static inline  struct cmap_node *
+cmap_find_in_bucket(const struct cmap_bucket *bucket, uint32_t hash)
+{
+	return cmap_bucket_node(bucket, cmap_bucket_match(bucket, hash));
+}
+
+/* Looks in both buckets at once: a miss, the common case for a tuple table,
+* needs both cache lines anyway, and fetching them together lets their
+* misses overlap.  Stable counters on both around the one scan give a
+* consistent view of the pair. */
 static inline  struct cmap_node *
 cmap_find__(const struct cmap_bucket *b1, const struct cmap_bucket *b2,
 uint32_t hash)
 {
 	uint32_t c1, c2;
-	 struct cmap_node *node;
+	struct cmap_node *node;
 
 	do {
-		do {
-			c1 = read_even_counter(b1);
-			node = cmap_find_in_bucket(b1, hash);
-		} while (counter_changed(b1, c1));
-		if (node) {
-			break;
-		}
-		do {
-			c2 = read_even_counter(b2);
-			node = cmap_find_in_bucket(b2, hash);
-		} while (counter_changed(b2, c2));
-		if (node) {
-			break;
+		c1 = read_even_counter(b1);
+		c2 = read_even_counter(b2);
+		uint32_t m1 = cmap_bucket_match(b1, hash);
+		uint32_t m2 = cmap_bucket_match(b2, hash);
+
+		node = cmap_bucket_node(b1, m1);
+		if (!node) {
+			node = cmap_bucket_node(b2, m2);
 		}
-	} while (counter_changed(b1, c1));
+	} while (counter_changed(b1, c1) || counter_changed(b2, c2));
 
 	return node;
 }
@@ -539,12 +653,9 @@ uint32_t hash)
 * not changing, then cmap_find_protected() is slightly faster.
 *
 * CMAP_FOR_EACH_WITH_HASH is usually more convenient. */
-struct cmap_node *
-cmap_find(const struct cmap *cmap, uint32_t hash)
+static inline struct cmap_node *
+cmap_find_in_impl(const struct cmap_impl *impl, uint32_t hash)
 {
-
-	
-	const struct cmap_impl *impl = cmap_get_impl(cmap);
 	uint32_t h1 = rehash(impl, hash);
 	uint32_t h2 = other_hash(h1);
 
@@ -553,6 +664,29 @@ cmap_find(const struct cmap *cmap, uint32_t hash)
 					   hash);
 }
 
+/* While a rehash is under way: the old impl first, as chains only ever move
+* from it to the new one. */
+static struct cmap_node *
+cmap_find_migrating(const struct cmap_impl *impl, const struct cmap_impl *old,
+uint32_t hash)
+{
+	struct cmap_node *node = cmap_find_in_impl(old, hash);
+
+	return node ? node : cmap_find_in_impl(impl, hash);
+}
+
+struct cmap_node *
+cmap_find(const struct cmap *cmap, uint32_t hash)
+{
+	const struct cmap_impl *impl = cmap_get_impl(cmap);
+	const struct cmap_impl *old = cmap_get_old(impl);
+
+	if (old) {
+		return cmap_find_migrating(impl, old, hash);
+	}
+	return cmap_find_in_impl(impl, hash);
+}
+
 /* Looks up multiple 'hashes', when the corresponding bit in 'map' is 1,
 * and sets the corresponding pointer in 'nodes', if the hash value was
 * found from the 'cmap'.  In other cases the 'nodes' values are not changed,
@@ -568,8 +702,24 @@ cmap_find_batch(const struct cmap *cmap, unsigned long map,
 uint32_t hashes[], const struct cmap_node *nodes[])
 {
 	const struct cmap_impl *impl = cmap_get_impl(cmap);
+	const struct cmap_impl *old = cmap_get_old(impl);
 	unsigned long result = map;
 	int i;
+
+	if (old) {
+		/* Rare enough not to be worth prefetching for. */
+		ULLONG_FOR_EACH_1(i, map) {
+			const struct cmap_node *node = cmap_find_migrating(impl, old, hashes[i]);
+
+			if (node) {
+				nodes[i] = node;
+			} else {
+				ULLONG_SET0(result, i);
+			}
+		}
+		return result;
+	}
+
 	uint32_t h1s[sizeof map * CHAR_BIT];
 	const struct cmap_bucket *b1s[sizeof map * CHAR_BIT];
 	const struct cmap_bucket *b2s[sizeof map * CHAR_BIT];
@@ -579,6 +729,7 @@ uint32_t hashes[], const struct cmap_node *nodes[])
 	ULLONG_FOR_EACH_1(i, map) {
 		h1s[i] = rehash(impl, hashes[i]);
 		b1s[i] = &impl->buckets[h1s[i] & impl->mask];
+		OVS_PREFETCH(b1s[i]);
 	}
 	/* Lookups, Round 1. Only look up at the first bucket. */
 	ULLONG_FOR_EACH_1(i, map) {
@@ -594,7 +745,7 @@ uint32_t hashes[], const struct cmap_node *nodes[])
 		if (!node) {
 			/* Not found (yet); Prefetch the 2nd bucket. */
 			b2s[i] = &impl->buckets[other_hash(h1s[i]) & impl->mask];
-	
+			OVS_PREFETCH(b2s[i]);
 			c1s[i] = c1; /* We may need to check this after Round 2. */
 			continue;
 		}
@@ -645,7 +796,7 @@ cmap_find_slot_protected(struct cmap_bucket *b, uint32_t hash)
 	int i;
 
 	for (i = 0; i < CMAP_K; i++) {
-		if (b->hashes[i] == hash && b->nodes[i].next) {
+		if (cmap_read(b->hashes[i]) == hash && cmap_read(b->nodes[i])) {
 			return i;
 		}
 	}
@@ -655,26 +806,19 @@ cmap_find_slot_protected(struct cmap_bucket *b, uint32_t hash)
 static struct cmap_node *
 cmap_find_bucket_protected(struct cmap_impl *impl, uint32_t hash, uint32_t h)
 {
-	struct cmap_bucket *b = &impl->buckets[h & impl->mask];
-	int i;
+	const struct cmap_bucket *b = &impl->buckets[h & impl->mask];
 
-	for (i = 0; i < CMAP_K; i++) {
-		if (b->hashes[i] == hash) {
-			return b->nodes[i].next;
-		}
-	}
-	return NULL;
+	return cmap_bucket_node(b, cmap_bucket_match(b, hash));
 }
 
 /* Like cmap_find(), but only for use if 'cmap' cannot change concurrently.
 *
 * CMAP_FOR_EACH_WITH_HASH_PROTECTED is usually more convenient. */
-struct cmap_node *
-	cmap_find_protected(const struct cmap *cmap, uint32_t hash)
+static struct cmap_node *
+cmap_find_impl_protected(struct cmap_impl *impl, uint32_t hash)
 {
-	struct cmap_impl *impl = cmap_get_impl(cmap);
 	uint32_t h1 = rehash(impl, hash);
-	uint32_t h2 = other_hash(hash);
+	uint32_t h2 = other_hash(h1);
 	struct cmap_node *node;
 
 	node = cmap_find_bucket_protected(impl, hash, h1);
@@ -684,13 +828,23 @@ struct cmap_node *
 	return cmap_find_bucket_protected(impl, hash, h2);
 }
 
+struct cmap_node *
+	cmap_find_protected(const struct cmap *cmap, uint32_t hash)
+{
+	struct cmap_impl *impl = cmap_get_impl(cmap);
+	struct cmap_impl *old = cmap_read(impl->old);
+	struct cmap_node *node = old ? cmap_find_impl_protected(old, hash) : nullptr;
+
+	return node ? node : cmap_find_impl_protected(impl, hash);
+}
+
 static int
 cmap_find_empty_slot_protected(const struct cmap_bucket *b)
 {
 	int i;
 
 	for (i = 0; i < CMAP_K; i++) {
-		if (!b->nodes[i].next) {
+		if (!cmap_read(b->nodes[i])) {
 			return i;
 		}
 	}
@@ -702,13 +856,16 @@ cmap_set_bucket(struct cmap_bucket *b, int i,
 struct cmap_node *node, uint32_t hash)
 {
 	
-	uint32_t c = b->counter;
-
-	b->counter= c + 1;
+	uint32_t c = cmap_read(b->counter);
 
-	b->nodes[i].next= node; /* Also atomic. */
-	b->hashes[i] = hash;
-	b->counter = c + 2;
+	/* An odd counter tells readers to retry; it has to be visible before
+	* either slot changes, and the even one after both have. */
+	cmap_write(b->counter, c + 1);
+	std::atomic_thread_fence(std::memory_order_release);
+	cmap_write(b->nodes[i], node);
+	cmap_write(b->hashes[i], hash);
+	std::atomic_thread_fence(std::memory_order_release);
+	cmap_write(b->counter, c + 2);
 
 }
 
@@ -722,8 +879,8 @@ struct cmap_bucket *b)
 	int i;
 
 	for (i = 0; i < CMAP_K; i++) {
-		if (b->hashes[i] == hash) {
-			struct cmap_node *node = b->nodes[i].next;
+		if (cmap_read(b->hashes[i]) == hash) {
+			struct cmap_node *node = cmap_read(b->nodes[i]);
 
 			if (node) {
 				struct cmap_node *p;
@@ -740,14 +897,14 @@ struct cmap_bucket *b)
 				* chain. */
 				p = new_node;
 				for (;;) {
-					struct cmap_node *next = p->next;
+					struct cmap_node *next = cmap_read(p->next);
 
 					if (!next) {
 						break;
 					}
 					p = next;
 				}
-				p->next = node;
+				cmap_write(p->next, node);
 			} else {
 				/* The hash value is there from some previous insertion, but
 				* the associated node has been removed.  We're not really
@@ -760,8 +917,9 @@ struct cmap_bucket *b)
 			/* Change the bucket to point to 'new_node'.  This is a degenerate
 			* form of cmap_set_bucket() that doesn't update the counter since
 			* we're only touching one field and in a way that doesn't change
-			* the bucket's meaning for readers. */
-			b->nodes[i].next = new_node;
+			* the bucket's meaning for readers, so 'new_node' has to be
+			* published on its own. */
+			cmap_publish(b->nodes[i], new_node);
 
 			return true;
 		}
@@ -780,8 +938,7 @@ struct cmap_bucket *b)
 	int i;
 
 	for (i = 0; i < CMAP_K; i++) {
-		if (!b->nodes[i].next) {
-			
+		if (!cmap_read(b->nodes[i])) {
 			cmap_set_bucket(b, i, node, hash);
 			return true;
 		}
@@ -795,7 +952,7 @@ struct cmap_bucket *b)
 static struct cmap_bucket *
 other_bucket_protected(struct cmap_impl *impl, struct cmap_bucket *b, int slot)
 {
-	uint32_t h1 = rehash(impl, b->hashes[slot]);
+	uint32_t h1 = rehash(impl, cmap_read(b->hashes[slot]));
 	uint32_t h2 = other_hash(h1);
 	uint32_t b_idx = b - impl->buckets;
 	uint32_t other_h = (h1 & impl->mask) == b_idx ? h2 : h1;
@@ -915,8 +1072,8 @@ uint32_t hash, struct cmap_bucket *b1, struct cmap_bucket *b2)
 
 					cmap_set_bucket(
 						buckets[k], slots[k],
-						buckets[k - 1]->nodes[slot].next,
-						buckets[k - 1]->hashes[slot]);
+						cmap_read(buckets[k - 1]->nodes[slot]),
+						cmap_read(buckets[k - 1]->hashes[slot]));
 				}
 
 				/* Finally, replace the first node on the path by
@@ -958,6 +1115,29 @@ cmap_try_insert(struct cmap_impl *impl, struct cmap_node *node, uint32_t hash)
 		cmap_insert_bfs(impl, node, hash, b1, b2));
 }
 
+/* While a rehash is under way, the chain for 'hash' may still be in 'old'.
+* If it is, adds the singleton 'node' to the front of it there and returns
+* true. */
+static bool
+cmap_insert_old_dup(struct cmap_impl *old, struct cmap_node *node, uint32_t hash)
+{
+	uint32_t h1 = rehash(old, hash);
+	uint32_t h2 = other_hash(h1);
+	struct cmap_bucket *buckets[2] = { &old->buckets[h1 & old->mask],
+									   &old->buckets[h2 & old->mask] };
+
+	for (struct cmap_bucket *b : buckets) {
+		int i = cmap_find_slot_protected(b, hash);
+
+		if (i >= 0) {
+			cmap_write(node->next, cmap_read(b->nodes[i]));
+			cmap_publish(b->nodes[i], node);
+			return true;
+		}
+	}
+	return false;
+}
+
 /* Inserts 'node', with the given 'hash', into 'cmap'.  The caller must ensure
 * that 'cmap' cannot change concurrently (from another thread).  If duplicates
 * are undesirable, the caller must have already verified that 'cmap' does not
@@ -967,19 +1147,143 @@ cmap_try_insert(struct cmap_impl *impl, struct cmap_node *node, uint32_t hash)
 size_t
 cmap_insert(struct cmap *cmap, struct cmap_node *node, uint32_t hash)
 {
+	cmap_migrate(cmap);
+
 	struct cmap_impl *impl = cmap_get_impl(cmap);
 
-	node->next = nullptr;
+	cmap_write(node->next, (struct cmap_node *) nullptr);
 
-	if (impl->n >= impl->max_n) {
-		impl = cmap_rehash(cmap, (impl->mask << 1) | 1);
+	if (cmap_read(impl->n) >= impl->max_n) {
+		impl = cmap_resize(cmap, (impl->mask << 1) | 1);
 	}
-	
+	struct cmap_impl *old = cmap_read(impl->old);
+	if (old && cmap_insert_old_dup(old, node, hash)) {
+		return cmap_add_n(impl, 1);
+	}
+
 	while (!cmap_try_insert(impl, node, hash)) {
-	
 		impl = cmap_rehash(cmap, impl->mask);
 	}
-	return ++impl->n;
+	return cmap_add_n(impl, 1);
+}
+
+/* Inserts 'node', with the given 'hash', into 'cmap' behind every node of its
+* chain that has a higher priority.  If all of the chains in 'cmap' were
+* already sorted by descending priority, they remain so, which lets searches
+* stop at the first matching node.  Same concurrency rules as cmap_insert().
+*
+* Returns the current number of nodes in the cmap after the insertion. */
+size_t
+cmap_insert_ordered(struct cmap *cmap, struct cmap_node *node, uint32_t hash)
+{
+	struct cmap_node *prev = cmap_find(cmap, hash);
+
+	if (!prev || prev->priority < node->priority) {
+		/* New head of the chain (or a chain of its own). */
+		return cmap_insert(cmap, node, hash);
+	}
+
+	/* Rehashing moves whole chains, so 'prev' stays valid. */
+	cmap_migrate(cmap);
+	struct cmap_impl *impl = cmap_get_impl(cmap);
+	if (cmap_read(impl->n) >= impl->max_n) {
+		impl = cmap_resize(cmap, (impl->mask << 1) | 1);
+	}
+
+	struct cmap_node *next;
+	while ((next = cmap_read(prev->next)) && next->priority >= node->priority) {
+		prev = next;
+	}
+	/* Link 'node' up before publishing it, so a concurrent reader sees
+	* either the old chain or the complete new one. */
+	cmap_write(node->next, next);
+	cmap_publish(prev->next, node);
+
+	return cmap_add_n(impl, 1);
+}
+
+/* Inserts the 'count' nodes in 'nodes', with the corresponding 'hashes', as
+* cmap_insert_ordered() would one at a time.
+*
+* Into an empty 'cmap', the nodes are linked into their chains up front and
+* placed in a new impl of the right size, which is published once built:
+* readers see either none of them or all of them, and nothing is rehashed on
+* the way.  Otherwise 'cmap' grows at most once, up front, and the nodes go
+* in one by one.
+*
+* Returns the current number of nodes in the cmap after the insertion. */
+size_t
+cmap_insert_bulk(struct cmap *cmap, struct cmap_node *nodes[],
+const uint32_t hashes[], size_t count)
+{
+	struct cmap_impl *impl = cmap_get_impl(cmap);
+	size_t n = cmap_read(impl->n);
+	uint32_t mask = std::max(cmap_capacity_mask(n + count), impl->mask);
+
+	if (!count) {
+		return n;
+	}
+	if (n) {
+		if (mask != impl->mask) {
+			cmap_rehash(cmap, mask);
+		}
+		for (size_t i = 0; i < count; i++) {
+			n = cmap_insert_ordered(cmap, nodes[i], hashes[i]);
+		}
+		return n;
+	}
+
+	/* Chains in descending priority, ties in the order given. */
+	struct bulk_entry {
+		uint32_t hash;
+		int priority;
+		size_t index;
+	};
+	std::vector<struct bulk_entry> order(count);
+	for (size_t i = 0; i < count; i++) {
+		order[i] = { hashes[i], nodes[i]->priority, i };
+	}
+	std::sort(order.begin(), order.end(), [](const bulk_entry& x, const bulk_entry& y) {
+		if (x.hash != y.hash) {
+			return x.hash < y.hash;
+		}
+		if (x.priority != y.priority) {
+			return x.priority > y.priority;
+		}
+		return x.index < y.index;
+	});
+	std::vector<size_t> heads;
+	for (size_t k = 0; k < count; k++) {
+		struct cmap_node *node = nodes[order[k].index];
+		bool last = k + 1 == count || order[k + 1].hash != order[k].hash;
+
+		cmap_write(node->next, last ? (struct cmap_node *) nullptr : nodes[order[k + 1].index]);
+		if (k == 0 || order[k - 1].hash != order[k].hash) {
+			heads.push_back(order[k].index);
+		}
+	}
+
+	struct cmap_impl *neww = cmap_impl_create(mask);
+	size_t h = 0;
+	while (h < heads.size()) {
+		if (cmap_try_insert(neww, nodes[heads[h]], hashes[heads[h]])) {
+			h++;
+		} else {
+			/* As in cmap_rehash(): start over under another basis. */
+			memset((void *) neww->buckets, 0, (mask + 1) * sizeof *neww->buckets);
+			neww->basis = random_uint32();
+			h = 0;
+		}
+	}
+	cmap_write(neww->n, (unsigned int) count);
+
+	struct cmap_impl *old = cmap_read(impl->old);
+	cmap_publish(cmap->impl, neww);
+	ovsrcu_postpone(free_cacheline, impl);
+	if (old) {
+		ovsrcu_postpone(free_cacheline, old);
+	}
+	return count;
 }
 
 static bool
@@ -997,21 +1301,21 @@ struct cmap_node *replacement, uint32_t hash, uint32_t h)
 	/* The pointer to 'node' is changed to point to 'replacement',
 	* which is the next node if no replacement node is given. */
 	if (!replacement) {
-		replacement = node->next;
+		replacement = cmap_read(node->next);
 	} else {
 		/* 'replacement' takes the position of 'node' in the list. */
-		replacement->next = node->next;
+		cmap_write(replacement->next, cmap_read(node->next));
 	}
 
-	struct cmap_node *iter = &b->nodes[slot];
+	std::atomic<struct cmap_node *> *iter = &b->nodes[slot];
 	for (;;) {
-		struct cmap_node *next = iter->next;
+		struct cmap_node *next = cmap_read(*iter);
 
 		if (next == node) {
-			iter->next = replacement;
+			cmap_publish(*iter, replacement);
 			return true;
 		}
-		iter = next;
+		iter = &next->next;
 	}
 }
 
@@ -1029,6 +1333,8 @@ size_t
 cmap_replace(struct cmap *cmap, struct cmap_node *old_node,
 struct cmap_node *new_node, uint32_t hash)
 {
+	cmap_migrate(cmap);
+
 	struct cmap_impl *impl = cmap_get_impl(cmap);
 	uint32_t h1 = rehash(impl, hash);
 	uint32_t h2 = other_hash(h1);
@@ -1036,16 +1342,24 @@ struct cmap_node *new_node, uint32_t hash)
 
 	ok = cmap_replace__(impl, old_node, new_node, hash, h1)
 		|| cmap_replace__(impl, old_node, new_node, hash, h2);
+	struct cmap_impl *old = cmap_read(impl->old);
+	if (!ok && old) {
+
+		h1 = rehash(old, hash);
+		h2 = other_hash(h1);
+		ok = cmap_replace__(old, old_node, new_node, hash, h1)
+			|| cmap_replace__(old, old_node, new_node, hash, h2);
+	}
 	//printf("ok? %d\n", ok);
 	//ovs_assert(ok);
 
 	if (!new_node) {
-		impl->n--;
-		if (impl->n < impl->min_n) {
-			impl = cmap_rehash(cmap, impl->mask >> 1);
+		/* Shrinking waits for a rehash under way to finish */
+		if (cmap_add_n(impl, -1) < impl->min_n && !old) {
+			impl = cmap_resize(cmap, impl->mask >> 1);
 		}
 	}
-	return impl->n;
+	return cmap_read(impl->n);
 }
 
 static bool
@@ -1059,9 +1373,9 @@ cmap_try_rehash(const struct cmap_impl *old, struct cmap_impl *neww)
 		for (i = 0; i < CMAP_K; i++) {
 			/* possible optimization here because we know the hashes are
 			* unique */
-			struct cmap_node *node = b->nodes[i].next;
+			struct cmap_node *node = cmap_read(b->nodes[i]);
 
-			if (node && !cmap_try_insert(neww, node, b->hashes[i])) {
+			if (node && !cmap_try_insert(neww, node, cmap_read(b->hashes[i]))) {
 				return false;
 			}
 		}
@@ -1069,33 +1383,116 @@ cmap_try_rehash(const struct cmap_impl *old, struct cmap_impl *neww)
 	return true;
 }
 
+/* Rehashes everything into a new impl at once, including what a rehash
+* under way has yet to move. */
 static struct cmap_impl *
 cmap_rehash(struct cmap *cmap, uint32_t mask)
 {
 	struct cmap_impl *old = cmap_get_impl(cmap);
+	struct cmap_impl *older = cmap_read(old->old);
 	struct cmap_impl *neww;
 
 	neww = cmap_impl_create(mask);
 	//ovs_assert(old->n < neww->max_n);
 
-	while (!cmap_try_rehash(old, neww)) {
-		memset(neww->buckets, 0, (mask + 1) * sizeof *neww->buckets);
+	while (!cmap_try_rehash(old, neww)
+		   || (older && !cmap_try_rehash(older, neww))) {
+		memset((void *) neww->buckets, 0, (mask + 1) * sizeof *neww->buckets);
 		neww->basis = random_uint32();
 	}
 
-	neww->n = old->n;
-	cmap->impl =neww;
-	free_cacheline(old);
+	cmap_write(neww->n, cmap_read(old->n));
+	cmap_publish(cmap->impl, neww);
+	/* Readers may still be searching 'old' and 'older'. */
+	ovsrcu_postpone(free_cacheline, old);
+	if (older) {
+		ovsrcu_postpone(free_cacheline, older);
+	}
 
 	return neww;
 }
 
+/* Starts moving everything into a new impl with 'mask', a few buckets per
+* update (see "Rehashing" above). */
+static struct cmap_impl *
+cmap_resize(struct cmap *cmap, uint32_t mask)
+{
+	struct cmap_impl *old = cmap_get_impl(cmap);
+	struct cmap_impl *neww;
+
+	if (cmap_read(old->old)) {
+		/* Already outgrown before the last move finished. */
+		return cmap_rehash(cmap, mask);
+	}
+
+	neww = cmap_impl_create(mask);
+	cmap_write(neww->n, cmap_read(old->n));
+	cmap_write(neww->old, old);
+	/* Readers that have just found 'old' must be done with it before any
+	* chain may leave it. */
+	neww->grace = ovsrcu_grace_start();
+	cmap_publish(cmap->impl, neww);
+
+	cmap_migrate(cmap);
+	return cmap_get_impl(cmap);
+}
+
+/* Moves the chains of the next CMAP_MIGRATE_STEP old buckets, if a rehash is
+* under way and its grace period is over. */
+static void
+cmap_migrate(struct cmap *cmap)
+{
+	struct cmap_impl *impl = cmap_get_impl(cmap);
+	struct cmap_impl *old = cmap_read(impl->old);
+
+	if (!old) {
+		return;
+	}
+	if (impl->grace) {
+		if (!ovsrcu_grace_expired(impl->grace)) {
+			return;
+		}
+		impl->grace = 0;
+	}
+
+	uint32_t end = impl->migrated + CMAP_MIGRATE_STEP;
+	for (; impl->migrated < end && impl->migrated <= old->mask; impl->migrated++) {
+		struct cmap_bucket *b = &old->buckets[impl->migrated];
+
+		for (int i = 0; i < CMAP_K; i++) {
+			struct cmap_node *node = cmap_read(b->nodes[i]);
+
+			if (!node) {
+				continue;
+			}
+			/* Into the new impl first, so that readers always find it in
+			* one or the other. */
+			if (!cmap_try_insert(impl, node, cmap_read(b->hashes[i]))) {
+				cmap_rehash(cmap, impl->mask);
+				return;
+			}
+			cmap_set_bucket(b, i, nullptr, 0);
+		}
+	}
+
+	if (impl->migrated > old->mask) {
+		cmap_publish(impl->old, (struct cmap_impl *) nullptr);
+		/* Readers may still be searching 'old'. */
+		ovsrcu_postpone(free_cacheline, old);
+	}
+}
+
 struct cmap_cursor
 	cmap_cursor_start(const struct cmap *cmap)
 {
 	struct cmap_cursor cursor;
+	const struct cmap_impl *impl = cmap_get_impl(cmap);
+	const struct cmap_impl *old = cmap_get_old(impl);
 
-	cursor.impl = cmap_get_impl(cmap);
+	/* What a rehash under way has yet to move comes first, so that a chain
+	* moved meanwhile may be visited twice but is never missed. */
+	cursor.impl = old ? old : impl;
+	cursor.next = old ? impl : nullptr;
 	cursor.bucket_idx = 0;
 	cursor.entry_idx = 0;
 	cursor.node = nullptr;
@@ -1110,23 +1507,32 @@ cmap_cursor_advance(struct cmap_cursor *cursor)
 	const struct cmap_impl *impl = cursor->impl;
 
 	if (cursor->node) {
-		cursor->node = cursor->node->next;
+		cursor->node = cmap_node_next(cursor->node);
 		if (cursor->node) {
 			return;
 		}
 	}
 
-	while (cursor->bucket_idx <= impl->mask) {
-		const struct cmap_bucket *b = &impl->buckets[cursor->bucket_idx];
+	for (;;) {
+		while (cursor->bucket_idx <= impl->mask) {
+			const struct cmap_bucket *b = &impl->buckets[cursor->bucket_idx];
 
-		while (cursor->entry_idx < CMAP_K) {
-			cursor->node = b->nodes[cursor->entry_idx++].next;
-			if (cursor->node) {
-				return;
+			while (cursor->entry_idx < CMAP_K) {
+				cursor->node = cmap_follow(b->nodes[cursor->entry_idx++]);
+				if (cursor->node) {
+					return;
+				}
 			}
-		}
 
-		cursor->bucket_idx++;
+			cursor->bucket_idx++;
+			cursor->entry_idx = 0;
+		}
+		if (!cursor->next) {
+			return;
+		}
+		impl = cursor->impl = cursor->next;
+		cursor->next = nullptr;
+		cursor->bucket_idx = 0;
 		cursor->entry_idx = 0;
 	}
 }
@@ -1144,20 +1550,25 @@ struct cmap_node *
 struct cmap_position *pos)
 {
 	struct cmap_impl *impl = cmap_get_impl(cmap);
+	struct cmap_impl *old = cmap_get_old(impl);
 	unsigned int bucket = pos->bucket;
 	unsigned int entry = pos->entry;
 	unsigned int offset = pos->offset;
+	/* As for cursors, the buckets of a rehash under way's old impl come
+	* first, numbered ahead of the new impl's. */
+	unsigned int n_old = old ? old->mask + 1 : 0;
 
-	while (bucket <= impl->mask) {
-		const struct cmap_bucket *b = &impl->buckets[bucket];
+	while (bucket < n_old + impl->mask + 1) {
+		const struct cmap_bucket *b = bucket < n_old
+			? &old->buckets[bucket] : &impl->buckets[bucket - n_old];
 
 		while (entry < CMAP_K) {
-			const struct cmap_node *node = b->nodes[entry].next;
+			const struct cmap_node *node = cmap_follow(b->nodes[entry]);
 			unsigned int i;
 
-			for (i = 0; node; i++, node = node->next) {
+			for (i = 0; node; i++, node = cmap_node_next(node)) {
 				if (i == offset) {
-					if (node->next) {
+					if (cmap_node_next(node)) {
 						offset++;
 					} else {
 						entry++;
@@ -1182,15 +1593,14 @@ struct cmap_position *pos)
 	return nullptr;
 }
 
-int cmap_largest_chain(const struct cmap* cmap) 
+static int cmap_largest_chain(const struct cmap_impl* impl)
 {
 	int longest = 0;
-	struct cmap_impl *impl = cmap_get_impl(cmap);
 
 	for (uint32_t i = 0; i <= impl->mask; i++) {
 		for (int j = 0; j < CMAP_K; j++) {
 			int chain = 0;
-			cmap_node* n = &impl->buckets[i].nodes[j];
+			cmap_node* n = cmap_follow(impl->buckets[i].nodes[j]);
 			unsigned int key = 0;
 			while (n) {
 				chain++;
@@ -1199,7 +1609,7 @@ int cmap_largest_chain(const struct cmap* cmap)
 				//}
 				//key = n->key;
 				// CHECK KEY
-				n = n->next;
+				n = cmap_node_next(n);
 			}
 			if (chain > longest) longest = chain;
 		}
@@ -1207,8 +1617,29 @@ int cmap_largest_chain(const struct cmap* cmap)
 	return longest;
 }
 
+int cmap_largest_chain(const struct cmap* cmap)
+{
+	struct cmap_impl *impl = cmap_get_impl(cmap);
+	struct cmap_impl *old = cmap_get_old(impl);
+	int longest = cmap_largest_chain(impl);
+
+	return old ? std::max(longest, cmap_largest_chain(old)) : longest;
+}
+
 int cmap_array_size(const struct cmap* cmap)
 {
 	struct cmap_impl *impl = cmap_get_impl(cmap);
 	return impl->mask + 1;
 }
+
+size_t cmap_memory_size(const struct cmap* cmap)
+{
+	struct cmap_impl *impl = cmap_get_impl(cmap);
+	struct cmap_impl *old = cmap_get_old(impl);
+	size_t size = sizeof *impl + (impl->mask + 1) * sizeof *impl->buckets;
+
+	if (old) {
+		size += sizeof *old + (old->mask + 1) * sizeof *old->buckets;
+	}
+	return size;
+}
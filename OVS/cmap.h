@@ -19,9 +19,12 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
+#include <atomic>
 #include "hash.h"
 #include "../ElementaryClasses.h"
-#include <memory>
+#include "../Utilities/MatchKernel.h"
+#include "../Utilities/SlabPool.h"
 
 /* Concurrent hash map
 * ===================
@@ -53,6 +56,13 @@
 * includes inserting the element back into its original cmap or a different
 * one.  One correct way to do this is to free them from an RCU callback with
 * ovsrcu_postpone().
+*
+* Everything that readers share with the writer (the impl pointer, the bucket
+* counters, hashes and node pointers, and the nodes' 'next' pointers) is a
+* std::atomic.  The writer publishes a node, a chain or an impl with a release
+* store (or a release fence ahead of a relaxed store) only once it is fully
+* built, and readers load what they will follow with acquire ordering, so a
+* reader never sees a half-made node or bucket array.
 */
 
 /* Given a pointer-typed lvalue OBJECT, expands to a pointer type that may be
@@ -115,41 +125,85 @@ the STRUCT object. */
     ((OBJECT) = NULL, ASSIGN_CONTAINER(OBJECT, POINTER, MEMBER))
 
 
+/* Alignment of a cmap_node: one cache line. */
+#define CMAP_NODE_ALIGN 64
+
 /* A concurrent hash map node, to be embedded inside the data structure being
 * mapped.
 *
-* All nodes linked together on a chain have exactly the same hash value. */
-struct cmap_node {
-	
-	cmap_node(unsigned int key) : key(key), next(nullptr) {  }
-	cmap_node(const Rule& r) : priority(r.priority), rule_ptr(std::make_shared<Rule>(r)), next(nullptr){ }
-	unsigned int key;
-	int priority;
-	std::shared_ptr<Rule> rule_ptr;
-	struct cmap_node * next; /* Next node with same hash. */
+* All nodes linked together on a chain have exactly the same hash value.
+*
+* The node carries a compact copy of its rule (the low and high end of every
+* field plus the priority, 44 bytes for 5 fields) so that testing a packet
+* against a candidate touches only the node's own cache line.  The full rule
+* is kept on the side for callers that need to hand rules back.
+*
+* Nodes and their rules come from a cmap_node_pool (below); plain 'delete'
+* gives both back to it, from any thread. */
+struct alignas(CMAP_NODE_ALIGN) cmap_node : public MatchRecord {
+
+	cmap_node(const Rule& r, SlabPool& rules) : MatchRecord(r), next(nullptr), rule_ptr(new (rules.Allocate()) Rule(r)) { }
+	~cmap_node() {
+		rule_ptr->~Rule();
+		SlabPool::Release(rule_ptr);
+	}
+	cmap_node(const cmap_node&) = delete;
+	cmap_node& operator=(const cmap_node&) = delete;
+
+	static void* operator new(size_t size, SlabPool& nodes) { return nodes.Allocate(); }
+	static void operator delete(void* p, SlabPool& nodes) { SlabPool::Release(p); }
+	static void operator delete(void* p) { SlabPool::Release(p); }
+
+	bool MatchesPacket(const Packet& p) const {
+		return MatchKernel::Matches(p, *this);
+	}
+
+	std::atomic<struct cmap_node *> next; /* Next node with same hash. */
+	Rule* rule_ptr;          /* Owned copy of the full rule. */
+};
+
+/* Where the nodes of one classifier's tables live.  Nodes are packed
+* together in their own slabs, away from the full rules, which lookups seldom
+* touch, and blocks freed by deletions are reused by later insertions.  Only
+* one thread may make nodes at a time.  The pool must outlive its nodes. */
+struct cmap_node_pool {
+	SlabPool nodes{ sizeof(cmap_node), alignof(cmap_node) };
+	SlabPool rules{ sizeof(Rule), alignof(Rule) };
+
+	cmap_node *make(const Rule& r) { return new (nodes) cmap_node(r, rules); }
+	size_t memory_size() const { return nodes.MemSizeBytes() + rules.MemSizeBytes(); }
 };
 
 
 static inline struct cmap_node *
 cmap_node_next(const struct cmap_node *node)
 {
-	return node->next;
+	return node->next.load(std::memory_order_acquire);
 }
 
 static inline struct cmap_node *
 cmap_node_next_protected(const struct cmap_node *node)
 {
-	return node->next;
+	return node->next.load(std::memory_order_relaxed);
 }
 
 /* Concurrent hash map. */
 
 struct cmap {
-	struct cmap_impl * impl;
+	cmap() = default;
+	/* Copies share the impl, and only one of them may be destroyed. */
+	cmap(const cmap& other) : impl(other.impl.load(std::memory_order_relaxed)) { }
+	cmap& operator=(const cmap& other) {
+		impl.store(other.impl.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		return *this;
+	}
+
+	std::atomic<struct cmap_impl *> impl;
 };
 
 /* Initialization. */
 void cmap_init(struct cmap *);
+void cmap_init_with_capacity(struct cmap *, size_t capacity);
 void cmap_destroy(struct cmap *);
 
 /* Count. */
@@ -158,6 +212,13 @@ bool cmap_is_empty(const struct cmap *);
 
 /* Insertion and deletion.  Return the current count after the operation. */
 size_t cmap_insert(struct cmap *, struct cmap_node *, uint32_t hash);
+/* Like cmap_insert(), but places 'node' in its chain so that the chain stays
+* in descending order of priority. */
+size_t cmap_insert_ordered(struct cmap *, struct cmap_node *, uint32_t hash);
+/* Inserts many nodes at once, as cmap_insert_ordered() would; fastest into
+* an empty cmap, which it sizes for them once. */
+size_t cmap_insert_bulk(struct cmap *, struct cmap_node *nodes[],
+const uint32_t hashes[], size_t count);
 static inline size_t cmap_remove(struct cmap *, struct cmap_node *,
 								 uint32_t hash);
 size_t cmap_replace(struct cmap *, struct cmap_node *old_node,
@@ -220,9 +281,48 @@ unsigned long cmap_find_batch(const struct cmap *cmap, unsigned long map,
 							  uint32_t hashes[],
 							  const struct cmap_node *nodes[]);
 
+/* Largest number of lookups cmap_find_batch() can do in a single call. */
+#define CMAP_BATCH_SIZE (sizeof(unsigned long) * CHAR_BIT)
+
+static inline int
+raw_ctz(uint64_t n)
+{
+#ifdef _WIN64
+	unsigned long r = 0;
+	_BitScanForward64(&r, n);
+	return r;
+#elif defined(__linux__)
+	return __builtin_ctzll(n);
+#else
+	unsigned long low = n, high, r = 0;
+	if (_BitScanForward(&r, low)) {
+		return r;
+	}
+	high = n >> 32;
+	_BitScanForward(&r, high);
+	return r + 32;
+#endif
+}
+
+static inline uintmax_t
+zero_rightmost_1bit(uintmax_t x)
+{
+	return x & (x - 1);
+}
+
+/* More efficient access to a map of single ullong. */
+#define ULLONG_FOR_EACH_1(IDX, MAP)                 \
+    for (uint64_t map__ = (MAP);                    \
+         map__ && (((IDX) = raw_ctz(map__)), true); \
+         map__ = zero_rightmost_1bit(map__))
+
+#define ULLONG_SET0(MAP, OFFSET) ((MAP) &= ~(1ULL << (OFFSET)))
+#define ULLONG_SET1(MAP, OFFSET) ((MAP) |= 1ULL << (OFFSET))
+
 
 struct cmap_cursor {
 	const struct cmap_impl *impl;
+	const struct cmap_impl *next; /* To go on to after 'impl', or null. */
 	uint32_t bucket_idx;
 	int entry_idx;
 	struct cmap_node *node;
@@ -347,4 +447,17 @@ int cmap_largest_chain(const struct cmap* cmap);
 * Added by James Daly
 */
 int cmap_array_size(const struct cmap* cmap);
+
+/*
+* Bytes held by the hash table itself (header and buckets), not counting the
+* nodes, which belong to the client
+*/
+size_t cmap_memory_size(const struct cmap* cmap);
+
+/*
+* Zeroed memory aligned to a cache line, as used for the buckets; release it
+* with free_cacheline()
+*/
+void *xzalloc_cacheline(size_t size);
+void free_cacheline(void *p);
 #endif /* cmap.h */
\ No newline at end of file
@@ -180,7 +180,7 @@ extern "C" {
 #else /* __SSE4_2__ && __x86_64__ */
 #include <smmintrin.h>
 
-	static inline uint32_t HashAdd(uint32_t hash, uint32_t data)
+	static inline uint32_t hash_add(uint32_t hash, uint32_t data)
 	{
 		return _mm_crc32_u32(hash, data);
 	}
@@ -207,7 +207,7 @@ extern "C" {
 	static inline uint32_t
 		hash_words_inline(const uint32_t p_[], size_t n_words, uint32_t basis)
 	{
-		const uint64_t *p = (const void *)p_;
+		const uint64_t *p = (const uint64_t *)p_;
 		uint64_t hash1 = basis;
 		uint64_t hash2 = 0;
 		uint64_t hash3 = n_words;
@@ -0,0 +1,189 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "ovs-rcu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/* Sequence number an offline thread advertises: never holds anything back. */
+const uint64_t OVSRCU_OFFLINE = UINT64_MAX;
+
+/* Per-thread state, one cache line each so that quiescing does not bounce a
+* line shared with other readers. */
+struct alignas(64) ovsrcu_perthread {
+	/* Global sequence number the thread saw at its last quiescent point, or
+	* OVSRCU_OFFLINE. */
+	std::atomic<uint64_t> seqno{ OVSRCU_OFFLINE };
+};
+
+struct ovsrcu_cb {
+	void(*function)(void *aux);
+	void *aux;
+	uint64_t seqno; /* Safe to run once every reader has seen this. */
+};
+
+/* Bumped by every postponed callback. */
+std::atomic<uint64_t> global_seqno{ 1 };
+
+std::mutex threads_mutex;
+std::vector<ovsrcu_perthread *> threads;
+
+std::mutex cbs_mutex;
+std::deque<ovsrcu_cb> cbs;
+
+/* Registers the thread on first use and unregisters it when it exits. */
+struct ovsrcu_thread_slot {
+	ovsrcu_perthread *perthread = nullptr;
+
+	ovsrcu_perthread *get() {
+		if (!perthread) {
+			perthread = new ovsrcu_perthread;
+			std::lock_guard<std::mutex> lock(threads_mutex);
+			threads.push_back(perthread);
+		}
+		return perthread;
+	}
+
+	~ovsrcu_thread_slot() {
+		if (perthread) {
+			std::lock_guard<std::mutex> lock(threads_mutex);
+			threads.erase(std::find(threads.begin(), threads.end(), perthread));
+			delete perthread;
+		}
+	}
+};
+
+thread_local ovsrcu_thread_slot this_thread;
+
+/* Smallest sequence number advertised by any reader. */
+uint64_t
+ovsrcu_min_seqno(void)
+{
+	uint64_t min = OVSRCU_OFFLINE;
+
+	std::lock_guard<std::mutex> lock(threads_mutex);
+	for (const ovsrcu_perthread *perthread : threads) {
+		min = std::min(min, perthread->seqno.load());
+	}
+	return min;
+}
+
+/* Runs every callback whose grace period has expired.  Callbacks are run
+* without holding 'cbs_mutex', so they may postpone further work. */
+void
+ovsrcu_run_callbacks(uint64_t min)
+{
+	std::vector<ovsrcu_cb> ready;
+	{
+		std::lock_guard<std::mutex> lock(cbs_mutex);
+		while (!cbs.empty() && cbs.front().seqno <= min) {
+			ready.push_back(cbs.front());
+			cbs.pop_front();
+		}
+	}
+	for (const ovsrcu_cb &cb : ready) {
+		cb.function(cb.aux);
+	}
+}
+
+} // namespace
+
+void
+ovsrcu_quiesce_start(void)
+{
+	if (this_thread.perthread) {
+		this_thread.perthread->seqno.store(OVSRCU_OFFLINE, std::memory_order_release);
+	}
+}
+
+void
+ovsrcu_quiesce_end(void)
+{
+	ovsrcu_quiesce();
+}
+
+void
+ovsrcu_quiesce(void)
+{
+	/* Sequentially consistent, so that no read of shared data that follows
+	* can be satisfied before a writer scanning the readers sees this. */
+	this_thread.get()->seqno.store(global_seqno.load());
+}
+
+bool
+ovsrcu_is_quiescent(void)
+{
+	return !this_thread.perthread
+		|| this_thread.perthread->seqno.load(std::memory_order_relaxed) == OVSRCU_OFFLINE;
+}
+
+void
+ovsrcu_synchronize(void)
+{
+	uint64_t target = global_seqno.fetch_add(1) + 1;
+	bool online = !ovsrcu_is_quiescent();
+
+	if (online) {
+		ovsrcu_quiesce();
+	}
+	for (;;) {
+		uint64_t min = ovsrcu_min_seqno();
+		if (min >= target) {
+			ovsrcu_run_callbacks(min);
+			return;
+		}
+		std::this_thread::yield();
+		if (online) {
+			ovsrcu_quiesce();
+		}
+	}
+}
+
+uint64_t
+ovsrcu_grace_start(void)
+{
+	return global_seqno.fetch_add(1) + 1;
+}
+
+bool
+ovsrcu_grace_expired(uint64_t grace)
+{
+	return ovsrcu_min_seqno() >= grace;
+}
+
+void
+ovsrcu_postpone__(void(*function)(void *aux), void *aux)
+{
+	{
+		std::lock_guard<std::mutex> lock(cbs_mutex);
+		cbs.push_back({ function, aux, global_seqno.fetch_add(1) + 1 });
+	}
+	ovsrcu_run_callbacks(ovsrcu_min_seqno());
+}
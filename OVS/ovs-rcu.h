@@ -0,0 +1,82 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef OVS_RCU_H
+#define OVS_RCU_H 1
+
+#include <cstdint>
+
+/* Read-Copy-Update
+* ================
+*
+* A small epoch-based take on Open vSwitch's ovs-rcu, enough to let one
+* writer update a cmap (or anything built from them) while other threads keep
+* reading it without locks.
+*
+* Readers never block.  A thread that reads shared data goes "online" with
+* ovsrcu_quiesce_end() and must then call ovsrcu_quiesce() every so often, at
+* a point where it holds no pointers into the shared data (between packets or
+* batches, say).  When it is done, ovsrcu_quiesce_start() takes it offline.
+* Threads that never go online, such as the writer, are assumed not to hold
+* any such pointers.
+*
+* The writer unlinks an object so that no new reader can reach it, then hands
+* it to ovsrcu_postpone().  The callback runs, on the writer's thread, once
+* every online thread has quiesced since the call; until then the object stays
+* valid for readers that found it earlier.  With no reader online, callbacks
+* run right away. */
+
+/* Marks the calling thread as holding no references to RCU-protected data,
+* and keeps it that way until ovsrcu_quiesce_end(). */
+void ovsrcu_quiesce_start(void);
+
+/* Marks the calling thread as a reader, which from now on must call
+* ovsrcu_quiesce() periodically. */
+void ovsrcu_quiesce_end(void);
+
+/* Reports that the calling thread holds no references right now. */
+void ovsrcu_quiesce(void);
+
+/* Returns true if the calling thread is not currently a reader. */
+bool ovsrcu_is_quiescent(void);
+
+/* Waits until every reader has quiesced, then runs all callbacks that were
+* postponed before the call. */
+void ovsrcu_synchronize(void);
+
+/* Polls for a grace period without waiting on it: once every reader has
+* quiesced since ovsrcu_grace_start() returned 'grace',
+* ovsrcu_grace_expired(grace) is true. */
+uint64_t ovsrcu_grace_start(void);
+bool ovsrcu_grace_expired(uint64_t grace);
+
+/* Schedules FUNCTION(ARG) to run after the current grace period.  FUNCTION
+* must take a pointer of ARG's type. */
+#define ovsrcu_postpone(FUNCTION, ARG)                          \
+    ((void) sizeof((FUNCTION)(ARG), 1),                         \
+     (void) sizeof(*(ARG)),                                     \
+     ovsrcu_postpone__((void (*)(void *))(FUNCTION), ARG))
+
+void ovsrcu_postpone__(void (*function)(void *aux), void *aux);
+
+#endif /* ovs-rcu.h */
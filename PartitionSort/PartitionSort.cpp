@@ -26,15 +26,16 @@
 void PartitionSort::InsertRule(const Rule& one_rule) {
 
  
-	for (auto mitree : mitrees)
+	for (size_t i = 0; i < mitrees.size(); i++)
 	{
+		auto mitree = mitrees[i];
 		bool prioritychange = false;
 		
 		bool success = mitree->TryInsertion(one_rule, prioritychange);
 		if (success) {
 			
 			if (prioritychange) {
-				InsertionSortMITrees();
+				PriorityReposition(mitrees, i);
 			}
 			mitree->ReconstructIfNumRulesLessThanOrEqualTo(10);
 			rules.push_back(std::make_pair(one_rule, mitree));
@@ -47,7 +48,7 @@ void PartitionSort::InsertRule(const Rule& one_rule) {
 	tree_ptr->TryInsertion(one_rule, priority_change);
 	rules.push_back(std::make_pair(one_rule, tree_ptr));
 	mitrees.push_back(tree_ptr);  
-	InsertionSortMITrees();
+	PriorityReposition(mitrees, mitrees.size() - 1);
 }
 
 
@@ -60,16 +61,14 @@ void PartitionSort::DeleteRule(size_t i){
 	bool prioritychange = false;
 
 	OptimizedMITree * mitree = rules[i].second; 
+	size_t position = PriorityIndexOf(mitrees, mitree);
 	mitree->Deletion(rules[i].first, prioritychange); 
  
-	if (prioritychange) {
-		InsertionSortMITrees();
-	}
-
-
 	if (mitree->Empty()) {
-		mitrees.pop_back();
+		mitrees.erase(mitrees.begin() + position);
 		delete mitree;
+	} else if (prioritychange) {
+		PriorityReposition(mitrees, position);
 	}
 
 
@@ -1,4 +1,32 @@
 #include "red_black_tree.h"
+#include "../Utilities/HugePages.h"
+#include "../Utilities/SlabPool.h"
+#include <mutex>
+
+/* Nodes come from the heap, or under a huge page policy from one slab pool */
+/* that all trees share, so that they sit on huge pages together. */
+static std::mutex rbNodesLock;
+
+static SlabPool& RBNodes() {
+  static SlabPool pool(sizeof(rb_red_blk_node), alignof(rb_red_blk_node));
+  return pool;
+}
+
+static rb_red_blk_node* RBNodeAlloc() {
+  if (HugePages::Policy() == PagesNormal) {
+    return (rb_red_blk_node*) SafeMalloc(sizeof(rb_red_blk_node));
+  }
+  std::lock_guard<std::mutex> guard(rbNodesLock);
+  return (rb_red_blk_node*) RBNodes().Allocate();
+}
+
+static void RBNodeFree(rb_red_blk_node* x) {
+  if (HugePages::Policy() == PagesNormal) {
+    free(x);
+  } else {
+    SlabPool::Release(x);
+  }
+}
 
 int CompareBox(const box& a, const box& b ) {
 	int compare_size = a.size();
@@ -53,11 +81,11 @@ rb_red_blk_tree* RBTreeCreate() {
   newTree = new rb_red_blk_tree;//(rb_red_blk_tree*) SafeMalloc(sizeof(rb_red_blk_tree));
   /*  see the comment in the rb_red_blk_tree structure in red_black_tree.h */
   /*  for information on nil and root */
-  temp=newTree->nil= (rb_red_blk_node*) SafeMalloc(sizeof(rb_red_blk_node));
+  temp=newTree->nil= RBNodeAlloc();
   temp->parent=temp->left=temp->right=temp;
   temp->red=0;
   temp->key = { { 1111, 1111 } };
-  temp=newTree->root= (rb_red_blk_node*) SafeMalloc(sizeof(rb_red_blk_node));
+  temp=newTree->root= RBNodeAlloc();
   temp->parent=temp->left=temp->right=newTree->nil;
   temp->key = { { 2222, 2222 } };
   temp->red=0; 
@@ -178,7 +206,7 @@ bool inline IsIntersect(unsigned a1, unsigned b1, unsigned a2, unsigned b2) {
 bool inline IsIdentical(unsigned a1, unsigned b1, unsigned a2, unsigned b2) {
 	return a1 == a2  && b1 == b2;
 }
-bool RBTreeCanInsert(rb_red_blk_tree* tree, const std::vector<box>& z, int level, const std::vector<int>& fieldOrder) {
+bool RBTreeCanInsert(rb_red_blk_tree* tree, const rule_boxes& z, int level, const std::vector<int>& fieldOrder) {
 	 
 	if (tree == nullptr) return true;
 	
@@ -211,7 +239,7 @@ bool RBTreeCanInsert(rb_red_blk_tree* tree, const std::vector<box>& z, int level
 			/*printf("TreeInsertHelp:: Exact Match!\n");
 			return true;
 			x = x->right;*/
-			return level == z.size() - 1 ? true : RBTreeCanInsert(x->rb_tree_next_level, z, level + 1,fieldOrder);
+			return level == fieldOrder.size() - 1 ? true : RBTreeCanInsert(x->rb_tree_next_level, z, level + 1,fieldOrder);
 		} else {  /* x.key || z.key */
 			return false;
 		}
@@ -235,7 +263,7 @@ bool RBTreeCanInsert(rb_red_blk_tree* tree, const std::vector<box>& z, int level
 /***********************************************************************/
 
 
-bool TreeInsertWithPathCompressionHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const std::vector<box>& b, int level, const std::vector<int>& fieldOrder, int priority, rb_red_blk_node*& out_ptr) {
+bool TreeInsertWithPathCompressionHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const rule_boxes& b, int level, const std::vector<int>& fieldOrder, int priority, rb_red_blk_node*& out_ptr) {
   /*  This function should only be called by InsertRBTree (see above) */
   rb_red_blk_node* x;
   rb_red_blk_node* y;
@@ -300,7 +328,7 @@ bool TreeInsertWithPathCompressionHelp(rb_red_blk_tree* tree, rb_red_blk_node* z
 			x->rb_tree_next_level->PushPriority(priority); 
 			out_ptr = x;
 		}
-		free(z);
+		RBNodeFree(z);
 		return true;
 	} else {  /* x.key || z.key */
 		printf("Warning TreeInsertPathcompressionHelp : x.key || z.key\n");
@@ -349,7 +377,7 @@ bool TreeInsertWithPathCompressionHelp(rb_red_blk_tree* tree, rb_red_blk_node* z
 /*            info pointers and inserts it into the tree. */
 /***********************************************************************/
 
-rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const std::vector<box>& key, unsigned int level, const std::vector<int>& fieldOrder,int priority) {
+rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const rule_boxes& key, unsigned int level, const std::vector<int>& fieldOrder,int priority) {
 
 	
   rb_red_blk_node * y;
@@ -438,7 +466,7 @@ rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const s
 				  for (auto e : temp_chain_boxes)
 					  printf("[%u %u] ", e[LowDim], e[HighDim]);
 				  printf("\n boxes:\n");
-				  for (size_t i = 0; i < key.size(); i++) {
+				  for (size_t i = 0; i < fieldOrder.size(); i++) {
 					  printf("[%u %u] ", key[fieldOrder[i]][LowDim], key[fieldOrder[i]][HighDim]);
 				  }
 				  printf("\n");
@@ -449,9 +477,9 @@ rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const s
 			//  x->rb_tree_next_level->PushPriority(priority);
 			 // x->rb_tree_next_level->PushPriority(xpriority);
 			  auto PrependChainbox = [](std::vector<box>& cb, int n_prepend) {
-				  std::vector<box> t;
-				  for (int i = 0; i < n_prepend; i++) t.push_back({ { 999, 100020 } });
-				  t.insert(end(t), begin(cb), end(cb));
+				  rule_boxes t;
+				  for (int i = 0; i < n_prepend; i++) t[i] = { { 999, 100020 } };
+				  std::copy(begin(cb), end(cb), begin(t) + n_prepend);
 				  return t;
 			  };
 			  auto z1 = RBTreeInsert(x->rb_tree_next_level, PrependChainbox(temp_chain_boxes, level), level + run, naturalFieldOrder, xpriority); 
@@ -468,9 +496,9 @@ rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const s
 	  } else { 
 
 		  auto PrependChainbox = [](std::vector<box>& cb, int n_prepend) {
-			  std::vector<box> t;
-			  for (int i = 0; i < n_prepend; i++) t.push_back({ { 0, 10000000 } });
-			  t.insert(end(t), begin(cb), end(cb));
+			  rule_boxes t;
+			  for (int i = 0; i < n_prepend; i++) t[i] = { { 0, 10000000 } };
+			  std::copy(begin(cb), end(cb), begin(t) + n_prepend);
 			  return t;
 		  };
 
@@ -495,7 +523,7 @@ rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const s
   tree->PushPriority(maxpri);*/
 
 
-  x = (rb_red_blk_node*)SafeMalloc(sizeof(rb_red_blk_node));
+  x = RBNodeAlloc();
   x->key = key[fieldOrder[level]];
   rb_red_blk_node * out_ptr;
 
@@ -572,7 +600,7 @@ rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const s
 /*            info pointers and inserts it into the tree. */
 /***********************************************************************/
 
-rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, const std::vector<box>& key, int level, const std::vector<int>& field_order, int priority) {
+rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, const rule_boxes& key, int level, const std::vector<int>& field_order, int priority) {
 
 	if (level == key.size()) return nullptr;
  
@@ -580,7 +608,7 @@ rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, const std::vector<box>& ke
 	rb_red_blk_node * x;
 	rb_red_blk_node * newNode;
 
-	x = (rb_red_blk_node*)SafeMalloc(sizeof(rb_red_blk_node));
+	x = RBNodeAlloc();
 	x->key = key[field_order[level]];
 	rb_red_blk_node * out_ptr;
 	if (TreeInsertHelp(tree, x, key, level, field_order, priority, out_ptr)){
@@ -637,7 +665,7 @@ rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, const std::vector<box>& ke
 }
 
 
-bool TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const std::vector<box>& b, int level, const std::vector<int>& field_order, int priority, rb_red_blk_node*& out_ptr) {
+bool TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const rule_boxes& b, int level, const std::vector<int>& field_order, int priority, rb_red_blk_node*& out_ptr) {
 	/*  This function should only be called by InsertRBTree  */
 	rb_red_blk_node* x;
 	rb_red_blk_node* y;
@@ -662,7 +690,7 @@ bool TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const std::vector
 				//x->nodes_priority[x->num_node_priority++] = priority;
 				out_ptr = x;
 			}
-			free(z);
+			RBNodeFree(z);
 			return true;
 		} else {  /* x.key || z.key */
 			printf("x:[%u %u], z:[%u %u]\n", x->key[LowDim], x->key[HighDim], z->key[LowDim], z->key[HighDim]);
@@ -814,7 +842,7 @@ void TreeDestHelper(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 		RBTreeDestroy(x->rb_tree_next_level);
     TreeDestHelper(tree,x->left);
     TreeDestHelper(tree,x->right);
-    delete x;
+    RBNodeFree(x);
   }
 }
 
@@ -834,8 +862,8 @@ void TreeDestHelper(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 
 void RBTreeDestroy(rb_red_blk_tree* tree) {
    TreeDestHelper(tree,tree->root->left);
-  delete (tree->root);
-  delete tree->nil;
+  RBNodeFree(tree->root);
+  RBNodeFree(tree->nil);
   delete tree; 
 }
 
@@ -1081,7 +1109,7 @@ void ClearStack(std::stack<std::pair<rb_red_blk_tree *, rb_red_blk_node *>>& st,
 	}
 
 }
-void RBTreeDeleteWithPathCompression(rb_red_blk_tree*& tree, const std::vector<box>& key, int level, const std::vector<int>& fieldOrder, int priority, bool& JustDeletedTree) {
+void RBTreeDeleteWithPathCompression(rb_red_blk_tree*& tree, const rule_boxes& key, int level, const std::vector<int>& fieldOrder, int priority, bool& JustDeletedTree) {
 
  
 	if (level == fieldOrder.size()) {
@@ -1286,12 +1314,12 @@ void RBDelete(rb_red_blk_tree* tree, rb_red_blk_node* z){
     } else {
       z->parent->right=y;
     }
-    free(z); 
+    RBNodeFree(z); 
   } else {
 //    tree->DestroyKey(y->key);
  //   tree->DestroyInfo(y->info);
     if (!(y->red)) RBDeleteFixUp(tree,x);
-    free(y);
+    RBNodeFree(y);
   }
   
 #ifdef DEBUG_ASSERT
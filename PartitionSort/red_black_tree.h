@@ -32,6 +32,8 @@
 static const int LOW = 0, HIGH = 1;
 struct rb_red_blk_tree;
 typedef std::array<Point, 2>  box; 
+/* one box per field of a rule, indexed by field */
+typedef std::array<box, MAXDIMENSIONS> rule_boxes;
 
 //Total 29 bytes per node
 typedef struct rb_red_blk_node {
@@ -105,15 +107,15 @@ FOR RB tree light weight node
 **/
 rb_red_blk_tree* RBTreeCreate();
 
-rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const std::vector<box>& key, unsigned int level, const std::vector<int>& fieldOrder, int priority);
-void RBTreeDeleteWithPathCompression(rb_red_blk_tree*& tree, const std::vector<box>& key, int level, const std::vector<int>& fieldOrder, int priority, bool& JustDeletedTree);
-std::vector<std::pair<rb_red_blk_tree*, rb_red_blk_node *>> RBFindNodeSequence(rb_red_blk_tree* tree, const std::vector<box>& key, int level, const std::vector<int>& fieldOrder);
+rb_red_blk_node * RBTreeInsertWithPathCompression(rb_red_blk_tree* tree, const rule_boxes& key, unsigned int level, const std::vector<int>& fieldOrder, int priority);
+void RBTreeDeleteWithPathCompression(rb_red_blk_tree*& tree, const rule_boxes& key, int level, const std::vector<int>& fieldOrder, int priority, bool& JustDeletedTree);
+std::vector<std::pair<rb_red_blk_tree*, rb_red_blk_node *>> RBFindNodeSequence(rb_red_blk_tree* tree, const rule_boxes& key, int level, const std::vector<int>& fieldOrder);
 
-bool TreeInsertWithPathCompressionHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const std::vector<box>& b, int level, const std::vector<int>& fieldOrder, int priority, rb_red_blk_node*& out_ptr);
+bool TreeInsertWithPathCompressionHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const rule_boxes& b, int level, const std::vector<int>& fieldOrder, int priority, rb_red_blk_node*& out_ptr);
 int RBExactQueryPriority(rb_red_blk_tree*  tree, const Packet& q, int level, const std::vector<int>& fieldOrder, int priority_so_far); 
-bool TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const std::vector<box>& b, int level, const std::vector<int>& fieldOrder, int priority,  rb_red_blk_node*& out_ptr);
-rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, const std::vector<box>& key, int level, const std::vector<int>& fieldOrder, int priority=0);
-bool RBTreeCanInsert(rb_red_blk_tree* tree, const std::vector<box>& z, int level, const std::vector<int>& fieldOrder);
+bool TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z, const rule_boxes& b, int level, const std::vector<int>& fieldOrder, int priority,  rb_red_blk_node*& out_ptr);
+rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, const rule_boxes& key, int level, const std::vector<int>& fieldOrder, int priority=0);
+bool RBTreeCanInsert(rb_red_blk_tree* tree, const rule_boxes& z, int level, const std::vector<int>& fieldOrder);
 void RBTreePrint(rb_red_blk_tree*);
 void RBDelete(rb_red_blk_tree* , rb_red_blk_node* );
 void RBTreeDestroy(rb_red_blk_tree*);
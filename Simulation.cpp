@@ -22,14 +22,55 @@
  * SOFTWARE.
  */
 #include "Simulation.h"
+#include "OVS/ovs-rcu.h"
+#include "Utilities/PerfCounter.h"
+#include <atomic>
+#include <functional>
+#include <numeric>
+#include <set>
 #include <string>
 #include <sstream>
+#include <thread>
 
 using namespace std;
 using namespace std::chrono;
 
 std::mt19937 Random::generator(0);
 
+namespace {
+	std::mutex& ThreadNumberMutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+	std::set<size_t>& FreeThreadNumbers() {
+		static std::set<size_t> numbers;
+		return numbers;
+	}
+	size_t threadNumbersTaken = 0;
+
+	// Static initialization runs on the main thread, which so takes 0
+	const size_t mainThreadNumber = ThreadNumber();
+}
+
+size_t NewThreadNumber() {
+	std::lock_guard<std::mutex> lock(ThreadNumberMutex());
+	auto& free = FreeThreadNumbers();
+	if (free.empty()) return threadNumbersTaken++;
+	size_t number = *free.begin();
+	free.erase(free.begin());
+	return number;
+}
+
+void FreeThreadNumber(size_t number) {
+	std::lock_guard<std::mutex> lock(ThreadNumberMutex());
+	FreeThreadNumbers().insert(number);
+}
+
+std::mutex& SharedSlotMutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+
 std::vector<Request> Simulator::GenerateRequests(int num_packet, int num_insert, int num_delete) const {
 	if (num_packet > packets.size()) {
 		printf("Warning in Simulator::GenerateRequests : too much request for num_packet--setting num to available size\n");
@@ -135,7 +176,7 @@ std::vector<Request> Simulator::SetupComputation(int num_packet, int num_insert,
 	
 	return sequence;
 }
-vector<int> Simulator::PerformOnlyPacketClassification(PacketClassifier& classifier, map<string, string>& summary) const {
+vector<int> Simulator::PerformOnlyPacketClassification(PacketClassifier& classifier, map<string, string>& summary, size_t batchSize) const {
 
 
 	time_point<steady_clock> start, end;
@@ -162,20 +203,40 @@ vector<int> Simulator::PerformOnlyPacketClassification(PacketClassifier& classif
 	const int trials = 1;
 	duration<double> sum_time(0);
 	vector<int> results;
+	PerfCounter dtlb(PerfCounter::DtlbLoadMisses);
+	uint64_t dtlbMisses = 0;
 	for (int t = 0; t < trials; t++) {
 		results.clear();
-		results.reserve(packets.size());
-		start = steady_clock::now();
-		for (auto const &p : packets) {
-			results.push_back(classifier.ClassifyAPacket(p));
+		if (batchSize > 1) {
+			results.resize(packets.size());
+			start = steady_clock::now();
+			dtlb.Start();
+			for (size_t i = 0; i < packets.size(); i += batchSize) {
+				classifier.ClassifyBatch(&packets[i], min(batchSize, packets.size() - i), &results[i]);
+			}
+		} else {
+			results.reserve(packets.size());
+			start = steady_clock::now();
+			dtlb.Start();
+			for (auto const &p : packets) {
+				results.push_back(classifier.ClassifyAPacket(p));
+			}
 		}
+		dtlb.Stop();
 		end = steady_clock::now();
+		dtlbMisses += dtlb.Read();
 		elapsed_seconds = end - start;
 		sum_time += elapsed_seconds; 
 	} 
 
 	printf("\tClassification time: %f s\n", sum_time.count() / trials);
 	summary["ClassificationTime(s)"] = to_string(sum_time.count() / trials);
+	if (dtlb.Available()) {
+		printf("\tdTLB misses: %f per packet\n", (double)dtlbMisses / trials / packets.size());
+		summary["dTLBMissesPerPacket"] = to_string((double)dtlbMisses / trials / packets.size());
+	} else {
+		summary["dTLBMissesPerPacket"] = "NA";
+	}
 	
 	if (results.size() <= 100) {
 		for (int x : results) printf("\t%d\n", x);
@@ -213,6 +274,296 @@ vector<int> Simulator::PerformOnlyPacketClassification(PacketClassifier& classif
 	return results;
 }
 
+std::vector<int> Simulator::PerformParallelClassification(PacketClassifier& classifier, std::map<std::string, std::string>& summary, int threads) const {
+	time_point<steady_clock> start, end;
+	duration<double> elapsed_seconds;
+	duration<double,std::milli> elapsed_milliseconds;
+
+	start = steady_clock::now();
+	classifier.ConstructClassifier(ruleset);
+	end = steady_clock::now();
+	elapsed_milliseconds = end - start;
+	printf("\tConstruction time: %f ms\n", elapsed_milliseconds.count());
+	summary["ConstructionTime(ms)"] = std::to_string(elapsed_milliseconds.count());
+
+	vector<int> results(packets.size());
+
+	// Single-threaded pass over the whole trace: warms the caches and gives
+	// the baseline that scaling is measured against
+	start = steady_clock::now();
+	for (size_t i = 0; i < packets.size(); i++) {
+		results[i] = classifier.ClassifyAPacket(packets[i]);
+	}
+	end = steady_clock::now();
+	elapsed_seconds = end - start;
+	double singleMpps = packets.size() / elapsed_seconds.count() / 1e6;
+	printf("\tSingle thread: %f Mpps\n", singleMpps);
+	summary["SingleThreadMpps"] = to_string(singleMpps);
+
+	// Each thread classifies its own contiguous slice of the trace against
+	// the shared classifier
+	classifier.ResetQueryStats(threads);
+	vector<double> threadSeconds(threads, 0.0);
+	int team = threads;
+	start = steady_clock::now();
+	#pragma omp parallel num_threads(threads)
+	{
+		int t = omp_get_thread_num();
+		int n = omp_get_num_threads();
+		// OpenMP may start fewer threads than asked for
+		if (t == 0) team = n;
+		size_t first = packets.size() * t / n;
+		size_t last = packets.size() * (t + 1) / n;
+		auto threadStart = steady_clock::now();
+		for (size_t i = first; i < last; i++) {
+			results[i] = classifier.ClassifyAPacket(packets[i]);
+		}
+		duration<double> threadElapsed = steady_clock::now() - threadStart;
+		threadSeconds[t] = threadElapsed.count();
+	}
+	end = steady_clock::now();
+	elapsed_seconds = end - start;
+
+	double aggregateMpps = packets.size() / elapsed_seconds.count() / 1e6;
+	double efficiency = aggregateMpps / (team * singleMpps);
+	printf("\tThreads: %d\n", team);
+	printf("\tClassification time: %f s\n", elapsed_seconds.count());
+	printf("\tAggregate: %f Mpps\n", aggregateMpps);
+	printf("\tScaling efficiency: %f\n", efficiency);
+	summary["Threads"] = to_string(team);
+	summary["ClassificationTime(s)"] = to_string(elapsed_seconds.count());
+	summary["AggregateMpps"] = to_string(aggregateMpps);
+	summary["ScalingEfficiency"] = to_string(efficiency);
+
+	stringstream ssThreadMpps;
+	for (int t = 0; t < team; t++) {
+		size_t share = packets.size() * (t + 1) / team - packets.size() * t / team;
+		double mpps = threadSeconds[t] > 0 ? share / threadSeconds[t] / 1e6 : 0;
+		printf("\t\tThread %d: %f Mpps\n", t, mpps);
+		if (t != 0) ssThreadMpps << "-";
+		ssThreadMpps << mpps;
+	}
+	summary["ThreadMpps"] = ssThreadMpps.str();
+
+	int memSize = classifier.MemSizeBytes();
+	printf("\tSize(bytes): %d \n", memSize);
+	summary["Size(bytes)"] = to_string(memSize);
+	int numTables = classifier.NumTables();
+	printf("\tTables: %d \n", numTables);
+	summary["Tables"] = to_string(numTables);
+
+	printf("\tAverage tables queried: %f\n", 1.0 * classifier.TablesQueried() / packets.size());
+	summary["AvgQueries"] = to_string(1.0 * classifier.TablesQueried() / packets.size());
+
+	return results;
+}
+
+void Simulator::PerformConstruction(PacketClassifier& classifier, std::map<std::string, std::string>& summary) const {
+	time_point<steady_clock> start, end;
+	duration<double,std::milli> elapsed_milliseconds;
+
+	start = steady_clock::now();
+	classifier.ConstructClassifier(ruleset);
+	end = steady_clock::now();
+	elapsed_milliseconds = end - start;
+	printf("\tConstruction time: %f ms\n", elapsed_milliseconds.count());
+	summary["ConstructionTime(ms)"] = std::to_string(elapsed_milliseconds.count());
+
+	int memSize = classifier.MemSizeBytes();
+	printf("\tSize(bytes): %d \n", memSize);
+	summary["Size(bytes)"] = to_string(memSize);
+	int numTables = classifier.NumTables();
+	printf("\tTables: %d \n", numTables);
+	summary["Tables"] = to_string(numTables);
+}
+
+std::vector<int> Simulator::PerformConcurrentUpdates(PacketClassifier& classifier, std::map<std::string, std::string>& summary, int readers, int updates) const {
+	if (!classifier.ConcurrentUpdates()) {
+		printf("\tSkipped: cannot update while classifying\n");
+		return vector<int>();
+	}
+
+	time_point<steady_clock> start, end;
+	duration<double> elapsed_seconds;
+	duration<double,std::milli> elapsed_milliseconds;
+
+	// Half of the rules are in the classifier to begin with, the rest make up
+	// the pool the writer inserts from
+	Bookkeeper live(vector<Rule>(ruleset.begin(), ruleset.begin() + ruleset.size() / 2));
+	Bookkeeper pool(vector<Rule>(ruleset.begin() + ruleset.size() / 2, ruleset.end()));
+
+	start = steady_clock::now();
+	classifier.ConstructClassifier(live.GetRules());
+	end = steady_clock::now();
+	elapsed_milliseconds = end - start;
+	printf("\tConstruction time: %f ms\n", elapsed_milliseconds.count());
+	summary["ConstructionTime(ms)"] = std::to_string(elapsed_milliseconds.count());
+
+	// Thread 0 runs the control plane while the other threads sweep the
+	// trace, each from its own offset, until told to stop.  A reader reports
+	// a quiescent point after each burst of packets.
+	const size_t burst = 64;
+	vector<size_t> classified(readers);
+	auto runReaders = [&](std::function<void()> control) {
+		std::atomic<bool> stop(false);
+		fill(classified.begin(), classified.end(), 0);
+		#pragma omp parallel num_threads(readers + 1)
+		{
+			int t = omp_get_thread_num();
+			if (t == 0) {
+				control();
+				stop = true;
+			} else {
+				size_t i = packets.size() * (t - 1) / readers;
+				size_t count = 0;
+				ovsrcu_quiesce_end();
+				while (!stop.load(std::memory_order_relaxed)) {
+					for (size_t k = 0; k < burst; k++) {
+						classifier.ClassifyAPacket(packets[i]);
+						if (++i == packets.size()) i = 0;
+					}
+					count += burst;
+					ovsrcu_quiesce();
+				}
+				ovsrcu_quiesce_start();
+				classified[t - 1] = count;
+			}
+		}
+		return accumulate(classified.begin(), classified.end(), (size_t)0);
+	};
+	classifier.ResetQueryStats(readers + 1);
+
+	// Alternate insertions and deletions of random rules
+	start = steady_clock::now();
+	size_t busyPackets = runReaders([&]() {
+		for (int u = 0; u < updates; u++) {
+			if ((u % 2 == 0 && pool.size() > 0) || live.size() == 0) {
+				Rule r = pool.GetOneRuleAndPop(Random::random_int(0, pool.size() - 1));
+				classifier.InsertRule(r);
+				live.InsertRule(r);
+			} else {
+				int index = Random::random_int(0, live.size() - 1);
+				classifier.DeleteRule(index);
+				pool.InsertRule(live.GetOneRuleAndPop(index));
+			}
+		}
+	});
+	end = steady_clock::now();
+	elapsed_seconds = end - start;
+	double updateSeconds = elapsed_seconds.count();
+
+	// The same readers for the same time without the writer
+	size_t idlePackets = runReaders([&]() {
+		std::this_thread::sleep_for(duration<double>(updateSeconds));
+	});
+	end = steady_clock::now();
+	elapsed_seconds = end - start;
+	double idleSeconds = elapsed_seconds.count() - updateSeconds;
+
+	double busyMpps = busyPackets / updateSeconds / 1e6;
+	double idleMpps = idlePackets / idleSeconds / 1e6;
+	printf("\tReaders: %d\n", readers);
+	printf("\tUpdates: %d in %f s (%f per s)\n", updates, updateSeconds, updates / updateSeconds);
+	printf("\tWhile updating: %f Mpps\n", busyMpps);
+	printf("\tWithout updates: %f Mpps\n", idleMpps);
+	summary["Readers"] = to_string(readers);
+	summary["Updates"] = to_string(updates);
+	summary["UpdateTime(s)"] = to_string(updateSeconds);
+	summary["UpdatesPerSec"] = to_string(updates / updateSeconds);
+	summary["ConcurrentMpps"] = to_string(busyMpps);
+	summary["IdleMpps"] = to_string(idleMpps);
+
+	// The classifier must have come out of it holding exactly the live rules.
+	// A rebuild may still be finishing in the background, so this thread is
+	// a reader too.
+	vector<int> results(packets.size());
+	ovsrcu_quiesce_end();
+	for (size_t i = 0; i < packets.size(); i++) {
+		results[i] = classifier.ClassifyAPacket(packets[i]);
+		ovsrcu_quiesce();
+	}
+	ovsrcu_quiesce_start();
+	vector<Rule> expected = live.GetRules();
+	sort(expected.begin(), expected.end(), [](const Rule& rx, const Rule& ry) { return rx.priority > ry.priority; });
+	vector<MatchRecord> records(expected.begin(), expected.end());
+	const int checked = min<int>(packets.size(), 10000);
+	int mismatches = 0;
+	for (int i = 0; i < checked; i++) {
+		size_t j = MatchKernel::FirstMatch(packets[i], records.data(), records.size());
+		if ((j < records.size() ? records[j].priority : -1) != results[i]) {
+			mismatches++;
+		}
+	}
+	printf("\tMismatches: %d of %d\n", mismatches, checked);
+	summary["Mismatches"] = to_string(mismatches);
+
+	int memSize = classifier.MemSizeBytes();
+	printf("\tSize(bytes): %d \n", memSize);
+	summary["Size(bytes)"] = to_string(memSize);
+	int numTables = classifier.NumTables();
+	printf("\tTables: %d \n", numTables);
+	summary["Tables"] = to_string(numTables);
+
+	return results;
+}
+
+void Simulator::PerformUpdateLatency(PacketClassifier& classifier, std::map<std::string, std::string>& summary, int updates, double frac, double inserts) const {
+	time_point<steady_clock> start, end;
+	duration<double,std::milli> elapsed_milliseconds;
+
+	// By default as in PerformConcurrentUpdates: start from half of the rules
+	// and alternate insertions and deletions of random rules.  Starting
+	// small and mostly inserting makes the tables grow instead.
+	size_t first = min(ruleset.size(), (size_t)(ruleset.size() * frac));
+	Bookkeeper live(vector<Rule>(ruleset.begin(), ruleset.begin() + first));
+	Bookkeeper pool(vector<Rule>(ruleset.begin() + first, ruleset.end()));
+
+	start = steady_clock::now();
+	classifier.ConstructClassifier(live.GetRules());
+	end = steady_clock::now();
+	elapsed_milliseconds = end - start;
+	printf("\tConstruction time: %f ms\n", elapsed_milliseconds.count());
+	summary["ConstructionTime(ms)"] = std::to_string(elapsed_milliseconds.count());
+
+	vector<double> latencies(updates);
+	int inserted = 0;
+	for (int u = 0; u < updates; u++) {
+		if ((inserted < (u + 1) * inserts && pool.size() > 0) || live.size() == 0) {
+			inserted++;
+			Rule r = pool.GetOneRuleAndPop(Random::random_int(0, pool.size() - 1));
+			start = steady_clock::now();
+			classifier.InsertRule(r);
+			end = steady_clock::now();
+			live.InsertRule(r);
+		} else {
+			int index = Random::random_int(0, live.size() - 1);
+			start = steady_clock::now();
+			classifier.DeleteRule(index);
+			end = steady_clock::now();
+			pool.InsertRule(live.GetOneRuleAndPop(index));
+		}
+		latencies[u] = duration<double, std::micro>(end - start).count();
+	}
+
+	double mean = accumulate(latencies.begin(), latencies.end(), 0.0) / max(updates, 1);
+	sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p) {
+		return latencies.empty() ? 0.0 : latencies[min<size_t>(latencies.size() * p, latencies.size() - 1)];
+	};
+	printf("\tUpdates: %d\n", updates);
+	printf("\tLatency(us): mean %f p50 %f p99 %f p99.9 %f max %f\n", mean, percentile(0.5), percentile(0.99), percentile(0.999), percentile(1.0));
+	summary["Updates"] = to_string(updates);
+	summary["MeanLatency(us)"] = to_string(mean);
+	summary["P50Latency(us)"] = to_string(percentile(0.5));
+	summary["P99Latency(us)"] = to_string(percentile(0.99));
+	summary["P999Latency(us)"] = to_string(percentile(0.999));
+	summary["MaxLatency(us)"] = to_string(percentile(1.0));
+
+	int numTables = classifier.NumTables();
+	printf("\tTables: %d \n", numTables);
+	summary["Tables"] = to_string(numTables);
+}
+
 std::vector<int> Simulator::PerformPartialBuild(PacketClassifier& classifier, std::map<std::string, std::string>& summary, double frac) const {
 
 
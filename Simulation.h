@@ -27,12 +27,37 @@
 
 #include "ElementaryClasses.h"
 #include "Utilities/MapExtensions.h"
+#include "Utilities/MatchKernel.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <map>
+#include <mutex>
 #include <unordered_map>
+#include <omp.h>
 
 typedef uint32_t Memory;
 
+size_t NewThreadNumber();
+void FreeThreadNumber(size_t number);
+// A number no other live thread holds, for indexing per-thread state.  A
+// thread takes the lowest free one when it first asks and gives it back when
+// it exits, so the numbers stay below the count of threads alive; the main
+// thread holds 0.
+inline size_t ThreadNumber() {
+	struct Holder {
+		size_t number = NewThreadNumber();
+		~Holder() { FreeThreadNumber(number); }
+	};
+	static thread_local Holder holder;
+	return holder.number;
+}
+// Held by threads numbered past the per-thread slots to update the last one,
+// which they share
+std::mutex& SharedSlotMutex();
+
 class PartitionPacketClassifier {
 public:
 	virtual int ComputeNumberOfBuckets(const std::vector<Rule>& rules) = 0;
@@ -54,8 +79,21 @@ public:
 
 class PacketClassifier {
 public:
+	virtual ~PacketClassifier() {}
 	virtual void ConstructClassifier(const std::vector<Rule>& rules) = 0;
 	virtual int ClassifyAPacket(const Packet& packet) = 0;
+	virtual void ClassifyBatch(const Packet* packets, size_t n, int* results) {
+		for (size_t i = 0; i < n; i++) {
+			results[i] = ClassifyAPacket(packets[i]);
+		}
+	}
+	// As ClassifyAPacket, also setting in wildcards every header bit the
+	// result depends on: any packet that agrees with this one on those bits
+	// gets the same result.  By default, all of them.
+	virtual int ClassifyWildcarded(const Packet& packet, Packet& wildcards) {
+		wildcards.fill(~0u);
+		return ClassifyAPacket(packet);
+	}
 	virtual void DeleteRule(size_t index) = 0;
 	virtual void InsertRule(const Rule& rule) = 0;
 	virtual Memory MemSizeBytes() const = 0;
@@ -63,33 +101,121 @@ public:
 	virtual size_t NumTables() const = 0;
 	virtual size_t RulesInTable(size_t tableIndex) const = 0;
 	virtual size_t PriorityOfTable(size_t tableIndex) const = 0;
+	// True if InsertRule and DeleteRule may run while other threads are in
+	// ClassifyAPacket, provided those threads follow the rules of OVS/ovs-rcu.h
+	virtual bool ConcurrentUpdates() const { return false; }
 
-	int TablesQueried() const {	return queryCount; }
-	int NumPacketsQueriedNTables(int n) const { return GetOrElse<int, int>(packetHistogram, n, 0); };
+	int TablesQueried() const {
+		int total = 0;
+		for (const auto& s : queryStats) total += s.queryCount;
+		return total;
+	}
+	int NumPacketsQueriedNTables(int n) const {
+		int total = 0;
+		for (const auto& s : queryStats) total += GetOrElse<int, int>(s.packetHistogram, n, 0);
+		return total;
+	}
+	// Clears the query statistics and makes room for teams of up to threads
+	// concurrent callers of ClassifyAPacket; must not be called while
+	// classifying
+	virtual void ResetQueryStats(size_t threads) {
+		queryStats.clear();
+		queryStats.resize(ThreadSlots(threads));
+	}
 
 protected:
-	void QueryUpdate(int query) { 
-		packetHistogram[query]++;
-		queryCount += query;
+	// Slots for per-thread state, indexed by ThreadNumber(): one per member of
+	// the largest team, and a last one that any threads numbered past those
+	// share
+	static size_t ThreadSlots(size_t threads) {
+		return std::max<size_t>(threads, omp_get_max_threads()) + 1;
+	}
+
+	void QueryUpdate(int query) {
+		size_t t = ThreadNumber();
+		if (t + 1 < queryStats.size()) {
+			CountQuery(queryStats[t], query);
+		} else {
+			std::lock_guard<std::mutex> lock(SharedSlotMutex());
+			CountQuery(queryStats.back(), query);
+		}
 	}
 
 private:
-	int queryCount = 0;
-	std::unordered_map<int, int> packetHistogram;
+	// Statistics gathered by one thread.  The padding keeps the counters of
+	// two threads from ever sharing a cache line.
+	struct QueryStats {
+		int queryCount = 0;
+		std::unordered_map<int, int> packetHistogram;
+		char pad[64];
+	};
+	static void CountQuery(QueryStats& s, int query) {
+		s.packetHistogram[query]++;
+		s.queryCount += query;
+	}
+	std::vector<QueryStats> queryStats = std::vector<QueryStats>(ThreadSlots(1));
 };
 
+// Helpers for classifiers that search a list of tables ordered by descending
+// MaxPriority().  Updates change the priority of one table at a time, so the
+// list can be kept in order by moving that table alone instead of resorting.
+
+// Position of table in the ordered list, where it is placed by priority.
+// The table must be in the list.
+template<class T>
+size_t PriorityIndexOf(const std::vector<T*>& tables, const T* table, int priority) {
+	auto it = std::partition_point(tables.begin(), tables.end(), [=](const T* t) { return (int)t->MaxPriority() > priority; });
+	while (it != tables.end() && *it != table && (int)(*it)->MaxPriority() == priority) it++;
+	if (it == tables.end() || *it != table) {
+		// Not among the tables of its priority, so the list is out of order
+		it = std::find(tables.begin(), tables.end(), table);
+		if (it == tables.end()) {
+			printf("Error: table is not in the list\n");
+			exit(1);
+		}
+	}
+	return it - tables.begin();
+}
+
+// As above, before the priority of table changes
+template<class T>
+size_t PriorityIndexOf(const std::vector<T*>& tables, const T* table) {
+	return PriorityIndexOf(tables, table, table->MaxPriority());
+}
+
+// Adds table in order, after the others of its priority
+template<class T>
+void PriorityInsert(std::vector<T*>& tables, T* table) {
+	int priority = table->MaxPriority();
+	tables.insert(std::partition_point(tables.begin(), tables.end(), [=](const T* t) { return (int)t->MaxPriority() >= priority; }), table);
+}
+
+// Restores the order after the priority of tables[index] has changed
+template<class T>
+void PriorityReposition(std::vector<T*>& tables, size_t index) {
+	T* table = tables[index];
+	int priority = table->MaxPriority();
+	auto at = tables.begin() + index;
+	auto to = std::partition_point(tables.begin(), at, [=](const T* t) { return (int)t->MaxPriority() >= priority; });
+	if (to != at) {
+		std::rotate(to, at, at + 1);
+	} else {
+		to = std::partition_point(at + 1, tables.end(), [=](const T* t) { return (int)t->MaxPriority() > priority; });
+		std::rotate(at, at + 1, to);
+	}
+}
+
 class ListClassifier : public PacketClassifier {
 public:
 	virtual void ConstructClassifier(const std::vector<Rule>& rules) {
 		this->rules = rules;
+		records.assign(rules.begin(), rules.end());
 	}
 	virtual int ClassifyAPacket(const Packet& packet) {
-		for (const Rule& r : rules) {
-			if (r.MatchesPacket(packet)) {
-				return r.priority;
-			}
-		}
-		return -1;
+		size_t i = MatchKernel::Run([&](auto k) __attribute__((always_inline)) {
+			return decltype(k)::FirstMatch(packet, records.data(), records.size());
+		});
+		return i < records.size() ? records[i].priority : -1;
 	}
 	virtual void DeleteRule(size_t index) {};
 	virtual void InsertRule(const Rule& rule) {};
@@ -108,6 +234,7 @@ public:
 
 private:
 	std::vector<Rule> rules;
+	std::vector<MatchRecord> records; // Same order as rules
 };
 
 
@@ -155,7 +282,13 @@ public:
 	static int PerformPartitioning(PartitionPacketClassifier& ppc, const std::vector<Rule>& ruleset, std::map<std::string, std::string>& summary);
 
 	std::vector<Request> SetupComputation(int num_packet, int num_insert, int num_delete);
-	std::vector<int>  PerformOnlyPacketClassification(PacketClassifier& classifier, std::map<std::string, std::string>& summary) const;
+	std::vector<int>  PerformOnlyPacketClassification(PacketClassifier& classifier, std::map<std::string, std::string>& summary, size_t batchSize = 1) const;
+	std::vector<int>  PerformParallelClassification(PacketClassifier& classifier, std::map<std::string, std::string>& summary, int threads) const;
+	void  PerformConstruction(PacketClassifier& classifier, std::map<std::string, std::string>& summary) const;
+	std::vector<int>  PerformConcurrentUpdates(PacketClassifier& classifier, std::map<std::string, std::string>& summary, int readers, int updates) const;
+	// Builds from the first frac of the rules, then times each of updates
+	// insertions and deletions, of which the inserts fraction insert
+	void  PerformUpdateLatency(PacketClassifier& classifier, std::map<std::string, std::string>& summary, int updates, double frac = 0.5, double inserts = 0.5) const;
 	std::vector<int>  PerformPartialBuild(PacketClassifier& classifier, std::map<std::string, std::string>& summary, double frac) const;
 	std::vector<int>  PerformPacketClassification( PacketClassifier& classifier, const std::vector<Request>& sequence, std::map<std::string, double>& trial) const;
 
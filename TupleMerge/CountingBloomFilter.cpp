@@ -0,0 +1,68 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "CountingBloomFilter.h"
+#include "../OVS/cmap.h"
+#include <new>
+
+CountingBloomFilter::CountingBloomFilter(size_t capacity, int countersPerKey) : capacity(capacity) {
+	size_t blocks = 1;
+	while (blocks * 128 < capacity * countersPerKey) blocks *= 2;
+	mask = blocks - 1;
+	this->blocks = (Block*)xzalloc_cacheline(blocks * sizeof(Block));
+	for (size_t i = 0; i < blocks; i++) {
+		new (&this->blocks[i]) Block();
+	}
+}
+
+CountingBloomFilter::~CountingBloomFilter() {
+	free_cacheline(blocks);
+}
+
+void CountingBloomFilter::Add(uint32_t hash) {
+	Block& b = blocks[BlockOf(hash)];
+	uint32_t h = Spread(hash);
+	for (int k = 0; k < Hashes; k++, h >>= 7) {
+		unsigned i = h & 127;
+		auto& word = b.words[i / 16];
+		uint64_t w = word.load(std::memory_order_relaxed);
+		if ((w >> (i % 16 * 4) & 15) != 15) {
+			word.store(w + (1ull << (i % 16 * 4)), std::memory_order_relaxed);
+		}
+	}
+}
+
+void CountingBloomFilter::Remove(uint32_t hash) {
+	Block& b = blocks[BlockOf(hash)];
+	uint32_t h = Spread(hash);
+	for (int k = 0; k < Hashes; k++, h >>= 7) {
+		unsigned i = h & 127;
+		auto& word = b.words[i / 16];
+		uint64_t w = word.load(std::memory_order_relaxed);
+		unsigned c = w >> (i % 16 * 4) & 15;
+		// A stuck counter may stand for more keys than it can count
+		if (c != 0 && c != 15) {
+			word.store(w - (1ull << (i % 16 * 4)), std::memory_order_relaxed);
+		}
+	}
+}
@@ -0,0 +1,78 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// A blocked counting Bloom filter over 32-bit hashes.  Each key sets three
+// 4-bit counters, all in the one 64-byte block its hash picks, so a lookup
+// touches a single cache line.  Counters stick at their maximum rather than
+// overflow, which only costs accuracy.
+//
+// One thread at a time may Add and Remove while others call MayContain.
+class CountingBloomFilter {
+public:
+	// Room for capacity keys at countersPerKey counters each
+	CountingBloomFilter(size_t capacity, int countersPerKey);
+	~CountingBloomFilter();
+	CountingBloomFilter(const CountingBloomFilter&) = delete;
+	CountingBloomFilter& operator=(const CountingBloomFilter&) = delete;
+
+	bool MayContain(uint32_t hash) const {
+		const Block& b = blocks[BlockOf(hash)];
+		uint32_t h = Spread(hash);
+		for (int k = 0; k < Hashes; k++, h >>= 7) {
+			if (!Counter(b, h & 127)) return false;
+		}
+		return true;
+	}
+	void Add(uint32_t hash);
+	void Remove(uint32_t hash);
+
+	size_t Capacity() const { return capacity; }
+	size_t MemSizeBytes() const { return (mask + 1) * sizeof(Block); }
+
+private:
+	static const int Hashes = 3;
+	struct Block {
+		std::atomic<uint64_t> words[8]; // 128 counters, 16 to a word
+	};
+
+	size_t BlockOf(uint32_t hash) const {
+		return (hash ^ (hash >> 16)) * 0x85ebca6bu >> 8 & mask;
+	}
+	// Twenty-one bits for the counters, from the top of a multiply
+	static uint32_t Spread(uint32_t hash) {
+		return hash * 0x9e3779b1u >> 11;
+	}
+	static unsigned Counter(const Block& b, unsigned i) {
+		return b.words[i / 16].load(std::memory_order_relaxed) >> (i % 16 * 4) & 15;
+	}
+
+	Block* blocks;
+	size_t mask; // Blocks, less one
+	size_t capacity;
+};
@@ -22,14 +22,16 @@
  * SOFTWARE.
  */
 #include "SlottedTable.h"
+#include "../OVS/ovs-rcu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <type_traits>
 
 using namespace TupleMergeUtils;
 using namespace std;
 
-// Values for Bernstein Hash
-#define HashBasis 5381
-#define HashMult 33
-
 namespace TupleMergeUtils {
 	int LeastSignificantBit(int x) {
 		int c = 32;
@@ -136,82 +138,20 @@ namespace TupleMergeUtils {
 		return result;
 	}
 	
-	inline uint32_t HashMultiplyAndAdd(const vector<uint32_t>& v) {
-		uint32_t hash = HashBasis;
-		for (size_t d = 0; d < v.size(); d++) {
-			hash *= HashMult;
-			hash += v[d];
-		}
-		return hash;
-	}
-
-	inline uint32_t HashKeyMultiplyAndAdd(const vector<unsigned int>& packet, const Tuple& tuple) {
-		uint32_t hash = HashBasis;
-		for (size_t d = 0; d < tuple.size(); d++) {
-			hash *= HashMult;
-			hash += packet[d] & Mask(tuple[d]);
-		}
-		return hash;
-	}
-
-	inline uint32_t HashRuleMultiplyAndAdd(const Rule& r, const Tuple& tuple) {
-		uint32_t hash = HashBasis;
-
-		for (size_t d = 0; d < tuple.size(); d++) {
-			hash *= HashMult;
-			hash += r.range[d][LowDim] & Mask(tuple[d]);
-		}
-		return hash;
-	}
-
-	inline uint32_t HashPacketElf(const vector<unsigned int>& packet, const Tuple& tuple) {
-		uint32_t hash = 0;
-		for (size_t d = 0; d < tuple.size(); d++) {
-			hash <<= 4;
-			hash += packet[d] & Mask(tuple[d]);
-			uint32_t high = hash & 0xf0000000u;
-			hash ^= (high >> 24);
-			hash &= ~high;
-		}
-		return hash;
-	}
-
-	inline uint32_t HashRuleElf(const Rule& r, const Tuple& tuple) {
-		uint32_t hash = 0;
-		for (size_t d = 0; d < tuple.size(); d++) {
-			hash <<= 4;
-			hash += r.range[d][LowDim] & Mask(tuple[d]);
-			uint32_t high = hash & 0xf0000000u;
-			hash ^= (high >> 24);
-			hash &= ~high;
-		}
-		return hash;
-	}
-
-	inline uint32_t HashKnuthPacket(const vector<unsigned int>& packet, const Tuple& tuple) {
-		uint32_t hash = 0;
-		for (size_t d = 0; d < tuple.size(); d++) {
-			hash = (hash << 5) ^ (hash >> 27);
-			hash ^= packet[d] & Mask(tuple[d]);
-		}
-		return hash;
-	}
-
-	inline uint32_t HashKnuthRule(const Rule& r, const Tuple& tuple) {
-		uint32_t hash = 0;
+	uint32_t Hash(const Rule& r, const Tuple& tuple) {
+		TupleMergeHash::State hash = TupleMergeHash::Start();
 		for (size_t d = 0; d < tuple.size(); d++) {
-			hash = (hash << 5) ^ (hash >> 27);
-			hash ^= r.range[d][LowDim] & Mask(tuple[d]);
+			hash = TupleMergeHash::Add(hash, r.range[d][LowDim] & Mask(tuple[d]));
 		}
-		return hash;
-	}
-
-	uint32_t Hash(const Rule& r, const Tuple& tuple) {
-		return HashRuleMultiplyAndAdd(r, tuple);
+		return TupleMergeHash::Finish(hash);
 	}
 	
 	uint32_t Hash(const Packet& p, const Tuple& tuple) {
-		return HashKeyMultiplyAndAdd(p, tuple);
+		TupleMergeHash::State hash = TupleMergeHash::Start();
+		for (size_t d = 0; d < tuple.size(); d++) {
+			hash = TupleMergeHash::Add(hash, p[d] & Mask(tuple[d]));
+		}
+		return TupleMergeHash::Finish(hash);
 	}
 	
 	bool IsHashable(const vector<Rule>& rl, size_t collisionLimit) {
@@ -229,6 +169,55 @@ namespace TupleMergeUtils {
 		return true;
 	}
 
+	bool FitsTuple(const vector<Rule>& rl, const Tuple& tuple, size_t collisionLimit) {
+		unordered_map<uint32_t, size_t> counts;
+		for (const Rule& r : rl) {
+			if (++counts[Hash(r, tuple)] > collisionLimit) return false;
+		}
+		return true;
+	}
+
+	static void HashPacketForTablesScalar(const Packet& p, const MaskLayout& layout, size_t base, uint32_t* hashes) {
+		for (size_t t = 0; t < HashLanes; t++) {
+			TupleMergeHash::State hash = TupleMergeHash::Start();
+			for (int d = 0; d < MAXDIMENSIONS; d++) {
+				hash = TupleMergeHash::Add(hash, p[d] & layout[d][base + t]);
+			}
+			hashes[t] = TupleMergeHash::Finish(hash);
+		}
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__attribute__((target("avx2")))
+	static void HashPacketForTablesAVX2(const Packet& p, const MaskLayout& layout, size_t base, uint32_t* hashes) {
+		// One lane per table, for the Bernstein hash; multiplying by 33 is a
+		// shift and an add
+		__m256i hash = _mm256_set1_epi32(HashPolicy::Bernstein::Start());
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			__m256i mask = _mm256_loadu_si256((const __m256i*)(layout[d].data() + base));
+			__m256i key = _mm256_and_si256(_mm256_set1_epi32(p[d]), mask);
+			hash = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(hash, 5), hash), key);
+		}
+		_mm256_storeu_si256((__m256i*)hashes, hash);
+	}
+
+	static bool SupportsAVX2() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+	static const bool UseAVX2 = std::is_same<TupleMergeHash, HashPolicy::Bernstein>::value && SupportsAVX2();
+#endif
+
+	void HashPacketForTables(const Packet& p, const MaskLayout& layout, size_t base, uint32_t* hashes) {
+#if defined(__x86_64__) || defined(__i386__)
+		if (UseAVX2) {
+			HashPacketForTablesAVX2(p, layout, base, hashes);
+			return;
+		}
+#endif
+		HashPacketForTablesScalar(p, layout, base, hashes);
+	}
+
 	void PrintTuple(const Tuple& tuple) {
 		for (size_t d = 0; d < tuple.size(); d++) {
 			printf("%d ", tuple[d]);
@@ -271,13 +260,18 @@ inline uint32_t HashRuleAddress(const Rule& r) {
 	return (r.prefix_length[0] << 6) + r.prefix_length[1];
 }
 
+// A field is hashed on only if the tuple asks for more than this many bits
+static const int FieldThreshold[] = { 0, 0, 16, 16, 24 };
+
+inline bool UsesField(const Tuple& t, int d) {
+	return d <= FieldProto && t[d] > FieldThreshold[d];
+}
+
 inline vector<int> Dimify(const Tuple& t) {
 	vector<int> sol;
-	if (t[FieldSA] > 0) sol.push_back(FieldSA);
-	if (t[FieldDA] > 0) sol.push_back(FieldDA);
-	if (t[FieldSP] > 16) sol.push_back(FieldSP);
-	if (t[FieldDP] > 16) sol.push_back(FieldDP);
-	if (t[FieldProto] > 24) sol.push_back(FieldProto);
+	for (int d = FieldSA; d <= FieldProto; d++) {
+		if (UsesField(t, d)) sol.push_back(d);
+	}
 	return sol;
 }
 
@@ -293,38 +287,120 @@ inline vector<unsigned int> Lengthify(const Tuple& t, const vector<int> dims) {
 // SlottedTable
 // ************
 
-SlottedTable::SlottedTable(const Tuple& tuple) 
-	: dims(Dimify(tuple)), lengths(Lengthify(tuple, dims))
+Tuple TupleMergeUtils::TableTuple(const Tuple& tuple) {
+	Tuple result(tuple.size(), 0);
+	for (size_t d = 0; d < tuple.size(); d++) {
+		if (UsesField(tuple, d)) result[d] = tuple[d];
+	}
+	return result;
+}
+
+SlottedTable::SlottedTable(const Tuple& tuple, cmap_node_pool& pool) 
+	: pool(&pool), dims(Dimify(tuple)), lengths(Lengthify(tuple, dims)), tuple(TableTuple(tuple))
 {
+	InitMasks();
 	cmap_init(&map_in_tuple);
 }
 
+void SlottedTable::InitMasks() {
+	masks.fill(0);
+	for (size_t i = 0; i < dims.size(); i++) {
+		masks[dims[i]] = TupleMergeUtils::Mask(lengths[i]);
+	}
+}
+
+SlottedTable::~SlottedTable() {
+	delete filter.load();
+	cmap_cursor cursor = cmap_cursor_start(&map_in_tuple);
+	while (cursor.node != nullptr) {
+		cmap_node * node = cursor.node;
+		cmap_cursor_advance(&cursor);
+		delete node;
+	}
+	cmap_destroy(&map_in_tuple);
+}
+
 int SlottedTable::WorstAccesses() const {
 	// TODO
 	return 1;//cmap_largest_chain(&map_in_tuple);
 }
 
-int SlottedTable::ClassifyAPacket(const Packet& p) const {
-	
+int SlottedTable::ClassifyAPacket(const Packet& p, int priority_so_far) const {
+	return ClassifyAPacket(p, HashPacket(p), priority_so_far);
+}
+
+int SlottedTable::ClassifyAPacket(const Packet& p, uint32_t hash, int priority_so_far) const {
+	// Chains are kept in descending priority, so the first match wins
+	const cmap_node * found_node = cmap_find(&map_in_tuple, hash);
+	return MatchKernel::Run([&](auto k) __attribute__((always_inline)) {
+		while (found_node != nullptr && found_node->priority > priority_so_far) {
+			if (decltype(k)::Matches(p, *found_node)) {
+				return found_node->priority;
+			}
+			found_node = cmap_node_next(found_node);
+		}
+		return -1;
+	});
+}
+
+int SlottedTable::ClassifyAPacket(const Packet& p, int priority_so_far, Packet& wildcards) const {
+	// The hash picks the chain, and every rule looked at decides where to stop
+	for (int d = 0; d < MAXDIMENSIONS; d++) {
+		wildcards[d] |= masks[d];
+	}
 	cmap_node * found_node = cmap_find(&map_in_tuple, HashPacket(p));
-	int priority = -1;
-	while (found_node != nullptr) {
-		if (found_node->rule_ptr->MatchesPacket(p)) {
-			priority = std::max(priority, found_node->priority);
+	while (found_node != nullptr && found_node->priority > priority_so_far) {
+		if (MatchKernel::MatchesWildcarded(p, *found_node, wildcards)) {
+			return found_node->priority;
 		}
-		found_node = found_node->next;
+		found_node = cmap_node_next(found_node);
 	}
-	return priority;
+	return -1;
 }
 
-bool SlottedTable::IsThatTuple(const Tuple& tuple) const {
-	auto td = Dimify(tuple);
-	if (td == dims) {
-		auto ld = Lengthify(tuple, td);
-		return ld == lengths;
-	} else {
-		return false;
+size_t SlottedTable::ClassifyBatch(const Packet* packets, unsigned long map, int* priorities) const {
+	uint32_t hashes[CMAP_BATCH_SIZE];
+	const cmap_node * nodes[CMAP_BATCH_SIZE];
+	int i;
+	size_t filtered = 0;
+
+	const CountingBloomFilter* f = filter.load(std::memory_order_acquire);
+	ULLONG_FOR_EACH_1(i, map) {
+		hashes[i] = HashPacket(packets[i]);
+		if (f && !f->MayContain(hashes[i])) {
+			ULLONG_SET0(map, i);
+			filtered++;
+		}
+	}
+	if (!map) return filtered;
+	unsigned long found = cmap_find_batch(&map_in_tuple, map, hashes, nodes);
+
+	// Start fetching every chain before walking any of them
+	ULLONG_FOR_EACH_1(i, found) {
+		__builtin_prefetch(nodes[i]);
+	}
+	MatchKernel::Run([&](auto k) __attribute__((always_inline)) {
+		ULLONG_FOR_EACH_1(i, found) {
+			const cmap_node * found_node = nodes[i];
+			while (found_node != nullptr && found_node->priority > priorities[i]) {
+				if (decltype(k)::Matches(packets[i], *found_node)) {
+					priorities[i] = found_node->priority;
+					break;
+				}
+				found_node = cmap_node_next(found_node);
+			}
+		}
+		return 0;
+	});
+	return filtered;
+}
+
+bool SlottedTable::IsThatTuple(const Tuple& t) const {
+	if (t.size() != tuple.size()) return false;
+	for (size_t d = 0; d < t.size(); d++) {
+		if ((UsesField(t, d) ? t[d] : 0) != tuple[d]) return false;
 	}
+	return true;
 }
 
 bool SlottedTable::CanTakeRulesFrom(const SlottedTable* table) const {
@@ -349,17 +425,25 @@ size_t SlottedTable::NumCollisions(const Rule& r) const {
 	cmap_node * node = cmap_find(&map_in_tuple, HashRule(r));
 	while (node != nullptr) {
 		collide++;
-		node = node->next;
+		node = cmap_node_next_protected(node);
 	}
 	return collide;
 }
 
+bool SlottedTable::CanTakeRules(const vector<Rule>& rl, size_t limit) const {
+	unordered_map<uint32_t, size_t> added;
+	for (const Rule& r : rl) {
+		if (NumCollisions(r) + ++added[HashRule(r)] > limit) return false;
+	}
+	return true;
+}
+
 vector<Rule> SlottedTable::Collisions(const Rule& r) const {
 	vector<Rule> rules;
 	cmap_node * node = cmap_find(&map_in_tuple, HashRule(r));
 	while (node != nullptr) {
 		rules.push_back(*node->rule_ptr);
-		node = node->next;
+		node = cmap_node_next_protected(node);
 	}
 	return rules;
 }
@@ -376,36 +460,92 @@ vector<Rule> SlottedTable::GetRules() const {
 	return rules;
 }
 
+// Every field takes part in the hash, unused ones with a zero mask, so that
+// HashPacketForTables can hash for many tables in lockstep
 uint32_t inline SlottedTable::HashRule(const Rule& r) const {
-	uint32_t hash = HashBasis;
-	for (size_t i = 0; i < dims.size(); i++) {
-		hash *= HashMult;
-		hash += r.range[dims[i]][LowDim] & TupleMergeUtils::Mask(lengths[i]);
+	return HashPolicy::HashMasked<TupleMergeHash>(r, masks.data());
+}
+
+uint32_t inline SlottedTable::HashPacket(const Packet& p) const {
+	return HashPolicy::HashMasked<TupleMergeHash>(p, masks.data());
+}
+
+static void FreeNode(cmap_node * node) {
+	delete node;
+}
+
+void SlottedTable::EnableFilter(int countersPerRule) {
+	filterCounters = countersPerRule;
+	if (filterCounters > 0) {
+		Refilter(max(NumRules() + NumRules() / 4, 64));
 	}
-	return hash;
+}
 
+static void FreeFilter(CountingBloomFilter* f) {
+	delete f;
 }
 
-uint32_t inline SlottedTable::HashPacket(const Packet& p) const {
-	uint32_t hash = HashBasis;
-	for (size_t i = 0; i < dims.size(); i++) {
-		hash *= HashMult;
-		hash += p[dims[i]] & TupleMergeUtils::Mask(lengths[i]);
+void SlottedTable::Refilter(size_t capacity) {
+	CountingBloomFilter* f = new CountingBloomFilter(capacity, filterCounters);
+	cmap_cursor cursor = cmap_cursor_start(&map_in_tuple);
+	while (cursor.node != nullptr) {
+		f->Add(HashRule(*cursor.node->rule_ptr));
+		cmap_cursor_advance(&cursor);
+	}
+	CountingBloomFilter* old = filter.exchange(f, std::memory_order_release);
+	if (old) {
+		ovsrcu_postpone(FreeFilter, old);
 	}
-	return hash;
 }
 
 void SlottedTable::Insertion(const Rule& r, bool& priority_change) {
-	cmap_node * new_node = new cmap_node(r);
-	cmap_insert(&map_in_tuple, new_node, HashRule(r));
+	// Into the filter first, so that it never hides a rule the table has
+	CountingBloomFilter* f = filter.load(std::memory_order_relaxed);
+	if (f && (size_t)NumRules() >= f->Capacity()) {
+		Refilter(2 * f->Capacity());
+		f = filter.load(std::memory_order_relaxed);
+	}
+	if (f) {
+		f->Add(HashRule(r));
+	}
+	cmap_node * new_node = pool->make(r);
+	cmap_insert_ordered(&map_in_tuple, new_node, HashRule(r));
 
 	priority_container.insert(r.priority);
-	if (r.priority > maxPriority) {
-		maxPriority = r.priority;
+	if (r.priority > MaxPriority()) {
+		maxPriority.store(r.priority, std::memory_order_relaxed);
 		priority_change = true;
 	}
 	
 }
+void SlottedTable::Insertion(const vector<Rule>& rl) {
+	vector<cmap_node*> nodes;
+	vector<uint32_t> hashes;
+	nodes.reserve(rl.size());
+	hashes.reserve(rl.size());
+	for (const Rule& r : rl) {
+		nodes.push_back(pool->make(r));
+		hashes.push_back(HashRule(r));
+		priority_container.insert(r.priority);
+	}
+
+	CountingBloomFilter* f = filter.load(std::memory_order_relaxed);
+	if (f && (size_t)NumRules() + rl.size() > f->Capacity()) {
+		Refilter(max(2 * f->Capacity(), NumRules() + rl.size()));
+		f = filter.load(std::memory_order_relaxed);
+	}
+	if (f) {
+		for (uint32_t hash : hashes) {
+			f->Add(hash);
+		}
+	}
+	cmap_insert_bulk(&map_in_tuple, nodes.data(), hashes.data(), nodes.size());
+
+	if (!priority_container.empty() && *priority_container.rbegin() > MaxPriority()) {
+		maxPriority.store(*priority_container.rbegin(), std::memory_order_relaxed);
+	}
+}
+
 bool SlottedTable::Deletion(const Rule& r, bool& priority_change) {
 	auto pit = priority_container.equal_range(r.priority);
 	if (pit.first != pit.second) {
@@ -414,16 +554,21 @@ bool SlottedTable::Deletion(const Rule& r, bool& priority_change) {
 		while (found_node != nullptr) {
 			if (found_node->priority == r.priority) {
 				cmap_remove(&map_in_tuple, found_node, hash_r);
+				// A concurrent classifier may still be looking at it
+				ovsrcu_postpone(FreeNode, found_node);
+				if (CountingBloomFilter* f = filter.load(std::memory_order_relaxed)) {
+					f->Remove(hash_r);
+				}
 				break;
 			}
-			found_node = found_node->next;
+			found_node = cmap_node_next_protected(found_node);
 		}
 		priority_container.erase(pit.first);
 		if (priority_container.size() == 0)  {
-			maxPriority = -1;
+			maxPriority.store(-1, std::memory_order_relaxed);
 			priority_change = true;
-		} else if (r.priority == maxPriority) {
-			maxPriority = *priority_container.rbegin();
+		} else if (r.priority == MaxPriority()) {
+			maxPriority.store(*priority_container.rbegin(), std::memory_order_relaxed);
 			priority_change = true;
 		} //else priority_change = false;
 		return true;
@@ -26,7 +26,10 @@
 #include "../Simulation.h"
 
 #include "../OVS/TupleSpaceSearch.h"
+#include "../Utilities/HashPolicy.h"
+#include "CountingBloomFilter.h"
 
+#include <atomic>
 #include <unordered_set>
 
 namespace TupleMergeUtils {
@@ -37,6 +40,8 @@ namespace TupleMergeUtils {
 
 	uint32_t Mask(int bits);
 	bool CompatibilityCheck(const Tuple& ruleTuple, const Tuple& tableTuple);
+	// The tuple a table built from tuple hashes on: unused fields are 0
+	Tuple TableTuple(const Tuple& tuple);
 	bool AreSame(const Tuple& t1, const Tuple& t2);
 	void PreferedTuple(const Rule& r, Tuple& tuple);
 	void BestTuple(const std::vector<Rule>& rules, Tuple& tuple);
@@ -44,8 +49,18 @@ namespace TupleMergeUtils {
 	uint32_t Hash(const Packet& r, const Tuple& tuple);
 	
 	bool IsHashable(const std::vector<Rule>& rules, size_t collisionLimit);
+	// True if a table on tuple could take all of rules without building it
+	bool FitsTuple(const std::vector<Rule>& rules, const Tuple& tuple, size_t collisionLimit);
 	void PrintTuple(const Tuple& tuple);
 
+	// Number of tables HashPacketForTables hashes in one pass
+	const size_t HashLanes = 8;
+	// The field masks of a list of tables, one row per field, each row padded
+	// to a multiple of HashLanes
+	typedef std::array<std::vector<uint32_t>, MAXDIMENSIONS> MaskLayout;
+	// Computes the hash p has in each of tables base .. base + HashLanes - 1
+	void HashPacketForTables(const Packet& p, const MaskLayout& layout, size_t base, uint32_t* hashes);
+
 	struct TupleHasher {
 		std::size_t operator()(const Tuple& v) const {
 			int hash = 0;
@@ -75,17 +90,42 @@ namespace TupleMergeUtils {
 
 struct SlottedTable {
 public:
-	SlottedTable(const std::vector<int>& dims, const std::vector<unsigned int>& lengths) 
-			: dims(dims), lengths(lengths), maxPriority(-1) {
+	// Nodes come from pool, which is shared by the tables of a classifier
+	SlottedTable(const std::vector<int>& dims, const std::vector<unsigned int>& lengths, cmap_node_pool& pool) 
+			: pool(&pool), dims(dims), lengths(lengths), tuple(MAXDIMENSIONS, 0), maxPriority(-1) {
+		for (size_t i = 0; i < dims.size(); i++) {
+			tuple[dims[i]] = lengths[i];
+		}
+		InitMasks();
 		cmap_init(&map_in_tuple);
 	}
-	SlottedTable(const TupleMergeUtils::Tuple& tuple);
-	~SlottedTable() { cmap_destroy(&map_in_tuple); }
+	SlottedTable(const TupleMergeUtils::Tuple& tuple, cmap_node_pool& pool);
+	~SlottedTable();
 
 	bool IsEmpty() { return NumRules() == 0; }
 
-	int ClassifyAPacket(const Packet& p) const;
+	// Returns the priority of the best rule matching p, or -1 if no rule
+	// better than priority_so_far matches
+	int ClassifyAPacket(const Packet& p, int priority_so_far = -1) const;
+	// As above, for a packet whose hash for this table is already known
+	int ClassifyAPacket(const Packet& p, uint32_t hash, int priority_so_far) const;
+	// As above, also setting in wildcards the bits of p the result depends on
+	int ClassifyAPacket(const Packet& p, int priority_so_far, Packet& wildcards) const;
+	// Classifies packets[i] for each bit i set in map, raising priorities[i] on
+	// a match; returns how many of them the filter kept out of the hash table
+	size_t ClassifyBatch(const Packet* packets, unsigned long map, int* priorities) const;
+	// False if no rule in the table can have this hash; always true without
+	// a filter
+	bool MayContain(uint32_t hash) const {
+		const CountingBloomFilter* f = filter.load(std::memory_order_acquire);
+		return !f || f->MayContain(hash);
+	}
+	// Puts a filter of countersPerRule counters per rule in front of the hash
+	// table, sized for the rules there and grown as they grow
+	void EnableFilter(int countersPerRule);
 	void Insertion(const Rule& r, bool& priority_change);
+	// All of rl at once, into a table sized for them up front
+	void Insertion(const std::vector<Rule>& rl);
 	bool Deletion(const Rule& r, bool& priority_change);
 	
 	bool CanInsert(const TupleMergeUtils::Tuple& tuple) const {
@@ -95,10 +135,13 @@ public:
 		return true;
 	}
 	bool IsThatTuple(const TupleMergeUtils::Tuple& tuple) const;
+	const TupleMergeUtils::Tuple& GetTuple() const { return tuple; }
 	bool CanTakeRulesFrom(const SlottedTable* table) const;
 	bool HaveSameTuple(const SlottedTable* table) const;
 	
 	size_t NumCollisions(const Rule& r) const;
+	// True if adding all of rl would keep every hash chain within limit
+	bool CanTakeRules(const std::vector<Rule>& rl, size_t limit) const;
 	std::vector<Rule> Collisions(const Rule& r) const;
 	std::vector<Rule> GetRules() const;
 	
@@ -106,22 +149,34 @@ public:
 	int NumRules() const  {
 		return cmap_count(&map_in_tuple);
 	}
-	Memory MemSizeBytes(Memory ruleSizeBytes) const {
-		return 	cmap_count(&map_in_tuple)* ruleSizeBytes + cmap_array_size(&map_in_tuple) * POINTER_SIZE_BYTES;
+	// Not counting the nodes, which the classifier counts with its pool
+	Memory MemSizeBytes() const {
+		const CountingBloomFilter* f = filter.load(std::memory_order_relaxed);
+		return cmap_memory_size(&map_in_tuple) + (f ? f->MemSizeBytes() : 0);
 	}
 
-	int MaxPriority() const { return maxPriority; };
+	int MaxPriority() const { return maxPriority.load(std::memory_order_relaxed); };
+	// Mask applied to each field before hashing; 0 for unused fields
+	const std::array<uint32_t, MAXDIMENSIONS>& Masks() const { return masks; }
 	
 protected:
+	void InitMasks();
+	void Refilter(size_t capacity);
 	uint32_t inline HashRule(const Rule& r) const;
 	uint32_t inline HashPacket(const Packet& p) const;
 	
 	cmap map_in_tuple;
+	cmap_node_pool* pool;
 
 	std::vector<int> dims;
 	std::vector<unsigned int> lengths;
+	TupleMergeUtils::Tuple tuple; // As given by TableTuple
+	std::array<uint32_t, MAXDIMENSIONS> masks;
 	
-	int maxPriority = -1;
+	std::atomic<int> maxPriority{ -1 }; // Read by concurrent classifiers
 	std::multiset<int> priority_container;
+
+	std::atomic<CountingBloomFilter*> filter{ nullptr }; // Of the hashes of the rules
+	int filterCounters = 0;
 };
 
@@ -0,0 +1,259 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "TupleMergeHybrid.h"
+#include "TupleMergeOffline.h"
+
+using namespace std;
+
+TupleMergeHybrid::TupleMergeHybrid(const unordered_map<string, string>& args, bool background)
+	: settings(args), background(background),
+	driftTables(GetDoubleOrElse(args, "TM.Hybrid.Tables", 1.5)),
+	driftProbes(GetDoubleOrElse(args, "TM.Hybrid.Probes", 1.5)),
+	interval(GetIntOrElse(args, "TM.Hybrid.Interval", 1000)),
+	serving(new TupleMergeOffline(args)), waiting(false), rebuilding(false), rebuilds(0) {
+	ResetQueryStats(1);
+}
+
+TupleMergeHybrid::~TupleMergeHybrid() {
+	Settle();
+	delete serving.load();
+}
+
+void TupleMergeHybrid::ConstructClassifier(const vector<Rule>& rules) {
+	Settle();
+	lock_guard<mutex> lock(updating);
+	TupleMergeOnline* old = Swap(Build(rules));
+	this->rules = rules;
+	rebuilds = 0;
+	WaitForReaders(old);
+	lock_guard<mutex> retire(retiring);
+	delete old;
+}
+
+void TupleMergeHybrid::ResetQueryStats(size_t threads) {
+	PacketClassifier::ResetQueryStats(threads);
+	if (numReaders < ThreadSlots(threads)) {
+		// A rebuild under way may be looking at the slots
+		Settle();
+		numReaders = ThreadSlots(threads);
+		readers.reset(new ReaderSlot[numReaders]);
+	}
+}
+
+int TupleMergeHybrid::ClassifyAPacket(const Packet& p) {
+	size_t t = ThreadNumber();
+	if (t + 1 >= numReaders) {
+		lock_guard<mutex> lock(sharedReader);
+		return Classify(readers[numReaders - 1], p);
+	}
+	return Classify(readers[t], p);
+}
+
+int TupleMergeHybrid::Classify(ReaderSlot& slot, const Packet& p) {
+	// Name the build, then make sure it is still served: either this sees
+	// a swap, or the swapping thread sees the slot (both are seq_cst)
+	TupleMergeOnline* build = serving.load(std::memory_order_acquire);
+	for (;;) {
+		slot.build.store(build);
+		TupleMergeOnline* now = serving.load();
+		if (now == build) break;
+		build = now;
+	}
+	int q;
+	int prior = build->ClassifyCounted(p, q);
+	slot.build.store(nullptr, std::memory_order_release);
+	QueryUpdate(q);
+	return prior;
+}
+
+void TupleMergeHybrid::WaitForReaders(const TupleMergeOnline* old) const {
+	for (size_t i = 0; i < numReaders; i++) {
+		while (readers[i].build.load() == old) {
+			this_thread::yield();
+		}
+	}
+}
+
+void TupleMergeHybrid::InsertRule(const Rule& r) {
+	YieldToRebuild();
+	lock_guard<mutex> lock(updating);
+	serving.load(std::memory_order_relaxed)->InsertRule(r);
+	rules.push_back(r);
+	if (logging) {
+		log.push_back({ true, r, 0 });
+	}
+	if (!rebuilding && Drifted()) {
+		Rebuild();
+	}
+}
+
+void TupleMergeHybrid::DeleteRule(size_t index) {
+	YieldToRebuild();
+	lock_guard<mutex> lock(updating);
+	serving.load(std::memory_order_relaxed)->DeleteRule(index);
+	rules[index] = rules[rules.size() - 1];
+	rules.pop_back();
+	if (logging) {
+		log.push_back({ false, Rule(), index });
+	}
+	if (!rebuilding && Drifted()) {
+		Rebuild();
+	}
+}
+
+Memory TupleMergeHybrid::MemSizeBytes() const {
+	lock_guard<mutex> lock(retiring);
+	return serving.load()->MemSizeBytes() + rules.size() * sizeof(Rule);
+}
+
+int TupleMergeHybrid::MemoryAccess() const {
+	lock_guard<mutex> lock(retiring);
+	return serving.load()->MemoryAccess();
+}
+
+size_t TupleMergeHybrid::NumTables() const {
+	lock_guard<mutex> lock(retiring);
+	return serving.load()->NumTables();
+}
+
+size_t TupleMergeHybrid::RulesInTable(size_t index) const {
+	lock_guard<mutex> lock(retiring);
+	return serving.load()->RulesInTable(index);
+}
+
+size_t TupleMergeHybrid::PriorityOfTable(size_t index) const {
+	lock_guard<mutex> lock(retiring);
+	return serving.load()->PriorityOfTable(index);
+}
+
+void TupleMergeHybrid::Settle() {
+	if (builder.joinable()) {
+		builder.join();
+	}
+}
+
+TupleMergeOnline* TupleMergeHybrid::Build(const vector<Rule>& rules) const {
+	TupleMergeOnline* classifier = new TupleMergeOffline(settings);
+	// Drifted watches the probes per packet
+	classifier->EnableProbeCounts();
+	classifier->ConstructClassifier(rules);
+	return classifier;
+}
+
+void TupleMergeHybrid::Apply(TupleMergeOnline* classifier, const Update& u) {
+	if (u.insert) {
+		classifier->InsertRule(u.rule);
+	} else {
+		classifier->DeleteRule(u.index);
+	}
+}
+
+TupleMergeOnline* TupleMergeHybrid::Swap(TupleMergeOnline* next) {
+	TupleMergeOnline* old = serving.exchange(next);
+	logging = false;
+	log.clear();
+	updates = 0;
+	builtTables = next->NumTables();
+	builtProbes = measuredProbes = 0;
+	next->ProbeTotals(seenPackets, seenProbes);
+	rebuilds++;
+	return old;
+}
+
+bool TupleMergeHybrid::Drifted() {
+	const TupleMergeOnline* current = serving.load(std::memory_order_relaxed);
+	// Probes per packet over windows of enough packets; the first window
+	// after a build is what later ones are held to
+	const uint64_t enough = 4096;
+	uint64_t packets, probes;
+	current->ProbeTotals(packets, probes);
+	if (packets - seenPackets >= enough) {
+		double mean = 1.0 * (probes - seenProbes) / (packets - seenPackets);
+		seenPackets = packets;
+		seenProbes = probes;
+		if (builtProbes == 0) {
+			builtProbes = mean;
+		} else {
+			measuredProbes = mean;
+		}
+	}
+	if (++updates < interval) return false;
+	return current->NumTables() > builtTables * driftTables
+		|| measuredProbes > builtProbes * driftProbes;
+}
+
+void TupleMergeHybrid::Rebuild() {
+	if (!background) {
+		TupleMergeOnline* old = Swap(Build(rules));
+		WaitForReaders(old);
+		lock_guard<mutex> lock(retiring);
+		delete old;
+		return;
+	}
+	// The last rebuild is done once rebuilding is clear
+	Settle();
+	rebuilding = true;
+	logging = true;
+	builder = thread(&TupleMergeHybrid::RebuildInBackground, this, rules);
+}
+
+void TupleMergeHybrid::RebuildInBackground(vector<Rule> rules) {
+	// A team of threads for the build would spin against the classifiers
+	omp_set_num_threads(1);
+	TupleMergeOnline* next = Build(rules);
+
+	// Catch up on the updates made meanwhile.  Only the last few are
+	// replayed with the lock held, so updates are held up briefly; if they
+	// keep outrunning the replay, the lock is taken for the rest anyway.
+	const size_t catchUp = 64;
+	const int rounds = 8;
+	size_t replayed = 0;
+	TupleMergeOnline* old;
+	for (int round = 0; ; round++) {
+		waiting = true;
+		unique_lock<mutex> lock(updating);
+		waiting = false;
+		if (log.size() - replayed <= catchUp || round == rounds) {
+			for (size_t i = replayed; i < log.size(); i++) {
+				Apply(next, log[i]);
+			}
+			old = Swap(next);
+			break;
+		}
+		vector<Update> pending(log.begin() + replayed, log.end());
+		lock.unlock();
+		for (const Update& u : pending) {
+			Apply(next, u);
+		}
+		replayed += pending.size();
+	}
+
+	// Classifiers may still be probing the old build
+	WaitForReaders(old);
+	{
+		lock_guard<mutex> lock(retiring);
+		delete old;
+	}
+	rebuilding = false;
+}
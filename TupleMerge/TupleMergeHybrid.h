@@ -0,0 +1,134 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include "TupleMergeOnline.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Serves lookups from a TupleMergeOffline build and applies updates to it
+// through the online algorithm.  Online updates leave more tables than the
+// offline algorithm would pick, so once the tables drift far enough from the
+// last build (more tables, or more probed per packet), a fresh offline build
+// of the current rules replaces the one serving lookups.
+//
+// With background set, the rebuild runs on its own thread.  Updates keep
+// landing in the classifier being served and are logged, and the rebuild
+// replays the log before it swaps itself in.  Otherwise the update that
+// notices the drift rebuilds in place.  Either way, a replaced build is freed
+// only once no classifying thread is probing it: each names the build it is
+// probing in a slot of its own, and threads numbered past the slots (see
+// ThreadNumber) share the last, one at a time.
+//
+// The slots cover only that swap.  Within a build, updates retire tables
+// through OVS/ovs-rcu.h, so threads that classify while updates run must
+// still follow its rules, as ConcurrentUpdates says: with no thread online,
+// ovsrcu_postpone runs its callbacks at once.
+class TupleMergeHybrid : public PacketClassifier {
+public:
+	TupleMergeHybrid(const std::unordered_map<std::string, std::string>& args, bool background);
+	~TupleMergeHybrid();
+	TupleMergeHybrid(const TupleMergeHybrid&) = delete;
+	TupleMergeHybrid& operator=(const TupleMergeHybrid&) = delete;
+
+	virtual void ConstructClassifier(const std::vector<Rule>& rules);
+	virtual int ClassifyAPacket(const Packet& p);
+	virtual void DeleteRule(size_t index);
+	virtual void InsertRule(const Rule& r);
+	virtual Memory MemSizeBytes() const;
+	virtual int MemoryAccess() const;
+	virtual size_t NumTables() const;
+	virtual size_t RulesInTable(size_t index) const;
+	virtual size_t PriorityOfTable(size_t index) const;
+	virtual bool ConcurrentUpdates() const { return true; }
+	// Also makes room for the slots of up to threads callers
+	virtual void ResetQueryStats(size_t threads);
+
+	// Builds swapped in since ConstructClassifier
+	size_t Rebuilds() const { return rebuilds.load(); }
+	// Waits for a rebuild under way to be swapped in
+	void Settle();
+
+private:
+	// An update made while a rebuild was under way
+	struct Update {
+		bool insert;
+		Rule rule;    // Inserted
+		size_t index; // Deleted
+	};
+
+	// The build a classifying thread is probing, or nullptr
+	struct ReaderSlot {
+		std::atomic<const TupleMergeOnline*> build{nullptr};
+		char pad[64];
+	};
+
+	int Classify(ReaderSlot& slot, const Packet& p);
+	// Waits until no classifying thread is probing old, which is no longer
+	// being served, so that it can be freed
+	void WaitForReaders(const TupleMergeOnline* old) const;
+
+	void YieldToRebuild() {
+		while (waiting.load(std::memory_order_acquire)) std::this_thread::yield();
+	}
+	TupleMergeOnline* Build(const std::vector<Rule>& rules) const;
+	static void Apply(TupleMergeOnline* classifier, const Update& u);
+	// With the lock held: puts next in service and returns the old build
+	TupleMergeOnline* Swap(TupleMergeOnline* next);
+	// With the lock held, after each update
+	bool Drifted();
+	void Rebuild();
+	void RebuildInBackground(std::vector<Rule> rules);
+
+	std::unordered_map<std::string, std::string> settings;
+	bool background;
+	double driftTables; // Rebuild above this many times the tables of the last build
+	double driftProbes; // or this many times the probes per packet measured after it
+	int interval;       // Updates to wait after a rebuild before looking for drift
+
+	std::atomic<TupleMergeOnline*> serving;
+	std::unique_ptr<ReaderSlot[]> readers; // By ThreadNumber(), the last shared by the threads past the others
+	size_t numReaders = 0;
+	std::mutex sharedReader; // Held while classifying through the last slot
+	std::vector<Rule> rules; // As held by serving, in the same order
+
+	std::mutex updating; // Held by updates, and by rebuilds to swap
+	std::atomic<bool> waiting; // A rebuild wants updating; updates let it go first
+	mutable std::mutex retiring; // Held to look at serving outside updates, and to free a build
+	std::thread builder;
+	std::atomic<bool> rebuilding;
+	bool logging = false;
+	std::vector<Update> log;
+	std::atomic<size_t> rebuilds;
+
+	// Drift since the last build
+	int updates = 0;
+	size_t builtTables = 0;
+	double builtProbes = 0;    // 0 until a window of packets has been measured
+	double measuredProbes = 0; // In the latest window since then
+	uint64_t seenPackets = 0, seenProbes = 0;
+};
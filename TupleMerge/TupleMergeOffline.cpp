@@ -30,16 +30,17 @@ using namespace TupleMergeUtils;
 // TupleMergeOffline
 // ************
 TupleMergeOffline::TupleMergeOffline(const unordered_map<string, string>& args) : TupleMergeOnline(args) {
-	collideLimit = GetIntOrElse(args, "TM.Limit.Offline.Collide", collideLimit);
+	ReadCollideLimit(args, "TM.Limit.Offline.Collide");
 }
 
 TupleMergeOffline::~TupleMergeOffline() {
-	for (auto table : tables) {
-		delete table;
-	}
+	// Tables are owned and freed by ~TupleMergeOnline
 }
 
 void TupleMergeOffline::ConstructClassifier(const vector<Rule>& rules) {
+	if (tuneLimit && !rules.empty()) {
+		collideLimit = TuneCollideLimit(rules);
+	}
 	this->rules = rules;
 	
 	vector<Rule> remain = rules;
@@ -52,14 +53,33 @@ void TupleMergeOffline::ConstructClassifier(const vector<Rule>& rules) {
 }
 
 vector<Rule> TupleMergeOffline::SelectTable(const vector<Rule>& rules) {
-	Tuple bestTuple;
-	size_t bestIndex = 0;
-	size_t bestSize = 0;
-	
+	// Group the rules by prefered tuple: whether a rule fits a candidate
+	// only depends on its tuple
+	RuleTuples rt;
+	rt.tupleOf.resize(rules.size());
+	{
+		TupleMap<int> ids;
+		for (size_t i = 0; i < rules.size(); i++) {
+			Tuple t;
+			PreferedTuple(rules[i], t);
+			auto it = ids.find(t);
+			if (it == ids.end()) {
+				it = ids.emplace(t, rt.tuples.size()).first;
+				rt.tuples.push_back(t);
+				rt.firstWith.push_back(i);
+				rt.count.push_back(0);
+			}
+			rt.tupleOf[i] = it->second;
+			rt.count[it->second]++;
+		}
+	}
+
+	// The candidates are the running minimum of the prefered tuples, each
+	// time it shrinks
+	vector<Tuple> candidates;
 	Tuple current;
-	for (const Rule& r : rules) {
-		Tuple t;
-		PreferedTuple(r, t);
+	for (size_t i = 0; i < rules.size(); i++) {
+		const Tuple& t = rt.tuples[rt.tupleOf[i]];
 		bool hasChanged = false;
 		if (current.empty()) {
 			current = t;
@@ -72,73 +92,127 @@ vector<Rule> TupleMergeOffline::SelectTable(const vector<Rule>& rules) {
 			}
 		}
 		if (hasChanged) {
-			size_t firstOut = rules.size();
-			size_t size = 0;
-			unordered_map<uint32_t, size_t> hashCounts;
-			for (size_t i = 0; i < rules.size(); i++) {
-				Tuple ti;
-				PreferedTuple(rules[i], ti);
-				if (CompatibilityCheck(ti, current)) {
-					uint32_t hash = Hash(rules[i], current);
-					hashCounts[hash]++;
-					if (hashCounts[hash] > collideLimit) {
-						firstOut = min(firstOut, i);
-					} else {
-						size++;
-					}
-				} else {
-					firstOut = min(firstOut, i);
-				}
-				if (firstOut < bestIndex) {
-					goto breakout;
-				}
-			}
-			
-			if (firstOut > bestIndex || size > bestSize) {
-				bestTuple = current;
-				bestIndex = firstOut;
-				bestSize = size;
+			candidates.push_back(current);
+		}
+	}
+
+	// Score a round of candidates in parallel, then go through the round in
+	// order, stopping at the first candidate that gives up earlier than the
+	// best so far
+	Tuple bestTuple;
+	size_t bestIndex = 0;
+	size_t bestSize = 0;
+	const int round = omp_get_max_threads();
+	vector<CandidateScore> scores(round);
+	for (int first = 0; first < (int)candidates.size(); first += round) {
+		int last = min<int>(candidates.size(), first + round);
+		#pragma omp parallel for schedule(dynamic)
+		for (int c = first; c < last; c++) {
+			scores[c - first] = ScoreCandidate(rules, rt, candidates[c], bestIndex);
+		}
+
+		bool stop = false;
+		for (int c = first; c < last && !stop; c++) {
+			const CandidateScore& score = scores[c - first];
+			if (score.cut || score.firstOut < bestIndex) {
+				stop = true;
+			} else if (score.firstOut > bestIndex || score.size > bestSize) {
+				bestTuple = candidates[c];
+				bestIndex = score.firstOut;
+				bestSize = score.size;
 			}
 		}
+		if (stop) break;
 	}
-breakout:
 	
-	SlottedTable* table = new SlottedTable(bestTuple);
-	vector<Rule> remain;
-	for (const Rule& r : rules) {
-		Tuple tr;
-		PreferedTuple(r, tr);
-		if (table->CanInsert(tr)) {
-			if (table->NumCollisions(r) < collideLimit) {
-				bool ignore;
-				table->Insertion(r, ignore);
+	// Pick the table's rules first, counting rules per hash value as the
+	// table would, so that it can be built in one go
+	SlottedTable* table = new SlottedTable(bestTuple, pool);
+	const Tuple& tuple = table->GetTuple();
+	size_t slots = 16;
+	while (slots < 2 * rules.size()) slots <<= 1;
+	vector<uint32_t> hashes(slots);
+	vector<size_t> hashCounts(slots, 0);
+	vector<Rule> taken, remain;
+	taken.reserve(bestSize);
+	remain.reserve(rules.size() - bestSize);
+	for (size_t i = 0; i < rules.size(); i++) {
+		const Rule& r = rules[i];
+		if (table->CanInsert(rt.tuples[rt.tupleOf[i]])) {
+			uint32_t hash = Hash(r, tuple);
+			size_t slot = (hash * 2654435761u) & (slots - 1);
+			while (hashCounts[slot] != 0 && hashes[slot] != hash) {
+				slot = (slot + 1) & (slots - 1);
+			}
+			hashes[slot] = hash;
+			if (hashCounts[slot]++ < collideLimit) {
+				taken.push_back(r);
 				assignments[r.priority] = table;
-			} else {
-				remain.push_back(r);
+				continue;
 			}
-		} else {
-			remain.push_back(r);
 		}
+		remain.push_back(r);
 	}
-	tables.push_back(table);
+	table->Insertion(taken);
+	AddTable(table);
 	return remain;
 }
 
+TupleMergeOffline::CandidateScore TupleMergeOffline::ScoreCandidate(const vector<Rule>& rules, const RuleTuples& rt, const Tuple& candidate, size_t cutBelow) const {
+	CandidateScore score = { rules.size(), 0, false };
+
+	vector<bool> compatible(rt.tuples.size());
+	size_t compatibleRules = 0;
+	for (size_t g = 0; g < rt.tuples.size(); g++) {
+		compatible[g] = CompatibilityCheck(rt.tuples[g], candidate);
+		if (compatible[g]) {
+			compatibleRules += rt.count[g];
+		} else {
+			score.firstOut = min(score.firstOut, rt.firstWith[g]);
+		}
+	}
+
+	// Rules per hash value, in an open addressing table at most half full
+	size_t slots = 16;
+	while (slots < 2 * compatibleRules) slots <<= 1;
+	vector<uint32_t> hashes(slots);
+	vector<size_t> hashCounts(slots, 0);
+	for (size_t i = 0; i < rules.size() && score.firstOut >= cutBelow; i++) {
+		if (compatible[rt.tupleOf[i]]) {
+			uint32_t hash = Hash(rules[i], candidate);
+			size_t slot = (hash * 2654435761u) & (slots - 1);
+			while (hashCounts[slot] != 0 && hashes[slot] != hash) {
+				slot = (slot + 1) & (slots - 1);
+			}
+			hashes[slot] = hash;
+			if (++hashCounts[slot] > collideLimit) {
+				score.firstOut = min(score.firstOut, i);
+			} else {
+				score.size++;
+			}
+		}
+	}
+	// firstOut never grows, so once below the best index found before this
+	// round, the candidate would stop the search whatever else happens
+	score.cut = score.firstOut < cutBelow;
+	return score;
+}
+
 void TupleMergeOffline::CombineTables() {
-	for (auto i1 = tables.begin(); i1 != tables.end(); i1++) {
-		for (auto i2 = i1 + 1; i2 != tables.end();) {
-			if ((*i1)->CanTakeRulesFrom(*i2)) {
+	for (size_t i1 = 0; i1 < tables.size(); i1++) {
+		for (size_t i2 = i1 + 1; i2 < tables.size();) {
+			if (tables[i1]->CanTakeRulesFrom(tables[i2])) {
 				// If all rules from i2 can go into i1, transfer them
 				// Don't worry about collision limits
 				// Then delete i2
-				vector<Rule> rl = (*i2)->GetRules();
+				SlottedTable* merged = tables[i2];
+				vector<Rule> rl = merged->GetRules();
+				tables[i1]->Insertion(rl);
 				for (Rule& r : rl) {
-					bool ignore;
-					(*i1)->Insertion(r, ignore);
-					assignments[r.priority] = *i1;
+					assignments[r.priority] = tables[i1];
 				}
-				delete (*i2);
-				i2 = tables.erase(i2);
+				RemoveTable(merged, merged->MaxPriority());
+				delete merged;
 			} else {
 				i2++;
 			}
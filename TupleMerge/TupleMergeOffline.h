@@ -37,7 +37,25 @@ public:
 	void ConstructClassifier(const std::vector<Rule>& rules) override;
 	
 private:
+	// The distinct prefered tuples among a list of rules
+	struct RuleTuples {
+		std::vector<TupleMergeUtils::Tuple> tuples;
+		std::vector<int> tupleOf;      // Per rule, index into tuples
+		std::vector<size_t> firstWith; // Per tuple, first rule that has it
+		std::vector<size_t> count;     // Per tuple, rules that have it
+	};
+	// How far down the rule list a candidate tuple gets before it has to
+	// leave a rule out, and how many rules it takes
+	struct CandidateScore {
+		size_t firstOut;
+		size_t size;
+		bool cut; // Gave up early, as firstOut fell below the bar
+	};
+
 	std::vector<Rule> SelectTable(const std::vector<Rule>& rules);
+	CandidateScore ScoreCandidate(const std::vector<Rule>& rules, const RuleTuples& rt, const TupleMergeUtils::Tuple& candidate, size_t cutBelow) const;
 	void CombineTables();
+
+	TupleMergeOnline* MakeScratch() const override { return new TupleMergeOffline(settings); }
 };
 
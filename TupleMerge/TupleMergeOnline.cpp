@@ -22,6 +22,12 @@
  * SOFTWARE.
  */
 #include "TupleMergeOnline.h"
+#include "TupleMergeSnapshot.h"
+#include "../OVS/ovs-rcu.h"
+
+#include <chrono>
+#include <limits>
+#include <random>
 
 using namespace std;
 using namespace ForgeUtils;
@@ -79,35 +85,138 @@ size_t CollisionsForTuple(const std::vector<Rule>& rules, const Tuple& tuple) {
 // ************
 
 TupleMergeOnline::TupleMergeOnline(const std::unordered_map<std::string, std::string>& args) 
-	: collideLimit(GetIntOrElse(args, "TM.Limit.Collide", 10)) {
+	: published(new TableList), collideLimit(10),
+	tunePackets(GetIntOrElse(args, "TM.Limit.Auto.Packets", 20000)),
+	tuneMemory(GetUIntOrElse(args, "TM.Limit.Auto.Memory", 0)),
+	settings(args),
+	filterCounters(GetIntOrElse(args, "TM.Filter", 0)),
+	compactEnabled(GetIntOrElse(args, "TM.Compact", 0) != 0),
+	compactTables(GetIntOrElse(args, "TM.Compact.Tables", 32)),
+	compactProbes(GetDoubleOrElse(args, "TM.Compact.Probes", 8.0)),
+	compactSparse(GetIntOrElse(args, "TM.Compact.Sparse", 4)),
+	compactInterval(GetIntOrElse(args, "TM.Compact.Interval", 1000)),
+	compactChecks(GetIntOrElse(args, "TM.Compact.Checks", 256)) {
+	countProbes = compactEnabled || filterCounters > 0;
+	ReadCollideLimit(args, "TM.Limit.Collide");
+	vector<string> candidates;
+	Split(GetOrElse(args, "TM.Limit.Auto.Candidates", "1,2,4,6,8,12,16,24,32"), ',', candidates);
+	for (const string& c : candidates) {
+		tuneCandidates.push_back(stoi(c));
+	}
 }
 
 TupleMergeOnline::~TupleMergeOnline() {
+	// Let the tables and lists retired by the last updates go first
+	ovsrcu_synchronize();
+	delete published.load();
 	for (auto t : tables) {
 		delete t;
 	}
 }
 
+static void FreeTable(SlottedTable* table) {
+	delete table;
+}
+
 void TupleMergeOnline::ConstructClassifier(const std::vector<Rule>& rules) {
+	if (tuneLimit && !rules.empty()) {
+		collideLimit = TuneCollideLimit(rules);
+	}
+	// No compaction while building: later rules may fill the sparse tables
 	for (const Rule& r : rules) {
-		InsertRule(r);
+		Insert(r);
 	}
 }
 
 int TupleMergeOnline::ClassifyAPacket(const Packet& p) {
+	int q;
+	int prior = ClassifyCounted(p, q);
+	QueryUpdate(q);
+	return prior;
+}
+
+int TupleMergeOnline::ClassifyCounted(const Packet& p, int& q) {
+	const TableList* list = published.load(std::memory_order_acquire);
+	const auto& tables = list->tables;
+	int prior = -1;
+	int filtered = 0;
+	q = 0;
+	// Hashes are computed a group of tables at a time, and only for groups
+	// that contain a table worth probing
+	uint32_t hashes[HashLanes];
+	size_t hashedBase = tables.size();
+	for (size_t i = 0; i < tables.size(); i++) {
+		if (tables[i]->MaxPriority() > prior) {
+			size_t base = i - i % HashLanes;
+			if (base != hashedBase) {
+				HashPacketForTables(p, list->masks, base, hashes);
+				hashedBase = base;
+			}
+			q++;
+			if (!tables[i]->MayContain(hashes[i - base])) {
+				filtered++;
+				continue;
+			}
+			prior = max(prior, tables[i]->ClassifyAPacket(p, hashes[i - base], prior));
+		}
+	}
+	CountProbes(1, q, filtered);
+	return prior;
+}
+
+int TupleMergeOnline::ClassifyWildcarded(const Packet& p, Packet& wildcards) {
+	const TableList* list = published.load(std::memory_order_acquire);
+	const auto& tables = list->tables;
 	int prior = -1;
 	int q = 0;
-	for (auto & t : tables) {
-		if (t->MaxPriority() > prior) {
-			prior = max(prior, t->ClassifyAPacket(p));
+	// Whether a table is probed depends only on the results so far, so only
+	// the tables probed add bits
+	for (size_t i = 0; i < tables.size(); i++) {
+		if (tables[i]->MaxPriority() > prior) {
+			prior = max(prior, tables[i]->ClassifyAPacket(p, prior, wildcards));
 			q++;
 		}
 	}
 	QueryUpdate(q);
+	CountProbes(1, q, 0);
 	return prior;
 }
 
+void TupleMergeOnline::ClassifyBatch(const Packet* packets, size_t n, int* results) {
+	const auto& tables = published.load(std::memory_order_acquire)->tables;
+	for (size_t offset = 0; offset < n; offset += CMAP_BATCH_SIZE) {
+		size_t count = min(n - offset, CMAP_BATCH_SIZE);
+		const Packet* burst = packets + offset;
+		int* prior = results + offset;
+		int q[CMAP_BATCH_SIZE] = { 0 };
+		size_t filtered = 0;
+
+		fill(prior, prior + count, -1);
+		for (auto & t : tables) {
+			// Only probe for packets that this table could still improve
+			unsigned long map = 0;
+			for (size_t i = 0; i < count; i++) {
+				if (t->MaxPriority() > prior[i]) {
+					ULLONG_SET1(map, i);
+					q[i]++;
+				}
+			}
+			// Not a break: while an update is running, the list can be
+			// briefly out of priority order
+			if (!map) continue;
+			filtered += t->ClassifyBatch(burst, map, prior);
+		}
+		size_t probes = 0;
+		for (size_t i = 0; i < count; i++) {
+			QueryUpdate(q[i]);
+			probes += q[i];
+		}
+		CountProbes(count, probes, filtered);
+	}
+}
+
 void TupleMergeOnline::DeleteRule(size_t index){
+	Compact();
 	Rule r = rules[index];
 	rules[index] = rules[rules.size() - 1];
 	rules.pop_back();
@@ -115,16 +224,18 @@ void TupleMergeOnline::DeleteRule(size_t index){
 	SlottedTable* tbl = assignments[r.priority];
 	assignments.erase(r.priority);
 
-	bool hasChanged;
+	int before = tbl->MaxPriority();
+	bool hasChanged = false;
 	tbl->Deletion(r, hasChanged);
 
 	if (tbl->IsEmpty()) {
-		tables.erase(find(tables.begin(), tables.end(), tbl), tables.end());
-		delete tbl;
-	}
-
-	if (hasChanged) {
-		Resort();
+		RemoveTable(tbl, before);
+		Publish();
+		// Classifiers may still be probing it through an older list
+		ovsrcu_postpone(FreeTable, tbl);
+	} else if (hasChanged) {
+		Reposition(tbl, before);
+		Publish();
 	}
 }
 
@@ -151,79 +262,380 @@ void Relax(Tuple& tuple) {
 }
 
 void TupleMergeOnline::InsertRule(const Rule& rule) {
+	Compact();
+	Insert(rule);
+}
+
+void TupleMergeOnline::Insert(const Rule& rule) {
 	rules.push_back(rule);
 	Tuple tuple;
 	PreferedTuple(rule, tuple);
 	
-	for (auto table : tables) {
-		if (table->CanInsert(tuple)) {
-			bool hasChanged = false;
-			table->Insertion(rule, hasChanged);
-			assignments[rule.priority] = table;
-			
-			if (table->NumCollisions(rule) > collideLimit) {
-				// Split Table
-				vector<Rule> collisions = table->Collisions(rule);
-				Tuple compatTuple;
-				BestTuple(collisions, compatTuple);
-				Tuple superTuple = compatTuple;
-				for (const Rule& r : collisions) {
-					Tuple t;
-					PreferedTuple(r, t);
-					for (size_t d = 0; d < tuple.size(); d++) {
-						superTuple[d] = max(superTuple[d], t[d]);
-					}
-				}
-				size_t bestD = 0;
-				int bestDelta = 0;
+	SlottedTable* table = FirstAcceptor(tuple);
+	if (table) {
+		int before = table->MaxPriority();
+		bool hasChanged = false;
+		table->Insertion(rule, hasChanged);
+		assignments[rule.priority] = table;
+		if (hasChanged) {
+			Reposition(table, before);
+		}
+		
+		if (table->NumCollisions(rule) > collideLimit) {
+			// Split Table
+			vector<Rule> collisions = table->Collisions(rule);
+			Tuple compatTuple;
+			BestTuple(collisions, compatTuple);
+			Tuple superTuple = compatTuple;
+			for (const Rule& r : collisions) {
+				Tuple t;
+				PreferedTuple(r, t);
 				for (size_t d = 0; d < tuple.size(); d++) {
-					int delta = superTuple[d] - compatTuple[d];
-					if (delta > bestDelta) {
-						bestD = d;
-						bestDelta = delta;
-					}
+					superTuple[d] = max(superTuple[d], t[d]);
 				}
-				compatTuple[bestD] = (superTuple[bestD] + compatTuple[bestD]) / 2;
-				SlottedTable* target = FindOrMake(compatTuple);
-				
-				vector<Rule> rl = table->GetRules();
-				for (Rule& r : rl) {
-					Tuple t;
-					PreferedTuple(r, t);
-					if (target->CanInsert(t)) {
-						table->Deletion(r, hasChanged);
-						target->Insertion(r, hasChanged);
-						assignments[r.priority] = target;
-					}
+			}
+			size_t bestD = 0;
+			int bestDelta = 0;
+			for (size_t d = 0; d < tuple.size(); d++) {
+				int delta = superTuple[d] - compatTuple[d];
+				if (delta > bestDelta) {
+					bestD = d;
+					bestDelta = delta;
 				}
 			}
+			compatTuple[bestD] = (superTuple[bestD] + compatTuple[bestD]) / 2;
+			SlottedTable* target = FindOrMake(compatTuple);
 			
-			if (hasChanged) {
-				Resort();
+			vector<Rule> rl = table->GetRules();
+			for (Rule& r : rl) {
+				Tuple t;
+				PreferedTuple(r, t);
+				if (target != table && target->CanInsert(t)) {
+					// Add before removing, so that a concurrent
+					// classifier always finds the rule somewhere
+					target->Insertion(r, hasChanged);
+					table->Deletion(r, hasChanged);
+					assignments[r.priority] = target;
+				}
 			}
-			return;
+			// Both tables may have moved
+			Resort();
+		} else if (hasChanged) {
+			Publish();
 		}
+		return;
 	}
 	// Could not insert
 	// So create a new table
 	{
 		bool ignore;
 		Relax(tuple);
-		SlottedTable * table = new SlottedTable(tuple);
+		table = new SlottedTable(tuple, pool);
 		table->Insertion(rule, ignore);
-		tables.push_back(table);
+		AddTable(table);
 		assignments[rule.priority] = table;
-		Resort();
+		Publish();
 	}
 }
 
 SlottedTable* TupleMergeOnline::FindOrMake(const Tuple& t) {
+	auto it = directory.find(TableTuple(t));
+	if (it != directory.end()) {
+		return it->second;
+	}
+	SlottedTable* table = new SlottedTable(t, pool);
+	AddTable(table);
+	Publish();
+	return table;
+}
+
+void TupleMergeOnline::Resort() {
+	auto bySearchOrder = [](const SlottedTable* tx, const SlottedTable* ty) { return tx->MaxPriority() > ty->MaxPriority(); };
+	sort(tables.begin(), tables.end(), bySearchOrder);
+	for (auto& entry : acceptors) {
+		sort(entry.second.begin(), entry.second.end(), bySearchOrder);
+	}
+	Publish();
+}
+
+void TupleMergeOnline::AddTable(SlottedTable* table) {
+	table->EnableFilter(filterCounters);
+	PriorityInsert(tables, table);
+	directory.emplace(table->GetTuple(), table);
+	auto& lists = acceptorLists[table];
+	for (auto& entry : acceptors) {
+		if (table->CanInsert(entry.first)) {
+			PriorityInsert(entry.second, table);
+			lists.push_back(&entry.second);
+		}
+	}
+}
+
+void TupleMergeOnline::RemoveTable(SlottedTable* table, int priority) {
+	tables.erase(tables.begin() + PriorityIndexOf(tables, table, priority));
+	auto it = directory.find(table->GetTuple());
+	if (it != directory.end() && it->second == table) {
+		directory.erase(it);
+	}
+	auto lists = acceptorLists.find(table);
+	if (lists == acceptorLists.end()) return;
+	for (auto list : lists->second) {
+		list->erase(list->begin() + PriorityIndexOf(*list, table, priority));
+	}
+	acceptorLists.erase(lists);
+}
+
+void TupleMergeOnline::Reposition(SlottedTable* table, int priority) {
+	PriorityReposition(tables, PriorityIndexOf(tables, table, priority));
+	auto lists = acceptorLists.find(table);
+	if (lists == acceptorLists.end()) return;
+	for (auto list : lists->second) {
+		PriorityReposition(*list, PriorityIndexOf(*list, table, priority));
+	}
+}
+
+SlottedTable* TupleMergeOnline::FirstAcceptor(const Tuple& t) {
+	auto it = acceptors.find(t);
+	if (it == acceptors.end()) {
+		it = acceptors.emplace(t, vector<SlottedTable*>()).first;
+		// Taken from tables, so already in search order
+		for (auto table : tables) {
+			if (table->CanInsert(t)) {
+				it->second.push_back(table);
+				acceptorLists[table].push_back(&it->second);
+			}
+		}
+	}
+	return it->second.empty() ? nullptr : it->second.front();
+}
+
+void TupleMergeOnline::Compact() {
+	if (!compactEnabled) return;
+	if (compactWait > 0) {
+		compactWait--;
+		return;
+	}
+	if (!compacting) {
+		compacting = tables.size() > compactTables || MeasuredProbes() > compactProbes;
+	}
+	if (!compacting || !MergeSparseTable()) {
+		compacting = false;
+		compactWait = compactInterval;
+	}
+}
+
+bool TupleMergeOnline::MergeSparseTable() {
+	vector<SlottedTable*> sparse;
 	for (auto table : tables) {
-		if (table->IsThatTuple(t)) {
-			return table;
+		if ((size_t)table->NumRules() <= compactSparse) {
+			sparse.push_back(table);
 		}
 	}
-	SlottedTable* table = new SlottedTable(t);
-	tables.push_back(table);
-	return table;
+
+	// Each update checks up to compactChecks pairs of tables, finishing the
+	// sparse table it is on; the next update carries on from the position
+	// in tables after it.  There is nothing to merge only once every table
+	// has been looked at since the last merge.
+	size_t checks = 0;
+	for (; compactUnmerged < tables.size(); compactUnmerged++, compactFrom++) {
+		if (checks >= compactChecks) return true;
+		if (compactFrom >= tables.size()) compactFrom = 0;
+		SlottedTable* from = tables[compactFrom];
+		if ((size_t)from->NumRules() > compactSparse) continue;
+		vector<Rule> rl = from->GetRules();
+		// Into a table whose tuple already covers this one
+		for (auto to : tables) {
+			checks++;
+			if (to != from && to->CanTakeRulesFrom(from) && to->CanTakeRules(rl, collideLimit)) {
+				MoveRules(from, to);
+				Resort();
+				// Classifiers may still be probing it through an older list
+				ovsrcu_postpone(FreeTable, from);
+				compactUnmerged = 0;
+				return true;
+			}
+		}
+		// Or, with another sparse table, into one with a tuple both share
+		for (auto other : sparse) {
+			if (other == from) continue;
+			checks++;
+			Tuple shared = from->GetTuple();
+			for (size_t d = 0; d < shared.size(); d++) {
+				shared[d] = min(shared[d], other->GetTuple()[d]);
+			}
+			shared = TableTuple(shared);
+			auto it = directory.find(shared);
+			SlottedTable* to = it != directory.end() ? it->second : nullptr;
+			if (to == from || to == other) continue;
+			vector<Rule> both = other->GetRules();
+			both.insert(both.end(), rl.begin(), rl.end());
+			if (to ? !to->CanTakeRules(both, collideLimit) : !FitsTuple(both, shared, collideLimit)) continue;
+			if (!to) {
+				to = new SlottedTable(shared, pool);
+				AddTable(to);
+				Publish();
+			}
+			MoveRules(other, to);
+			MoveRules(from, to);
+			Resort();
+			ovsrcu_postpone(FreeTable, other);
+			ovsrcu_postpone(FreeTable, from);
+			compactUnmerged = 0;
+			return true;
+		}
+	}
+	compactUnmerged = 0;
+	return false;
+}
+
+void TupleMergeOnline::MoveRules(SlottedTable* from, SlottedTable* to) {
+	int before = from->MaxPriority();
+	bool ignore;
+	for (const Rule& r : from->GetRules()) {
+		// Add before removing, as when splitting
+		to->Insertion(r, ignore);
+		from->Deletion(r, ignore);
+		assignments[r.priority] = to;
+	}
+	RemoveTable(from, before);
+}
+
+double TupleMergeOnline::FilteredProbes() const {
+	uint64_t probes = 0, filtered = 0;
+	for (const auto& c : probeCounts) {
+		probes += c.probes.load(std::memory_order_relaxed);
+		filtered += c.filtered.load(std::memory_order_relaxed);
+	}
+	return probes ? 1.0 * filtered / probes : 0.0;
+}
+
+void TupleMergeOnline::ProbeTotals(uint64_t& packets, uint64_t& probes) const {
+	packets = probes = 0;
+	for (const auto& c : probeCounts) {
+		packets += c.packets.load(std::memory_order_relaxed);
+		probes += c.probes.load(std::memory_order_relaxed);
+	}
+}
+
+double TupleMergeOnline::MeasuredProbes() {
+	const uint64_t enough = 4096;
+	uint64_t packets, probes;
+	ProbeTotals(packets, probes);
+	if (packets - seenPackets < enough) return 0;
+	double mean = 1.0 * (probes - seenProbes) / (packets - seenPackets);
+	seenPackets = packets;
+	seenProbes = probes;
+	return mean;
+}
+
+void TupleMergeOnline::Publish() {
+	TableList* list = new TableList;
+	list->tables = tables;
+	size_t padded = (tables.size() + HashLanes - 1) / HashLanes * HashLanes;
+	for (int d = 0; d < MAXDIMENSIONS; d++) {
+		list->masks[d].assign(padded, 0);
+		for (size_t i = 0; i < tables.size(); i++) {
+			list->masks[d][i] = tables[i]->Masks()[d];
+		}
+	}
+	TableList* old = published.exchange(list);
+	ovsrcu_postpone(FreeTableList, old);
+}
+
+void TupleMergeOnline::ReadCollideLimit(const unordered_map<string, string>& args, const string& key) {
+	auto it = args.find(key);
+	if (it == args.end()) return;
+	tuneLimit = it->second == "Auto";
+	if (!tuneLimit) {
+		collideLimit = stoi(it->second);
+	}
+}
+
+// Points drawn from the boxes of randomly chosen rules, so that every table
+// sees packets in proportion to the rules it holds
+static vector<Packet> SamplePackets(const vector<Rule>& rules, int n) {
+	mt19937 gen(1);
+	vector<Packet> packets(n);
+	for (Packet& p : packets) {
+		const Rule& r = rules[gen() % rules.size()];
+		p.fill(0);
+		for (int d = 0; d < r.dim; d++) {
+			uint64_t width = (uint64_t)r.range[d][HighDim] - r.range[d][LowDim] + 1;
+			p[d] = r.range[d][LowDim] + gen() % width;
+		}
+	}
+	return packets;
+}
+
+int TupleMergeOnline::TuneCollideLimit(const vector<Rule>& rules) const {
+	vector<Packet> sample = SamplePackets(rules, tunePackets);
+
+	// A higher limit means fewer tables but longer chains to check in each;
+	// timing the sample settles which one costs more on this ruleset
+	int best = collideLimit, smallest = collideLimit;
+	double bestTime = numeric_limits<double>::max();
+	Memory smallestSize = numeric_limits<Memory>::max();
+	for (int limit : tuneCandidates) {
+		TupleMergeOnline* scratch = MakeScratch();
+		scratch->tuneLimit = false;
+		scratch->collideLimit = limit;
+		scratch->ConstructClassifier(rules);
+
+		double time = numeric_limits<double>::max();
+		for (int trial = 0; trial < 3; trial++) {
+			auto start = chrono::steady_clock::now();
+			for (const Packet& p : sample) {
+				scratch->ClassifyAPacket(p);
+			}
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+			time = min(time, elapsed.count());
+		}
+		Memory size = scratch->MemSizeBytes();
+		delete scratch;
+
+		if (size < smallestSize) {
+			smallest = limit;
+			smallestSize = size;
+		}
+		if ((tuneMemory == 0 || size <= tuneMemory) && time < bestTime) {
+			best = limit;
+			bestTime = time;
+		}
+	}
+	// If nothing fits the budget, come as close as possible
+	return bestTime < numeric_limits<double>::max() ? best : smallest;
+}
+
+bool TupleMergeOnline::SaveSnapshot(const string& file) const {
+	vector<const SlottedTable*> order(tables.begin(), tables.end());
+	unordered_map<const SlottedTable*, uint32_t> index;
+	for (size_t i = 0; i < order.size(); i++) {
+		index[order[i]] = i;
+	}
+	vector<uint32_t> tableOf;
+	for (const Rule& r : rules) {
+		tableOf.push_back(index.at(assignments.at(r.priority)));
+	}
+	return TupleMergeSnapshot::Write(file, order, rules, tableOf);
+}
+
+void TupleMergeOnline::LoadSnapshot(const TupleMergeImage& image) {
+	vector<SlottedTable*> made;
+	vector<vector<Rule>> tableRules(image.NumTables());
+	for (size_t i = 0; i < image.NumTables(); i++) {
+		made.push_back(new SlottedTable(image.TupleOfTable(i), pool));
+	}
+	for (size_t i = 0; i < image.NumRules(); i++) {
+		size_t t;
+		Rule r = image.RuleAt(i, t);
+		tableRules[t].push_back(r);
+		assignments[r.priority] = made[t];
+		rules.push_back(r);
+	}
+	// Every table's rules are known, so each is built in one go
+	for (size_t t = 0; t < made.size(); t++) {
+		made[t]->Insertion(tableRules[t]);
+		AddTable(made[t]);
+	}
+	Resort();
 }
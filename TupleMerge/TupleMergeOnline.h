@@ -27,6 +27,8 @@
 
 #include "SlottedTable.h"
 
+class TupleMergeImage;
+
 namespace ForgeUtils {
 	void Crazify(TupleMergeUtils::Tuple& tuple);
 }
@@ -38,17 +40,21 @@ public:
 	
 	virtual void ConstructClassifier(const std::vector<Rule>& rules);
 	virtual int ClassifyAPacket(const Packet& p);
+	// As ClassifyAPacket, but hands back the tables probed in q instead of
+	// counting them in the query statistics
+	int ClassifyCounted(const Packet& p, int& q);
+	virtual void ClassifyBatch(const Packet* packets, size_t n, int* results);
+	virtual int ClassifyWildcarded(const Packet& p, Packet& wildcards);
 	virtual void DeleteRule(size_t index);
 	virtual void InsertRule(const Rule& r);
 	virtual Memory MemSizeBytes() const {
-		int ruleSizeBytes = 19; // TODO variables sizes
 		int sizeBytes = 0;
 		for (const auto table : tables) {
-			sizeBytes += table->MemSizeBytes(ruleSizeBytes);
+			sizeBytes += table->MemSizeBytes();
 		}
 		int assignmentsSizeBytes = rules.size() * POINTER_SIZE_BYTES;
 		int arraySize = tables.size() * POINTER_SIZE_BYTES;
-		return sizeBytes + assignmentsSizeBytes + arraySize;
+		return sizeBytes + assignmentsSizeBytes + arraySize + pool.memory_size();
 	}
 	virtual int MemoryAccess() const {
 		int cost = 0;
@@ -59,23 +65,125 @@ public:
 		return cost;
 	}
 	virtual size_t NumTables() const { return tables.size(); }
+	const SlottedTable* Table(size_t index) const { return tables[index]; }
 	virtual size_t RulesInTable(size_t index) const { return tables[index]->NumRules(); }
 	virtual size_t PriorityOfTable(size_t index) const {
 		return tables[index]->MaxPriority();
 	}
+	virtual bool ConcurrentUpdates() const { return true; }
+
+	// Fraction of table probes that a table's filter answered without
+	// touching its hash table
+	double FilteredProbes() const;
+	// Packets classified and tables probed for them, ever
+	void ProbeTotals(uint64_t& packets, uint64_t& probes) const;
+	// Probe counts stay at zero unless compaction or table filters are on,
+	// or this turns counting on
+	void EnableProbeCounts() { countProbes = true; }
+	// With TM.Limit.Collide=Auto, the limit the last build picked
+	int CollideLimit() const { return collideLimit; }
+
+	// Snapshots (TupleMergeSnapshot.h): write the tables as they stand, or
+	// take over the tables of an image instead of building from rules
+	bool SaveSnapshot(const std::string& file) const;
+	void LoadSnapshot(const TupleMergeImage& image);
 
 protected:
-	void Resort() {
-		sort(tables.begin(), tables.end(), [](auto& tx, auto& ty) { return tx->MaxPriority() > ty->MaxPriority(); });
-	}
+	// What classifiers probe: the tables in search order and their masks.
+	// A published list is never changed; updates publish a new one.
+	struct TableList {
+		std::vector<SlottedTable*> tables;
+		TupleMergeUtils::MaskLayout masks; // Masks of tables, in the same order
+	};
+	static void FreeTableList(TableList* list) { delete list; }
+
+	// Sorts tables and the lists in acceptors back into search order, after
+	// the priorities of several tables have changed, and publishes
+	void Resort();
+	void Publish();
 	SlottedTable* FindOrMake(const TupleMergeUtils::Tuple& t);
+	// Adds table to tables and the lists in acceptors, in search order
+	void AddTable(SlottedTable* table);
+	// Takes table out of tables and the lists in acceptors, where it is
+	// placed by priority
+	void RemoveTable(SlottedTable* table, int priority);
+	// Moves table back into search order in tables and the lists in
+	// acceptors after its priority has changed from priority
+	void Reposition(SlottedTable* table, int priority);
+	// InsertRule without compaction
+	void Insert(const Rule& r);
+	// The first table, in search order, that can take rules with this tuple
+	SlottedTable* FirstAcceptor(const TupleMergeUtils::Tuple& t);
+
+	// Compaction (TM.Compact=1): while there are too many tables, or
+	// classifiers probe too many per packet, each update first merges one
+	// sparse table into another
+	void Compact();
+	bool MergeSparseTable();
+	// Leaves from empty and out of tables; the caller frees it once it has
+	// published a list without it
+	void MoveRules(SlottedTable* from, SlottedTable* to);
+	void CountProbes(size_t packets, size_t probes, size_t filtered) {
+		if (!countProbes) return;
+		ProbeCount& c = probeCounts[omp_get_thread_num() % probeCounts.size()];
+		c.packets.fetch_add(packets, std::memory_order_relaxed);
+		c.probes.fetch_add(probes, std::memory_order_relaxed);
+		c.filtered.fetch_add(filtered, std::memory_order_relaxed);
+	}
+	// Mean tables probed per packet since the last call, or 0 if too few
+	// packets have been classified since then to tell
+	double MeasuredProbes();
+
+	// TM.Limit.Collide=Auto: build a scratch classifier with each candidate
+	// limit, classify sample packets with it, and keep the fastest limit
+	// among those that fit in the memory budget
+	void ReadCollideLimit(const std::unordered_map<std::string, std::string>& args, const std::string& key);
+	int TuneCollideLimit(const std::vector<Rule>& rules) const;
+	virtual TupleMergeOnline* MakeScratch() const { return new TupleMergeOnline(settings); }
 	
-	std::vector<SlottedTable*> tables;
+	cmap_node_pool pool; // Nodes of all the tables
+	std::vector<SlottedTable*> tables; // Only touched by updates
+	std::atomic<TableList*> published;
+
+	// Indexes over tables, kept up to date by AddTable and RemoveTable
+	TupleMergeUtils::TupleMap<SlottedTable*> directory; // Table tuple -> table
+	TupleMergeUtils::TupleMap<std::vector<SlottedTable*>> acceptors; // Prefered tuple -> tables that can take it, in search order
+	std::unordered_map<SlottedTable*, std::vector<std::vector<SlottedTable*>*>> acceptorLists; // Table -> lists in acceptors that hold it
 	std::unordered_map<int, SlottedTable*> assignments; // Priority -> Table
 
 	std::vector<Rule> rules;
 
 	int collideLimit;
+	bool tuneLimit = false;
+	std::vector<int> tuneCandidates;
+	int tunePackets;
+	size_t tuneMemory; // Bytes; 0 for no budget
+	std::unordered_map<std::string, std::string> settings; // For scratch classifiers
+
+	int filterCounters; // Per rule in each table's filter; 0 for none
+
+	bool compactEnabled;
+	size_t compactTables;  // Compact when there are more tables than this
+	double compactProbes;  // or when classifiers probe more tables per packet
+	size_t compactSparse;  // Tables with at most this many rules get merged away
+	int compactInterval;   // Updates to wait after compaction runs out of merges
+	size_t compactChecks;  // Pairs of tables to check for a merge per update
+	size_t compactFrom = 0; // Position in tables the next update checks from
+	size_t compactUnmerged = 0; // Tables looked at since the last merge
+	int compactWait = 0;
+	bool compacting = false;
+
+	// Counted by classifiers, one pair per thread; the padding keeps two
+	// threads from sharing a cache line
+	struct ProbeCount {
+		std::atomic<uint64_t> packets{0};
+		std::atomic<uint64_t> probes{0};
+		std::atomic<uint64_t> filtered{0}; // Probes a table filter answered
+		char pad[64];
+	};
+	bool countProbes;
+	std::array<ProbeCount, 64> probeCounts;
+	uint64_t seenPackets = 0, seenProbes = 0;
 };
 
 
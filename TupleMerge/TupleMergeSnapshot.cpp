@@ -0,0 +1,331 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "TupleMergeSnapshot.h"
+#include "../OVS/hash.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace TupleMergeSnapshot;
+
+// ************
+// Writing
+// ************
+
+namespace {
+	// Appends parts to a buffer, each at an offset a multiple of 64
+	struct Builder {
+		vector<char> bytes;
+
+		uint64_t Reserve(size_t n) {
+			bytes.resize((bytes.size() + 63) / 64 * 64);
+			uint64_t offset = bytes.size();
+			bytes.resize(offset + n, 0);
+			return offset;
+		}
+		template <class T>
+		uint64_t Append(const vector<T>& items) {
+			uint64_t offset = Reserve(items.size() * sizeof(T));
+			if (!items.empty()) {
+				memcpy(&bytes[offset], items.data(), items.size() * sizeof(T));
+			}
+			return offset;
+		}
+		template <class T>
+		void Put(uint64_t offset, const T& item) {
+			memcpy(&bytes[offset], &item, sizeof(T));
+		}
+	};
+}
+
+uint64_t TupleMergeSnapshot::Fingerprint(const vector<Rule>& rules) {
+	// A sum of per-rule hashes, so that the order does not matter
+	uint64_t fingerprint = rules.size();
+	for (const Rule& r : rules) {
+		uint32_t words[2 * MAXDIMENSIONS + 1];
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			words[2 * d] = r.range[d][LowDim];
+			words[2 * d + 1] = r.range[d][HighDim];
+		}
+		words[2 * MAXDIMENSIONS] = r.priority;
+		uint64_t high = hash_words_inline(words, 2 * MAXDIMENSIONS + 1, 0);
+		fingerprint += high << 32 | hash_words_inline(words, 2 * MAXDIMENSIONS + 1, 1);
+	}
+	return fingerprint;
+}
+
+bool TupleMergeSnapshot::Write(const string& file, const vector<const SlottedTable*>& tables, const vector<Rule>& rules, const vector<uint32_t>& tableOf) {
+	Builder b;
+	Header h = {};
+	memcpy(h.magic, Magic, sizeof(Magic));
+	h.version = Version;
+	h.byteOrder = ByteOrderMark;
+	h.dimensions = MAXDIMENSIONS;
+	h.numTables = tables.size();
+	h.numRules = rules.size();
+	strncpy(h.hash, TupleMergeHash::Name(), sizeof(h.hash) - 1);
+	h.fingerprint = Fingerprint(rules);
+	b.Reserve(sizeof(Header));
+	h.tablesOffset = b.Reserve(tables.size() * sizeof(Table));
+
+	for (size_t i = 0; i < tables.size(); i++) {
+		const SlottedTable* table = tables[i];
+		vector<Rule> rl = table->GetRules();
+		const uint32_t* masks = table->Masks().data();
+
+		Table t = {};
+		const auto& tuple = table->GetTuple();
+		t.tupleSize = min<size_t>(tuple.size(), MAXDIMENSIONS);
+		for (size_t d = 0; d < t.tupleSize; d++) {
+			t.tuple[d] = tuple[d];
+		}
+		memcpy(t.masks, masks, sizeof(t.masks));
+		t.maxPriority = table->MaxPriority();
+		t.numRules = rl.size();
+		// At least two buckets per rule
+		t.numBuckets = 2;
+		t.bucketShift = 31;
+		while (t.numBuckets < 2 * rl.size()) {
+			t.numBuckets <<= 1;
+			t.bucketShift--;
+		}
+
+		vector<Entry> entries(rl.size());
+		vector<uint32_t> bucketOf(rl.size());
+		for (size_t j = 0; j < rl.size(); j++) {
+			entries[j].match = MatchRecord(rl[j]);
+			entries[j].hash = HashPolicy::HashMasked<TupleMergeHash>(rl[j], masks);
+		}
+		sort(entries.begin(), entries.end(), [&t](const Entry& x, const Entry& y) {
+			uint32_t bx = (x.hash * BucketMult) >> t.bucketShift;
+			uint32_t by = (y.hash * BucketMult) >> t.bucketShift;
+			return bx != by ? bx < by : x.match.priority > y.match.priority;
+		});
+		vector<uint32_t> buckets(t.numBuckets + 1, 0);
+		for (const Entry& e : entries) {
+			buckets[((e.hash * BucketMult) >> t.bucketShift) + 1]++;
+		}
+		for (size_t k = 1; k < buckets.size(); k++) {
+			buckets[k] += buckets[k - 1];
+		}
+		t.bucketsOffset = b.Append(buckets);
+		t.entriesOffset = b.Append(entries);
+		b.Put(h.tablesOffset + i * sizeof(Table), t);
+	}
+
+	vector<RuleRecord> records(rules.size());
+	for (size_t i = 0; i < rules.size(); i++) {
+		const Rule& r = rules[i];
+		RuleRecord& rec = records[i];
+		rec.table = tableOf[i];
+		rec.dim = r.dim;
+		rec.priority = r.priority;
+		rec.id = r.id;
+		rec.tag = r.tag;
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			rec.prefixLength[d] = r.prefix_length[d];
+			rec.low[d] = r.range[d][LowDim];
+			rec.high[d] = r.range[d][HighDim];
+		}
+	}
+	h.rulesOffset = b.Append(records);
+	h.fileSize = b.bytes.size();
+	b.Put(0, h);
+
+	FILE* out = fopen(file.c_str(), "wb");
+	if (!out) {
+		return false;
+	}
+	bool written = fwrite(b.bytes.data(), 1, b.bytes.size(), out) == b.bytes.size();
+	return fclose(out) == 0 && written;
+}
+
+// ************
+// TupleMergeImage
+// ************
+
+TupleMergeImage::~TupleMergeImage() {
+	Unmap();
+}
+
+void TupleMergeImage::Unmap() {
+	if (base) {
+		munmap((void*)base, size);
+	}
+	base = nullptr;
+	size = 0;
+	header = nullptr;
+	tables = nullptr;
+}
+
+// Says what is wrong with the tables and rules of a snapshot of size bytes,
+// or nullptr if every offset and index in them is in range
+static const char* CheckContents(const char* base, size_t size, const Header* h) {
+	auto fits = [size](uint64_t offset, uint64_t count, size_t item) {
+		return offset <= size && count <= (size - offset) / item;
+	};
+	if (!fits(h->tablesOffset, h->numTables, sizeof(Table)) || !fits(h->rulesOffset, h->numRules, sizeof(RuleRecord))) {
+		return "truncated";
+	}
+	const Table* ts = (const Table*)(base + h->tablesOffset);
+	uint64_t tableRules = 0;
+	for (uint32_t i = 0; i < h->numTables; i++) {
+		const Table& t = ts[i];
+		if (t.tupleSize > MAXDIMENSIONS) {
+			return "a table has too long a tuple";
+		}
+		// Bucket indices come from the top bits of a 32-bit product
+		if (t.bucketShift < 1 || t.bucketShift > 31 || t.numBuckets != 1u << (32 - t.bucketShift)) {
+			return "a table has a bad bucket count";
+		}
+		if (!fits(t.bucketsOffset, t.numBuckets + 1ull, sizeof(uint32_t)) || !fits(t.entriesOffset, t.numRules, sizeof(Entry))) {
+			return "truncated";
+		}
+		const uint32_t* buckets = (const uint32_t*)(base + t.bucketsOffset);
+		if (buckets[0] != 0 || buckets[t.numBuckets] != t.numRules) {
+			return "a table's buckets do not cover its entries";
+		}
+		for (uint32_t b = 0; b < t.numBuckets; b++) {
+			if (buckets[b] > buckets[b + 1]) {
+				return "a table's buckets are out of order";
+			}
+		}
+		tableRules += t.numRules;
+	}
+	if (tableRules != h->numRules) {
+		return "the tables do not hold every rule";
+	}
+	const RuleRecord* records = (const RuleRecord*)(base + h->rulesOffset);
+	for (uint32_t i = 0; i < h->numRules; i++) {
+		if (records[i].table >= h->numTables) {
+			return "a rule is in a table that does not exist";
+		}
+	}
+	return nullptr;
+}
+
+bool TupleMergeImage::Load(const string& file, const vector<Rule>& rules) {
+	Unmap();
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		printf("Cannot open snapshot %s\n", file.c_str());
+		return false;
+	}
+	struct stat st;
+	void* p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		printf("Cannot map snapshot %s\n", file.c_str());
+		return false;
+	}
+	base = (const char*)p;
+	size = st.st_size;
+
+	const char* problem = nullptr;
+	const Header* h = At<Header>(0);
+	if (size < sizeof(Header) || memcmp(h->magic, Magic, sizeof(Magic)) != 0) {
+		problem = "not a TupleMerge snapshot";
+	} else if (h->version != Version) {
+		problem = "written by another version";
+	} else if (h->byteOrder != ByteOrderMark) {
+		problem = "written on a machine of the other byte order";
+	} else if (h->dimensions != MAXDIMENSIONS) {
+		problem = "written by a build with another MAXDIMENSIONS";
+	} else if (strncmp(h->hash, TupleMergeHash::Name(), sizeof(h->hash)) != 0) {
+		problem = "written by a build with another TM_HASH";
+	} else if (h->numRules != rules.size() || h->fingerprint != Fingerprint(rules)) {
+		problem = "built from another ruleset";
+	} else if (h->fileSize != size) {
+		problem = "truncated";
+	} else {
+		problem = CheckContents(base, size, h);
+	}
+	if (problem) {
+		printf("Snapshot %s: %s\n", file.c_str(), problem);
+		Unmap();
+		return false;
+	}
+	header = h;
+	tables = At<Table>(h->tablesOffset);
+	return true;
+}
+
+int TupleMergeImage::ClassifyAPacket(const Packet& p) {
+	int prior = -1;
+	int q = 0;
+	for (uint32_t i = 0; i < NumTables() && tables[i].maxPriority > prior; i++) {
+		const Table& t = tables[i];
+		q++;
+		uint32_t hash = HashPolicy::HashMasked<TupleMergeHash>(p, t.masks);
+		uint32_t bucket = (hash * BucketMult) >> t.bucketShift;
+		const uint32_t* buckets = At<uint32_t>(t.bucketsOffset);
+		const Entry* entries = At<Entry>(t.entriesOffset);
+		// Highest priority first, so the first match is the table's answer
+		prior = MatchKernel::Run([&](auto k) __attribute__((always_inline)) {
+			for (uint32_t e = buckets[bucket]; e < buckets[bucket + 1] && entries[e].match.priority > prior; e++) {
+				if (entries[e].hash == hash && decltype(k)::Matches(p, entries[e].match)) {
+					return entries[e].match.priority;
+				}
+			}
+			return prior;
+		});
+	}
+	QueryUpdate(q);
+	return prior;
+}
+
+void TupleMergeImage::DeleteRule(size_t index) {
+	printf("Warning: a TupleMerge image is read-only; DeleteRule ignored\n");
+}
+
+void TupleMergeImage::InsertRule(const Rule& r) {
+	printf("Warning: a TupleMerge image is read-only; InsertRule ignored\n");
+}
+
+TupleMergeUtils::Tuple TupleMergeImage::TupleOfTable(size_t index) const {
+	const Table& t = tables[index];
+	return TupleMergeUtils::Tuple(t.tuple, t.tuple + min<uint32_t>(t.tupleSize, MAXDIMENSIONS));
+}
+
+Rule TupleMergeImage::RuleAt(size_t i, size_t& table) const {
+	const RuleRecord& rec = At<RuleRecord>(header->rulesOffset)[i];
+	Rule r(rec.dim);
+	r.priority = rec.priority;
+	r.id = rec.id;
+	r.tag = rec.tag;
+	for (int d = 0; d < MAXDIMENSIONS; d++) {
+		r.prefix_length[d] = rec.prefixLength[d];
+		r.range[d][LowDim] = rec.low[d];
+		r.range[d][HighDim] = rec.high[d];
+	}
+	table = rec.table;
+	return r;
+}
@@ -0,0 +1,138 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include "../Simulation.h"
+
+#include "SlottedTable.h"
+
+#include <string>
+
+// A built TupleMerge classifier as a file that can be mapped into memory
+// and classified from in place. Everything in the file is found by its
+// offset from the start, so it works wherever it is mapped.
+//
+// Layout, each part starting on a cache line:
+//   Header
+//   Table[numTables], in search order
+//   for each table: uint32_t buckets[numBuckets + 1], then Entry[numRules]
+//   RuleRecord[numRules], in the classifier's rule order
+// A table's entries are grouped by bucket and, within a bucket, by falling
+// priority; buckets[b] is the index of the first entry of bucket b.
+namespace TupleMergeSnapshot {
+	const char Magic[8] = { 'T', 'M', 'S', 'N', 'A', 'P', '\r', '\n' };
+	const uint32_t Version = 2;
+	const uint32_t ByteOrderMark = 0x01020304;
+	// Bucket of hash h in a table: (h * BucketMult) >> bucketShift
+	const uint32_t BucketMult = 2654435761u;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder; // ByteOrderMark, as the writer stored it
+		uint32_t dimensions;
+		uint32_t numTables;
+		uint32_t numRules;
+		char hash[20]; // Name of the hash policy the tables were built with
+		uint64_t fingerprint; // Of the rules, as Fingerprint computes it
+		uint64_t tablesOffset;
+		uint64_t rulesOffset;
+		uint64_t fileSize;
+	};
+
+	struct Table {
+		uint32_t tupleSize;
+		int32_t tuple[MAXDIMENSIONS];
+		uint32_t masks[MAXDIMENSIONS];
+		int32_t maxPriority;
+		uint32_t numRules;
+		uint32_t bucketShift;
+		uint32_t numBuckets;
+		uint64_t bucketsOffset;
+		uint64_t entriesOffset;
+	};
+
+	struct Entry {
+		MatchRecord match;
+		uint32_t hash;
+	};
+
+	struct RuleRecord {
+		uint32_t table;
+		int32_t dim;
+		int32_t priority;
+		int32_t id;
+		int32_t tag;
+		uint32_t prefixLength[MAXDIMENSIONS];
+		uint32_t low[MAXDIMENSIONS];
+		uint32_t high[MAXDIMENSIONS];
+	};
+
+	// Depends on the ranges and priorities of the rules, but not their order
+	uint64_t Fingerprint(const std::vector<Rule>& rules);
+
+	// Writes the tables, in search order, and the rules, with tableOf[i] the
+	// index of the table rules[i] is in. Returns false if the file could
+	// not be written.
+	bool Write(const std::string& file, const std::vector<const SlottedTable*>& tables, const std::vector<Rule>& rules, const std::vector<uint32_t>& tableOf);
+}
+
+// Classifies from a mapped snapshot, without building anything. It cannot
+// take updates; TupleMergeOnline::LoadSnapshot makes a classifier that can.
+class TupleMergeImage : public PacketClassifier {
+public:
+	TupleMergeImage() {}
+	~TupleMergeImage();
+
+	// Maps the file and checks that a compatible build wrote it from rules
+	// and that everything in it lies within the file; says why and returns
+	// false if not
+	bool Load(const std::string& file, const std::vector<Rule>& rules);
+
+	// The image is built already, so the rules are not needed
+	virtual void ConstructClassifier(const std::vector<Rule>& rules) {}
+	virtual int ClassifyAPacket(const Packet& p);
+	virtual void DeleteRule(size_t index);
+	virtual void InsertRule(const Rule& r);
+	virtual Memory MemSizeBytes() const { return size; }
+	virtual int MemoryAccess() const { return 0; }
+	virtual size_t NumTables() const { return header ? header->numTables : 0; }
+	virtual size_t RulesInTable(size_t index) const { return tables[index].numRules; }
+	virtual size_t PriorityOfTable(size_t index) const { return tables[index].maxPriority; }
+
+	TupleMergeUtils::Tuple TupleOfTable(size_t index) const;
+	size_t NumRules() const { return header ? header->numRules : 0; }
+	// Rule i in the classifier's rule order, and the index of its table
+	Rule RuleAt(size_t i, size_t& table) const;
+
+private:
+	template <class T>
+	const T* At(uint64_t offset) const { return (const T*)(base + offset); }
+	void Unmap();
+
+	const char* base = nullptr;
+	size_t size = 0;
+	const TupleMergeSnapshot::Header* header = nullptr;
+	const TupleMergeSnapshot::Table* tables = nullptr;
+};
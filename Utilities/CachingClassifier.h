@@ -0,0 +1,101 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CACHING_CLASSIFIER_H
+#define CACHING_CLASSIFIER_H
+
+#include "../Simulation.h"
+#include <mutex>
+
+// What the caches in front of another classifier (FlowCache, MegaflowCache)
+// share: the classifier they own and pass queries about their tables on to,
+// and a cache per thread, whose contents are the Cache of the subclass.
+template <class Cache>
+class CachingClassifier : public PacketClassifier {
+public:
+	// Takes ownership of classifier
+	CachingClassifier(PacketClassifier* classifier) : classifier(classifier) {}
+	~CachingClassifier() { delete classifier; }
+	CachingClassifier(const CachingClassifier&) = delete;
+	CachingClassifier& operator=(const CachingClassifier&) = delete;
+
+	virtual int MemoryAccess() const { return classifier->MemoryAccess(); }
+	virtual size_t NumTables() const { return classifier->NumTables(); }
+	virtual size_t RulesInTable(size_t index) const { return classifier->RulesInTable(index); }
+	virtual size_t PriorityOfTable(size_t index) const { return classifier->PriorityOfTable(index); }
+	virtual bool ConcurrentUpdates() const { return classifier->ConcurrentUpdates(); }
+	// Also makes room for the caches of up to threads callers
+	virtual void ResetQueryStats(size_t threads) {
+		PacketClassifier::ResetQueryStats(threads);
+		classifier->ResetQueryStats(threads);
+		if (caches.size() < ThreadSlots(threads)) {
+			caches.resize(ThreadSlots(threads));
+		}
+		for (auto& c : caches) {
+			Prepare(c);
+			c.lookups = c.hits = 0;
+		}
+	}
+
+	// Fraction of packets answered from the cache since the last
+	// ResetQueryStats
+	double HitRate() const {
+		size_t lookups = 0, hits = 0;
+		for (const auto& c : caches) {
+			lookups += c.lookups;
+			hits += c.hits;
+		}
+		return lookups ? 1.0 * hits / lookups : 0.0;
+	}
+
+protected:
+	// The padding keeps the caches of two threads from sharing a cache line
+	struct ThreadCache : Cache {
+		size_t lookups = 0;
+		size_t hits = 0;
+		char pad[64];
+	};
+
+	// Readies a cache that ResetQueryStats may have just made
+	virtual void Prepare(ThreadCache& c) {}
+	// Returns use(cache) for the cache of the calling thread.  Threads
+	// numbered past the others (see ThreadNumber) share the last cache, one
+	// at a time.
+	template <class Use>
+	auto WithCache(Use use) {
+		size_t t = ThreadNumber();
+		if (t + 1 >= caches.size()) {
+			std::lock_guard<std::mutex> lock(sharedCache);
+			return use(caches.back());
+		}
+		return use(caches[t]);
+	}
+
+	PacketClassifier* classifier;
+	std::vector<ThreadCache> caches;
+
+private:
+	std::mutex sharedCache;
+};
+
+#endif
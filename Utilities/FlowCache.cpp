@@ -0,0 +1,163 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "FlowCache.h"
+#include "../OVS/cmap.h"
+
+using namespace std;
+
+FlowCache::FlowCache(PacketClassifier* classifier, size_t entries) : CachingClassifier(classifier), generation(1) {
+	size_t buckets = 1;
+	while (buckets * EntriesPerBucket < entries) buckets *= 2;
+	mask = buckets - 1;
+	ResetQueryStats(1);
+}
+
+FlowCache::~FlowCache() {
+	for (auto& c : caches) {
+		free_cacheline(c.buckets);
+	}
+}
+
+void FlowCache::Prepare(ThreadCache& c) {
+	if (!c.buckets) {
+		c.buckets = (Bucket*)xzalloc_cacheline((mask + 1) * sizeof(Bucket));
+	}
+}
+
+void FlowCache::ConstructClassifier(const vector<Rule>& rules) {
+	classifier->ConstructClassifier(rules);
+	NextGeneration();
+}
+
+int FlowCache::ClassifyAPacket(const Packet& packet) {
+	return WithCache([&](ThreadCache& c) { return Classify(c, packet); });
+}
+
+void FlowCache::ClassifyBatch(const Packet* packets, size_t n, int* results) {
+	WithCache([&](ThreadCache& c) { ClassifyBatch(c, packets, n, results); });
+}
+
+int FlowCache::Classify(ThreadCache& c, const Packet& packet) {
+	// Read before classifying: should an update finish in the meantime, the
+	// entry is stamped with the old generation and never used
+	uint32_t current = generation.load(std::memory_order_acquire);
+	uint32_t hash = hash_words_inline(packet.data(), packet.size(), 0);
+	Bucket& b = c.buckets[hash & mask];
+	c.lookups++;
+
+	const Entry* e = Find(b, packet, hash, current);
+	if (e) {
+		c.hits++;
+		QueryUpdate(0);
+		return e->priority;
+	}
+	int priority = classifier->ClassifyAPacket(packet);
+	QueryUpdate(1);
+	Fill(b, packet, hash, current, priority);
+	return priority;
+}
+
+void FlowCache::ClassifyBatch(ThreadCache& c, const Packet* packets, size_t n, int* results) {
+	uint32_t current = generation.load(std::memory_order_acquire);
+	for (size_t offset = 0; offset < n; offset += CMAP_BATCH_SIZE) {
+		size_t count = min(n - offset, CMAP_BATCH_SIZE);
+		Packet missed[CMAP_BATCH_SIZE];
+		uint32_t hashes[CMAP_BATCH_SIZE];
+		size_t at[CMAP_BATCH_SIZE];
+		int found[CMAP_BATCH_SIZE];
+		size_t misses = 0;
+		c.lookups += count;
+		for (size_t i = offset; i < offset + count; i++) {
+			uint32_t hash = hash_words_inline(packets[i].data(), packets[i].size(), 0);
+			const Entry* e = Find(c.buckets[hash & mask], packets[i], hash, current);
+			if (e) {
+				c.hits++;
+				QueryUpdate(0);
+				results[i] = e->priority;
+			} else {
+				missed[misses] = packets[i];
+				hashes[misses] = hash;
+				at[misses++] = i;
+			}
+		}
+		if (misses == 0) continue;
+		classifier->ClassifyBatch(missed, misses, found);
+		for (size_t j = 0; j < misses; j++) {
+			QueryUpdate(1);
+			results[at[j]] = found[j];
+			Fill(c.buckets[hashes[j] & mask], missed[j], hashes[j], current, found[j]);
+		}
+	}
+}
+
+const FlowCache::Entry* FlowCache::Find(const Bucket& b, const Packet& packet, uint32_t hash, uint32_t current) const {
+	for (size_t i = 0; i < EntriesPerBucket; i++) {
+		const Entry& e = b.entries[i];
+		if (e.generation == current && e.signature == hash && e.key == packet) {
+			return &e;
+		}
+	}
+	return nullptr;
+}
+
+void FlowCache::Fill(Bucket& b, const Packet& packet, uint32_t hash, uint32_t current, int priority) {
+	// A stale entry if there is one, unless a packet earlier in the same
+	// batch already filled one for this header
+	size_t victim = (hash >> 16) % EntriesPerBucket;
+	for (size_t i = 0; i < EntriesPerBucket; i++) {
+		const Entry& e = b.entries[i];
+		if (e.generation != current) {
+			victim = i;
+		} else if (e.signature == hash && e.key == packet) {
+			victim = i;
+			break;
+		}
+	}
+	Entry& e = b.entries[victim];
+	e.key = packet;
+	e.signature = hash;
+	e.generation = current;
+	e.priority = priority;
+}
+
+void FlowCache::DeleteRule(size_t index) {
+	classifier->DeleteRule(index);
+	NextGeneration();
+}
+
+void FlowCache::InsertRule(const Rule& rule) {
+	classifier->InsertRule(rule);
+	NextGeneration();
+}
+
+void FlowCache::NextGeneration() {
+	// Updates come from one thread at a time
+	uint32_t next = generation.load(std::memory_order_relaxed) + 1;
+	if (next == 0) next = 1;
+	generation.store(next, std::memory_order_release);
+}
+
+Memory FlowCache::MemSizeBytes() const {
+	return classifier->MemSizeBytes() + caches.size() * (mask + 1) * sizeof(Bucket);
+}
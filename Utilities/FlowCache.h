@@ -0,0 +1,89 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef FLOW_CACHE_H
+#define FLOW_CACHE_H
+
+#include "CachingClassifier.h"
+#include <atomic>
+
+// An exact-match cache in front of another classifier, after the EMC of Open
+// vSwitch.  Each thread keeps its own table of recently seen headers and the
+// priority they matched.  The table is an array of cache-line buckets, each
+// holding a few entries keyed by the full header, with its hash kept as a
+// signature to compare first.
+//
+// Every entry is stamped with the generation it was filled in.  Inserting or
+// deleting a rule moves to a new generation, which invalidates every entry at
+// once without touching the tables.  Updates may run while other threads
+// classify if the wrapped classifier allows it.
+//
+// The query counts of this class are the number of lookups (0 or 1) passed
+// on to the classifier.
+struct FlowCacheTable {
+	struct Entry {
+		Packet key;
+		uint32_t signature;
+		uint32_t generation; // 0 is never current, so zeroed entries are empty
+		int priority;
+	};
+	static const size_t EntriesPerBucket = sizeof(Entry) < 64 ? 64 / sizeof(Entry) : 1;
+	struct Bucket {
+		Entry entries[EntriesPerBucket];
+	};
+	Bucket* buckets = nullptr;
+};
+
+class FlowCache : public CachingClassifier<FlowCacheTable> {
+public:
+	// Takes ownership of classifier; entries is rounded up to a power of two
+	FlowCache(PacketClassifier* classifier, size_t entries);
+	~FlowCache();
+
+	virtual void ConstructClassifier(const std::vector<Rule>& rules);
+	virtual int ClassifyAPacket(const Packet& packet);
+	// Looks up the whole batch first, then passes the misses to the
+	// classifier as one batch
+	virtual void ClassifyBatch(const Packet* packets, size_t n, int* results);
+	virtual void DeleteRule(size_t index);
+	virtual void InsertRule(const Rule& rule);
+	virtual Memory MemSizeBytes() const;
+
+private:
+	typedef FlowCacheTable::Entry Entry;
+	typedef FlowCacheTable::Bucket Bucket;
+	static const size_t EntriesPerBucket = FlowCacheTable::EntriesPerBucket;
+
+	virtual void Prepare(ThreadCache& c);
+	void NextGeneration();
+	int Classify(ThreadCache& c, const Packet& packet);
+	void ClassifyBatch(ThreadCache& c, const Packet* packets, size_t n, int* results);
+	// The entry for packet that is still current, or nullptr
+	const Entry* Find(const Bucket& b, const Packet& packet, uint32_t hash, uint32_t current) const;
+	void Fill(Bucket& b, const Packet& packet, uint32_t hash, uint32_t current, int priority);
+
+	size_t mask; // Buckets per cache, less one
+	std::atomic<uint32_t> generation;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include "../ElementaryClasses.h"
+#include "../OVS/hash.h"
+
+// Hash functions for the tuple tables, as policies: a table combines the
+// masked fields of a key with Start, Add per field, and Finish. Which
+// policy the tables use is fixed when compiling (TM_HASH for SlottedTable,
+// TSS_HASH for TupleTable), so each add inlines into the table's loop.
+namespace HashPolicy {
+	// Bernstein's multiply-add, h = 33 * h + w
+	struct Bernstein {
+		typedef uint32_t State;
+		static const char* Name() { return "Bernstein"; }
+		static State Start() { return 5381; }
+		static State Add(State hash, uint32_t word) { return hash * 33 + word; }
+		static uint32_t Finish(State hash) { return hash; }
+		static bool Supported() { return true; }
+	};
+
+	// Murmur3 mixing, as OVS uses it
+	struct Murmur {
+		typedef uint32_t State;
+		static const char* Name() { return "Murmur"; }
+		static State Start() { return 0; }
+		static State Add(State hash, uint32_t word) { return mhash_add(hash, word); }
+		static uint32_t Finish(State hash) { return mhash_finish(hash ^ 16); }
+		static bool Supported() { return true; }
+	};
+
+	// The SSE4.2 crc32 instruction, one field per instruction, with the
+	// multiply OVS finishes its CRC hashes with. The instruction is
+	// written out so that the rest of the build needs no -msse4.2; running
+	// it needs a CPU that has it.
+	struct Crc32 {
+		typedef uint32_t State;
+		static const char* Name() { return "Crc32"; }
+		static State Start() { return 0; }
+		static State Add(State hash, uint32_t word) {
+#if defined(__x86_64__) || defined(__i386__)
+			__asm__("crc32l %1, %0" : "+r"(hash) : "rm"(word));
+#else
+			hash ^= word;
+			for (int b = 0; b < 32; b++) {
+				hash = (hash >> 1) ^ (0x82f63b78u & -(hash & 1));
+			}
+#endif
+			return hash;
+		}
+		static uint32_t Finish(State hash) {
+			hash = Add(hash, 16) * 0x805204f3u;
+			return hash ^ hash >> 16;
+		}
+		static bool Supported() {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("sse4.2");
+#else
+			return true;
+#endif
+		}
+	};
+
+	// Multiply-shift: a 64-bit polynomial in an odd multiplier, keeping the
+	// high half, where the multiplies mix best
+	struct MultiplyShift {
+		typedef uint64_t State;
+		static const char* Name() { return "MultiplyShift"; }
+		static State Start() { return 0; }
+		static State Add(State hash, uint32_t word) { return (hash + word) * 0x9e3779b97f4a7c15ull; }
+		static uint32_t Finish(State hash) { return hash >> 32; }
+		static bool Supported() { return true; }
+	};
+
+	// Hash of the fields of p under masks, with every field taking part
+	template <class H>
+	inline uint32_t HashMasked(const Packet& p, const uint32_t* masks) {
+		typename H::State hash = H::Start();
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			hash = H::Add(hash, p[d] & masks[d]);
+		}
+		return H::Finish(hash);
+	}
+	template <class H>
+	inline uint32_t HashMasked(const Rule& r, const uint32_t* masks) {
+		typename H::State hash = H::Start();
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			hash = H::Add(hash, r.range[d][LowDim] & masks[d]);
+		}
+		return H::Finish(hash);
+	}
+}
+
+#ifndef TM_HASH
+#define TM_HASH Bernstein
+#endif
+#ifndef TSS_HASH
+#define TSS_HASH Murmur
+#endif
+typedef HashPolicy::TM_HASH TupleMergeHash;
+typedef HashPolicy::TSS_HASH TupleSpaceHash;
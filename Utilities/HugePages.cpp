@@ -0,0 +1,274 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "HugePages.h"
+#include "SlabPool.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+PagePolicy HugePages::policy = PagesNormal;
+const size_t HugePages::PageBytes;
+const size_t HugePages::ChunkBytes;
+
+namespace {
+	const size_t LineBytes = 64;
+	// Blocks up to this size, with their header, come from the size class
+	// slab pools; a 64 KB chunk then holds at least seven of them
+	const size_t SmallBytes = 8192;
+	const int SmallClasses = 7; // 128 bytes to SmallBytes
+
+	// The cache line in front of every block that isn't a mapping of its own
+	enum Source { FromHeap, FromSlab, FromRun };
+	struct Header {
+		void* base;   // What malloc() or the run gave, or the slab block
+		size_t bytes; // Length of the run
+		Source source;
+	};
+
+	size_t RoundUp(size_t x, size_t to) {
+		return (x + to - 1) / to * to;
+	}
+
+	// Regions, the runs of chunks they are carved into, and the big blocks
+	// that are mappings of their own, keyed by address
+	std::mutex regionsLock;
+	char* regionCursor = nullptr;
+	char* regionLimit = nullptr;
+	std::map<size_t, std::vector<char*>> freeRuns;
+	std::unordered_map<void*, size_t> mappings;
+	size_t mapped = 0;
+	bool hugeTlbFailed = false;
+
+	std::mutex classesLock;
+	SlabPool* classes[SmallClasses] = {};
+
+	char* MapPages(size_t bytes) {
+#ifdef __linux__
+		if (HugePages::Policy() == PagesHugeTLB && !hugeTlbFailed) {
+			void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED) {
+				mapped += bytes;
+				return (char*)p;
+			}
+			hugeTlbFailed = true;
+			fprintf(stderr, "Warning: no more huge pages reserved (see /proc/sys/vm/nr_hugepages), using transparent huge pages\n");
+		}
+		// Map a page more than needed and trim the ends, to start on a huge
+		// page boundary
+		size_t span = bytes + HugePages::PageBytes;
+		char* raw = (char*)mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == (char*)MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		char* p = (char*)RoundUp((uintptr_t)raw, HugePages::PageBytes);
+		if (p > raw) {
+			munmap(raw, p - raw);
+		}
+		if (raw + span > p + bytes) {
+			munmap(p + bytes, raw + span - (p + bytes));
+		}
+		madvise(p, bytes, MADV_HUGEPAGE);
+		mapped += bytes;
+		return p;
+#else
+		void* p;
+		if (posix_memalign(&p, HugePages::PageBytes, bytes) != 0) {
+			throw std::bad_alloc();
+		}
+		memset(p, 0, bytes);
+		mapped += bytes;
+		return (char*)p;
+#endif
+	}
+
+	void UnmapPages(void* p, size_t bytes) {
+#ifdef __linux__
+		munmap(p, bytes);
+#else
+		free(p);
+#endif
+		mapped -= bytes;
+	}
+
+	// A run of whole chunks, 'bytes' long, reusing one of the same length
+	// when there is one. Runs never cross regions.
+	char* CarveRun(size_t bytes) {
+		std::lock_guard<std::mutex> guard(regionsLock);
+		std::vector<char*>& reuse = freeRuns[bytes];
+		if (!reuse.empty()) {
+			char* run = reuse.back();
+			reuse.pop_back();
+			return run;
+		}
+		if (regionCursor == nullptr || regionCursor + bytes > regionLimit) {
+			// Whatever is left of the old region goes to slab chunks
+			for (; regionCursor != nullptr && regionCursor < regionLimit; regionCursor += HugePages::ChunkBytes) {
+				freeRuns[HugePages::ChunkBytes].push_back(regionCursor);
+			}
+			regionCursor = MapPages(HugePages::PageBytes);
+			regionLimit = regionCursor + HugePages::PageBytes;
+		}
+		char* run = regionCursor;
+		regionCursor += bytes;
+		return run;
+	}
+
+	void ReleaseRun(char* run, size_t bytes) {
+		std::lock_guard<std::mutex> guard(regionsLock);
+		freeRuns[bytes].push_back(run);
+	}
+}
+
+PagePolicy HugePages::ParsePolicy(const std::string& name) {
+	if (name == "Normal") {
+		return PagesNormal;
+	} else if (name == "Advise") {
+		return PagesAdvise;
+	} else if (name == "HugeTLB") {
+		return PagesHugeTLB;
+	}
+	printf("Unknown page policy: %s\n", name.c_str());
+	exit(EXIT_FAILURE);
+}
+
+const char* HugePages::PolicyName(PagePolicy p) {
+	switch (p) {
+	case PagesAdvise:
+		return "Advise";
+	case PagesHugeTLB:
+		return "HugeTLB";
+	default:
+		return "Normal";
+	}
+}
+
+void* HugePages::Allocate(size_t bytes, bool zero) {
+	size_t total = LineBytes + bytes;
+	char* block;
+	Header header;
+	if (policy == PagesNormal) {
+		// calloc() gets big blocks already zeroed from the system
+		void* base = zero ? calloc(1, total + LineBytes - 1) : malloc(total + LineBytes - 1);
+		if (base == nullptr) {
+			throw std::bad_alloc();
+		}
+		block = (char*)RoundUp((uintptr_t)base, LineBytes);
+		header = { base, 0, FromHeap };
+	} else if (total <= SmallBytes) {
+		int c = 0;
+		while ((size_t)128 << c < total) {
+			c++;
+		}
+		{
+			std::lock_guard<std::mutex> guard(classesLock);
+			if (classes[c] == nullptr) {
+				classes[c] = new SlabPool((size_t)128 << c, LineBytes);
+			}
+			block = (char*)classes[c]->Allocate();
+		}
+		if (zero) {
+			memset(block + LineBytes, 0, bytes);
+		}
+		header = { block, 0, FromSlab };
+	} else if (total <= PageBytes / 2) {
+		size_t length = RoundUp(total, ChunkBytes);
+		block = CarveRun(length);
+		if (zero) {
+			memset(block + LineBytes, 0, bytes);
+		}
+		header = { block, length, FromRun };
+	} else {
+		// A mapping of its own, fresh and so already zero. It needs no
+		// header: it is found by address when freed.
+		size_t length = RoundUp(bytes, policy == PagesHugeTLB ? PageBytes : 4096);
+		std::lock_guard<std::mutex> guard(regionsLock);
+		char* p = MapPages(length);
+		mappings[p] = length;
+		return p;
+	}
+	new (block) Header(header);
+	return block + LineBytes;
+}
+
+void HugePages::Free(void* p) {
+	if (p == nullptr) {
+		return;
+	}
+	if ((uintptr_t)p % PageBytes == 0 && policy != PagesNormal) {
+		std::lock_guard<std::mutex> guard(regionsLock);
+		auto it = mappings.find(p);
+		if (it != mappings.end()) {
+			UnmapPages(p, it->second);
+			mappings.erase(it);
+			return;
+		}
+	}
+	Header* header = (Header*)((char*)p - LineBytes);
+	switch (header->source) {
+	case FromHeap:
+		free(header->base);
+		break;
+	case FromSlab:
+		SlabPool::Release(header->base);
+		break;
+	case FromRun:
+		ReleaseRun((char*)header->base, header->bytes);
+		break;
+	}
+}
+
+void* HugePages::AllocateChunk() {
+	if (policy == PagesNormal) {
+		void* chunk;
+		if (posix_memalign(&chunk, ChunkBytes, ChunkBytes) != 0) {
+			throw std::bad_alloc();
+		}
+		return chunk;
+	}
+	return CarveRun(ChunkBytes);
+}
+
+void HugePages::FreeChunk(void* chunk) {
+	if (policy == PagesNormal) {
+		free(chunk);
+	} else {
+		ReleaseRun((char*)chunk, ChunkBytes);
+	}
+}
+
+size_t HugePages::MappedBytes() {
+	std::lock_guard<std::mutex> guard(regionsLock);
+	return mapped;
+}
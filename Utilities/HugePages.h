@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Where the big, hot allocations get their pages. With hundreds of tuple
+// tables spread over the heap, lookups on large rulesets spend much of their
+// time missing the TLB; backing cmap bucket arrays and the chunks of slab
+// pools (cmap nodes, their rules, red-black tree nodes) with 2 MB pages lets
+// a handful of TLB entries cover what took thousands.
+//
+//   PagesNormal   the heap, as always
+//   PagesAdvise   2 MB aligned anonymous regions marked MADV_HUGEPAGE, for
+//                 transparent huge pages to back as the kernel can
+//   PagesHugeTLB  MAP_HUGETLB regions from the reserved huge page pool; once
+//                 that runs dry, warns and does as PagesAdvise
+//
+// Under the last two, small blocks and slab chunks are carved out of shared
+// regions and reused when given back, but regions are never unmapped. The
+// policy is set once, before anything is allocated under it.
+enum PagePolicy { PagesNormal, PagesAdvise, PagesHugeTLB };
+
+class HugePages {
+public:
+	static const size_t PageBytes = 2 << 20;
+	// The unit regions are carved in; also SlabPool's chunk size
+	static const size_t ChunkBytes = 1 << 16;
+
+	static void SetPolicy(PagePolicy p) { policy = p; }
+	static PagePolicy Policy() { return policy; }
+	// Normal, Advise or HugeTLB
+	static PagePolicy ParsePolicy(const std::string& name);
+	static const char* PolicyName(PagePolicy p);
+
+	// Cache-line aligned blocks of any size, zeroed if asked
+	static void* Allocate(size_t bytes, bool zero);
+	static void Free(void* p);
+
+	// ChunkBytes sized and aligned
+	static void* AllocateChunk();
+	static void FreeChunk(void* chunk);
+
+	// Bytes mapped for regions and big blocks so far
+	static size_t MappedBytes();
+
+private:
+	static PagePolicy policy;
+};
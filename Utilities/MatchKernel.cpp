@@ -0,0 +1,88 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "MatchKernel.h"
+
+MatchRecord::MatchRecord(const Rule& r) : priority(r.priority) {
+	for (int i = 0; i < MAXDIMENSIONS; i++) {
+		low[i] = r.range[i][LowDim];
+		high[i] = r.range[i][HighDim];
+	}
+}
+
+namespace {
+	// The shortest prefix of v whose block of values lies wholly inside or
+	// wholly outside [low, high]
+	Point DecidingPrefix(Point v, Point low, Point high) {
+		for (int len = 0; len < 32; len++) {
+			Point mask = len == 0 ? 0 : ~0u << (32 - len);
+			Point first = v & mask;
+			Point last = first | ~mask;
+			if ((low <= first && last <= high) || last < low || first > high) return mask;
+		}
+		return ~0u;
+	}
+
+	MatchKernel::Isa SelectIsa() {
+#ifdef MATCH_KERNEL_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return MatchKernel::IsaAvx2;
+		if (__builtin_cpu_supports("sse4.1")) return MatchKernel::IsaSse41;
+#endif
+		return MatchKernel::IsaScalar;
+	}
+}
+
+namespace MatchKernel {
+	const Isa Selected = SelectIsa();
+
+	bool Matches(const Packet& p, const MatchRecord& r) {
+		return Run([&](auto k) __attribute__((always_inline)) { return decltype(k)::Matches(p, r); });
+	}
+
+	size_t FirstMatch(const Packet& p, const MatchRecord* records, size_t n) {
+		return Run([&](auto k) __attribute__((always_inline)) { return decltype(k)::FirstMatch(p, records, n); });
+	}
+
+	const char* Name() {
+		switch (Selected) {
+		case IsaAvx2: return "avx2";
+		case IsaSse41: return "sse4.1";
+		default: return "scalar";
+		}
+	}
+
+	bool MatchesWildcarded(const Packet& p, const MatchRecord& r, Packet& wildcards) {
+		// A miss only depends on one field that is out of range
+		for (int i = 0; i < MAXDIMENSIONS; i++) {
+			if (p[i] < r.low[i] || p[i] > r.high[i]) {
+				wildcards[i] |= DecidingPrefix(p[i], r.low[i], r.high[i]);
+				return false;
+			}
+		}
+		for (int i = 0; i < MAXDIMENSIONS; i++) {
+			wildcards[i] |= DecidingPrefix(p[i], r.low[i], r.high[i]);
+		}
+		return true;
+	}
+}
@@ -0,0 +1,173 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include "../ElementaryClasses.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATCH_KERNEL_X86
+#endif
+
+// The fields of a rule needed to test a packet against it, stored as two
+// parallel arrays so that several fields can be compared at once
+struct MatchRecord {
+	MatchRecord() {}
+	MatchRecord(const Rule& r);
+
+	Point low[MAXDIMENSIONS];
+	Point high[MAXDIMENSIONS];
+	int priority;
+};
+
+// Packet/rule match tests that compare all fields with one vector operation.
+// Each kernel is built for one instruction set (AVX2, SSE4.1, or a plain
+// loop), and the widest one the CPU supports is picked at startup.  Chain
+// walks are written once as a template over the kernel and run through Run,
+// which calls them from a function built for the kernel's instruction set,
+// so that the test inlines into each copy of the walk.
+namespace MatchKernel {
+	struct Scalar {
+		static bool Matches(const Packet& p, const MatchRecord& r) {
+			for (int i = 0; i < MAXDIMENSIONS; i++) {
+				if (p[i] < r.low[i] || p[i] > r.high[i]) return false;
+			}
+			return true;
+		}
+		// Returns the index of the first of the n records that p matches, or n
+		static size_t FirstMatch(const Packet& p, const MatchRecord* records, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				if (Matches(p, records[i])) return i;
+			}
+			return n;
+		}
+	};
+
+#ifdef MATCH_KERNEL_X86
+	// A field is inside [low, high] iff max(p, low) == p and min(p, high) == p;
+	// the unsigned min/max avoid the sign tricks a compare would need
+	struct Sse41 {
+		// Four fields at a time and the rest one by one
+		__attribute__((target("sse4.1")))
+		static bool Matches(const Packet& p, const MatchRecord& r) {
+			int d = 0;
+			for (; d + 4 <= MAXDIMENSIONS; d += 4) {
+				__m128i pv = _mm_loadu_si128((const __m128i*)(p.data() + d));
+				__m128i lo = _mm_loadu_si128((const __m128i*)(r.low + d));
+				__m128i hi = _mm_loadu_si128((const __m128i*)(r.high + d));
+				__m128i in = _mm_and_si128(_mm_cmpeq_epi32(_mm_max_epu32(pv, lo), pv), _mm_cmpeq_epi32(_mm_min_epu32(pv, hi), pv));
+				if (_mm_movemask_epi8(in) != 0xFFFF) return false;
+			}
+			for (; d < MAXDIMENSIONS; d++) {
+				if (p[d] < r.low[d] || p[d] > r.high[d]) return false;
+			}
+			return true;
+		}
+		__attribute__((target("sse4.1")))
+		static size_t FirstMatch(const Packet& p, const MatchRecord* records, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				if (Matches(p, records[i])) return i;
+			}
+			return n;
+		}
+	};
+
+	struct Avx2 {
+		// Lanes outside the mask load as zero and so always pass the test
+		__attribute__((target("avx2")))
+		static bool InRange(__m256i pv, const Point* low, const Point* high, __m256i mask) {
+			__m256i lo = _mm256_maskload_epi32((const int*)low, mask);
+			__m256i hi = _mm256_maskload_epi32((const int*)high, mask);
+			__m256i in = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(pv, lo), pv), _mm256_cmpeq_epi32(_mm256_min_epu32(pv, hi), pv));
+			return _mm256_movemask_epi8(in) == -1;
+		}
+		// Loading 8 entries from TailMask + 8 - k gives a mask selecting the
+		// first k lanes
+		__attribute__((target("avx2")))
+		static __m256i Tail() {
+			alignas(32) static const int TailMask[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+			return _mm256_loadu_si256((const __m256i*)(TailMask + 8 - MAXDIMENSIONS % 8));
+		}
+		__attribute__((target("avx2")))
+		static size_t FirstMatch(const Packet& p, const MatchRecord* records, size_t n) {
+			const int full = MAXDIMENSIONS / 8 * 8;
+			const __m256i all = _mm256_set1_epi32(-1);
+			const __m256i tail = Tail();
+			// The packet is loaded once for the whole run of records
+			__m256i pv[MAXDIMENSIONS / 8 + 1];
+			for (int d = 0; d < full; d += 8) {
+				pv[d / 8] = _mm256_loadu_si256((const __m256i*)(p.data() + d));
+			}
+			pv[full / 8] = _mm256_maskload_epi32((const int*)(p.data() + full), tail);
+
+			for (size_t i = 0; i < n; i++) {
+				const MatchRecord& r = records[i];
+				bool in = true;
+				for (int d = 0; in && d < full; d += 8) {
+					in = InRange(pv[d / 8], r.low + d, r.high + d, all);
+				}
+				if (in && InRange(pv[full / 8], r.low + full, r.high + full, tail)) return i;
+			}
+			return n;
+		}
+		__attribute__((target("avx2")))
+		static bool Matches(const Packet& p, const MatchRecord& r) {
+			return FirstMatch(p, &r, 1) == 0;
+		}
+	};
+
+	// Hosts for a walk, built for each kernel's instruction set
+	template <class Walk>
+	__attribute__((target("sse4.1")))
+	auto RunSse41(Walk& walk) { return walk(Sse41()); }
+	template <class Walk>
+	__attribute__((target("avx2")))
+	auto RunAvx2(Walk& walk) { return walk(Avx2()); }
+#endif
+
+	enum Isa { IsaScalar, IsaSse41, IsaAvx2 };
+	// Picked once, at startup
+	extern const Isa Selected;
+
+	// Returns walk(kernel) for the kernel picked at startup.  walk is a generic
+	// lambda that calls the static Matches or FirstMatch of its argument's
+	// type; marked always_inline, it is compiled into each host above
+	template <class Walk>
+	inline auto Run(Walk walk) {
+#ifdef MATCH_KERNEL_X86
+		if (Selected == IsaAvx2) return RunAvx2(walk);
+		if (Selected == IsaSse41) return RunSse41(walk);
+#endif
+		return walk(Scalar());
+	}
+
+	// For callers off the hot path: one test with the picked kernel
+	bool Matches(const Packet& p, const MatchRecord& r);
+	size_t FirstMatch(const Packet& p, const MatchRecord* records, size_t n);
+	// As Matches, also setting in wildcards the bits of p that decide the
+	// answer: any packet that agrees with p on those bits gets the same one
+	bool MatchesWildcarded(const Packet& p, const MatchRecord& r, Packet& wildcards);
+	// Name of the instruction set in use
+	const char* Name();
+}
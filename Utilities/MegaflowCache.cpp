@@ -0,0 +1,205 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "MegaflowCache.h"
+#include "../OVS/hash.h"
+
+using namespace std;
+
+size_t MegaflowCacheTable::PacketHasher::operator()(const Packet& p) const {
+	return hash_words_inline(p.data(), p.size(), 0);
+}
+
+MegaflowCache::MegaflowCache(PacketClassifier* classifier, size_t entries) : CachingClassifier(classifier), capacity(entries), logging(0), generation(0) {
+	ResetQueryStats(1);
+}
+
+void MegaflowCache::ConstructClassifier(const vector<Rule>& rules) {
+	classifier->ConstructClassifier(rules);
+	this->rules = rules;
+	// Too far ahead for any cache to catch up: they all start over
+	uint32_t next = generation.load(std::memory_order_relaxed) + LogSize + 1;
+	logging.store(next, std::memory_order_relaxed);
+	generation.store(next, std::memory_order_release);
+}
+
+int MegaflowCache::ClassifyAPacket(const Packet& packet) {
+	return WithCache([&](ThreadCache& c) { return Classify(c, packet); });
+}
+
+int MegaflowCache::Classify(ThreadCache& c, const Packet& packet) {
+	uint32_t current = generation.load(std::memory_order_acquire);
+	if (current != c.seen) {
+		Revalidate(c, current);
+	}
+
+	// Now and then, move the busiest masks to the front
+	if (++c.lookups % 4096 == 0) {
+		sort(c.subtables.begin(), c.subtables.end(), [](const Subtable& sx, const Subtable& sy) { return sx.hits > sy.hits; });
+	}
+	int q = 0;
+	for (auto& s : c.subtables) {
+		Packet key;
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			key[d] = packet[d] & s.mask[d];
+		}
+		q++;
+		auto it = s.flows.find(key);
+		if (it != s.flows.end()) {
+			s.hits++;
+			c.hits++;
+			QueryUpdate(q);
+			return it->second;
+		}
+	}
+	QueryUpdate(q);
+
+	Packet wildcards;
+	wildcards.fill(0);
+	int priority = classifier->ClassifyWildcarded(packet, wildcards);
+	AddFlow(c, packet, wildcards, priority);
+	return priority;
+}
+
+void MegaflowCache::AddFlow(ThreadCache& c, const Packet& packet, const Packet& wildcards, int priority) {
+	if (c.flows >= capacity) {
+		c.subtables.clear();
+		c.flows = 0;
+	}
+	auto s = find_if(c.subtables.begin(), c.subtables.end(), [&](const Subtable& st) { return st.mask == wildcards; });
+	if (s == c.subtables.end()) {
+		c.subtables.emplace_back();
+		s = c.subtables.end() - 1;
+		s->mask = wildcards;
+	}
+	Packet key;
+	for (int d = 0; d < MAXDIMENSIONS; d++) {
+		key[d] = packet[d] & wildcards[d];
+	}
+	if (s->flows.emplace(key, priority).second) {
+		c.flows++;
+	}
+}
+
+void MegaflowCache::Revalidate(ThreadCache& c, uint32_t current) {
+	// The slot of generation g is reused for g + LogSize
+	bool lost = current - c.seen > LogSize;
+	for (uint32_t g = c.seen + 1; !lost && g != current + 1; g++) {
+		const Update& u = log[g % LogSize];
+		int priority = u.priority.load(std::memory_order_relaxed);
+		Point low[MAXDIMENSIONS], high[MAXDIMENSIONS];
+		for (int d = 0; d < MAXDIMENSIONS; d++) {
+			low[d] = u.low[d].load(std::memory_order_relaxed);
+			high[d] = u.high[d].load(std::memory_order_relaxed);
+		}
+		bool inserted = u.inserted.load(std::memory_order_relaxed);
+
+		for (auto& s : c.subtables) {
+			for (auto it = s.flows.begin(); it != s.flows.end();) {
+				bool stale;
+				if (inserted) {
+					// Could the new rule match a packet the entry covers?  The
+					// covered values of a field all lie in [key, key | ~mask]
+					stale = it->second < priority;
+					for (int d = 0; stale && d < MAXDIMENSIONS; d++) {
+						Point first = it->first[d], last = it->first[d] | ~s.mask[d];
+						stale = !(last < low[d] || first > high[d]);
+					}
+				} else {
+					stale = it->second == priority;
+				}
+				if (stale) {
+					it = s.flows.erase(it);
+					c.flows--;
+				} else {
+					++it;
+				}
+			}
+		}
+	}
+	// Nor while being read, as with a seqlock
+	std::atomic_thread_fence(std::memory_order_acquire);
+	lost = lost || logging.load(std::memory_order_relaxed) - c.seen > LogSize;
+	if (lost) {
+		c.subtables.clear();
+		c.flows = 0;
+	} else {
+		c.subtables.erase(remove_if(c.subtables.begin(), c.subtables.end(), [](const Subtable& s) { return s.flows.empty(); }), c.subtables.end());
+	}
+	c.seen = current;
+}
+
+void MegaflowCache::Log(const Rule& rule, bool inserted) {
+	// Updates come from one thread at a time
+	uint32_t next = generation.load(std::memory_order_relaxed) + 1;
+	logging.store(next, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	Update& u = log[next % LogSize];
+	u.inserted.store(inserted, std::memory_order_relaxed);
+	u.priority.store(rule.priority, std::memory_order_relaxed);
+	for (int d = 0; d < MAXDIMENSIONS; d++) {
+		u.low[d].store(rule.range[d][LowDim], std::memory_order_relaxed);
+		u.high[d].store(rule.range[d][HighDim], std::memory_order_relaxed);
+	}
+	generation.store(next, std::memory_order_release);
+}
+
+void MegaflowCache::InsertRule(const Rule& rule) {
+	classifier->InsertRule(rule);
+	rules.push_back(rule);
+	Log(rule, true);
+}
+
+void MegaflowCache::DeleteRule(size_t index) {
+	classifier->DeleteRule(index);
+	Rule rule = rules[index];
+	rules[index] = rules.back();
+	rules.pop_back();
+	Log(rule, false);
+}
+
+Memory MegaflowCache::MemSizeBytes() const {
+	size_t bytes = 0;
+	for (const auto& c : caches) {
+		for (const auto& s : c.subtables) {
+			bytes += sizeof(Subtable) + s.flows.size() * (sizeof(Packet) + sizeof(int) + sizeof(void*));
+		}
+	}
+	return classifier->MemSizeBytes() + bytes;
+}
+
+size_t MegaflowCache::NumMegaflows() const {
+	size_t flows = 0;
+	for (const auto& c : caches) {
+		flows += c.flows;
+	}
+	return flows;
+}
+
+size_t MegaflowCache::NumMasks() const {
+	size_t masks = 0;
+	for (const auto& c : caches) {
+		masks += c.subtables.size();
+	}
+	return masks;
+}
@@ -0,0 +1,96 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MEGAFLOW_CACHE_H
+#define MEGAFLOW_CACHE_H
+
+#include "CachingClassifier.h"
+#include <atomic>
+
+// A wildcarded cache in front of another classifier, after the megaflows of
+// Open vSwitch.  A miss asks the classifier which header bits its answer
+// depended on (ClassifyWildcarded) and caches the answer for every packet
+// that shares those bits.  Each thread keeps its own cache, searched as a
+// small tuple space: one hash table per distinct wildcard mask, the most hit
+// first.
+//
+// Updates are logged rather than flushing the caches.  Before its next
+// lookup, each thread revalidates its entries against the updates it has not
+// seen: a deleted rule takes out the entries that answered with it, and an
+// inserted rule the lower priority entries it may overlap.  A thread that
+// falls more than a log's worth of updates behind starts over empty.
+//
+// The query counts of this class are the number of masks tried per packet.
+struct MegaflowCacheTable {
+	struct PacketHasher {
+		size_t operator()(const Packet& p) const;
+	};
+	struct Subtable {
+		Packet mask;
+		std::unordered_map<Packet, int, PacketHasher> flows; // Masked header -> priority
+		size_t hits = 0;
+	};
+	std::vector<Subtable> subtables;
+	size_t flows = 0;
+	uint32_t seen = 0; // Generation the entries are valid for
+};
+
+class MegaflowCache : public CachingClassifier<MegaflowCacheTable> {
+public:
+	// Takes ownership of classifier; each thread keeps up to entries flows
+	MegaflowCache(PacketClassifier* classifier, size_t entries);
+
+	virtual void ConstructClassifier(const std::vector<Rule>& rules);
+	virtual int ClassifyAPacket(const Packet& packet);
+	virtual void DeleteRule(size_t index);
+	virtual void InsertRule(const Rule& rule);
+	virtual Memory MemSizeBytes() const;
+
+	size_t NumMegaflows() const;
+	size_t NumMasks() const;
+
+private:
+	typedef MegaflowCacheTable::Subtable Subtable;
+	// One rule update, read by classifying threads while the writer may be
+	// reusing the slot, hence the atomics
+	struct Update {
+		std::atomic<bool> inserted;
+		std::atomic<int> priority;
+		std::atomic<Point> low[MAXDIMENSIONS];
+		std::atomic<Point> high[MAXDIMENSIONS];
+	};
+	static const uint32_t LogSize = 256;
+
+	int Classify(ThreadCache& c, const Packet& packet);
+	void Log(const Rule& rule, bool inserted);
+	void Revalidate(ThreadCache& c, uint32_t current);
+	void AddFlow(ThreadCache& c, const Packet& packet, const Packet& wildcards, int priority);
+
+	size_t capacity;
+	std::vector<Rule> rules; // Kept in the same order as the classifier's, to find what DeleteRule deletes
+	std::array<Update, LogSize> log; // The update that made generation g is in log[g % LogSize]
+	std::atomic<uint32_t> logging;    // Generation whose slot is being written
+	std::atomic<uint32_t> generation; // Latest complete generation
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "SlabPool.h"
+
+#include <cstdint>
+#include <new>
+
+static size_t RoundUp(size_t x, size_t to) {
+	return (x + to - 1) / to * to;
+}
+
+SlabPool::SlabPool(size_t blockSize, size_t alignment)
+	: blockSize(RoundUp(blockSize < sizeof(Block) ? sizeof(Block) : blockSize, alignment)), alignment(alignment) {
+}
+
+SlabPool::~SlabPool() {
+	for (void* chunk : chunks) {
+		HugePages::FreeChunk(chunk);
+	}
+}
+
+void* SlabPool::Allocate() {
+	if (!freeList) {
+		freeList = released.exchange(nullptr, std::memory_order_acquire);
+	}
+	if (freeList) {
+		Block* b = freeList;
+		freeList = b->next;
+		return b;
+	}
+	if (cursor == nullptr || cursor + blockSize > limit) {
+		void* chunk = HugePages::AllocateChunk();
+		chunks.push_back(chunk);
+		new (chunk) ChunkHeader{ this };
+		cursor = (char*)chunk + RoundUp(sizeof(ChunkHeader), alignment);
+		limit = (char*)chunk + ChunkBytes;
+	}
+	void* p = cursor;
+	cursor += blockSize;
+	return p;
+}
+
+void SlabPool::Release(void* p) {
+	ChunkHeader* chunk = (ChunkHeader*)((uintptr_t)p & ~(uintptr_t)(ChunkBytes - 1));
+	SlabPool* pool = chunk->pool;
+	// Only the allocating thread ever pops, and it takes the whole stack at
+	// once, so pushes need no protection against ABA
+	Block* b = (Block*)p;
+	Block* head = pool->released.load(std::memory_order_relaxed);
+	do {
+		b->next = head;
+	} while (!pool->released.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+}
@@ -0,0 +1,76 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 by J. Daly at Michigan State University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include "HugePages.h"
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Fixed-size blocks carved out of large aligned chunks. A block that is
+// given back goes on a free list and is handed out again before the pool
+// takes a new chunk, so whatever the churn, the blocks stay packed in as
+// few chunks as the live count needs. Blocks are never returned to the
+// heap before the pool itself goes. Chunks come from HugePages, so they
+// sit on huge pages when the page policy asks for them.
+//
+// One thread allocates. Any thread may release, as the RCU callbacks that
+// retire nodes do: releases land on a lock-free stack that the allocating
+// thread takes over whole when its own free list runs dry.
+class SlabPool {
+public:
+	SlabPool(size_t blockSize, size_t alignment = alignof(void*));
+	// Frees every chunk; no block may be used afterwards
+	~SlabPool();
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+	void* Allocate();
+	// Gives p back to the pool it came from
+	static void Release(void* p);
+
+	size_t BlockSize() const { return blockSize; }
+	size_t MemSizeBytes() const { return chunks.size() * ChunkBytes; }
+
+	// Chunks are aligned to their size, so a block finds its pool by
+	// rounding its address down to the chunk header
+	static const size_t ChunkBytes = HugePages::ChunkBytes;
+
+private:
+	struct Block {
+		Block* next;
+	};
+	struct alignas(64) ChunkHeader {
+		SlabPool* pool;
+	};
+
+	size_t blockSize;
+	size_t alignment;
+	std::vector<void*> chunks;
+	char* cursor = nullptr; // Unused part of the newest chunk
+	char* limit = nullptr;
+	Block* freeList = nullptr; // Only the allocating thread touches this
+	std::atomic<Block*> released{ nullptr };
+};
@@ -35,8 +35,14 @@
 #include "BruteForce.h"
 #include "TupleMerge/TupleMergeOnline.h"
 #include "TupleMerge/TupleMergeOffline.h"
+#include "TupleMerge/TupleMergeSnapshot.h"
+#include "TupleMerge/TupleMergeHybrid.h"
 #include "OVS/cmap.h"
+#include "OVS/ovs-rcu.h"
 #include "OVS/TupleSpaceSearch.h"
+#include "Utilities/FlowCache.h"
+#include "Utilities/MegaflowCache.h"
+#include "Utilities/HugePages.h"
 #include "ClassBenchTraceGenerator/trace_tools.h"
 
 #include "PartitionSort/PartitionSort.h"
@@ -46,8 +52,12 @@
 #include <assert.h>
 #include <memory>
 #include <chrono>
+#include <limits>
 #include <string>
 #include <sstream>
+#include <unordered_set>
+#include <deque>
+#include <numeric>
 
 using namespace std;
 unsigned int HashPacket(const Packet& p, int sip_length, int dip_length) {
@@ -66,7 +76,8 @@ unsigned int inline hash_rule(const Rule& r)  {
 
 }
 
-void PrepareSimulators(const unordered_map<string, string>& args, ClassifierTests tests, unordered_map<string, PacketClassifier*>& classifiers) {
+// The classifiers are to be built from rules, which a snapshot is checked against
+void PrepareSimulators(const unordered_map<string, string>& args, ClassifierTests tests, const vector<Rule>& rules, unordered_map<string, PacketClassifier*>& classifiers) {
 	if (tests & ClassifierTests::TestDiscPac) {
 		classifiers["DISCPAC"] = new DISCPAC();
 	}
@@ -101,13 +112,45 @@ void PrepareSimulators(const unordered_map<string, string>& args, ClassifierTest
 	if (tests & ClassifierTests::TestForgeOnline) {
 		classifiers["TupleMerge-Online"] = new TupleMergeOnline(args);
 	}
+	if (tests & ClassifierTests::TestForgeHybrid) {
+		classifiers["TupleMerge-Hybrid"] = new TupleMergeHybrid(args, true);
+	}
+	if (tests & ClassifierTests::TestForgeHybridOnline) {
+		classifiers["TupleMerge-HybridOnline"] = new TupleMergeHybrid(args, false);
+	}
+	string snapshot = GetOrElse(args, "Snapshot", "");
+	if ((tests & ClassifierTests::TestForgeImage) && !snapshot.empty()) {
+		TupleMergeImage* image = new TupleMergeImage;
+		if (!image->Load(snapshot, rules)) {
+			exit(EINVAL);
+		}
+		classifiers["TupleMerge-Image"] = image;
+	}
+
+	// Caches go in front in the order OVS looks them up: exact match first
+	int megaflows = GetIntOrElse(args, "Megaflow", 0);
+	if (megaflows > 0) {
+		for (auto& pair : classifiers) {
+			pair.second = new MegaflowCache(pair.second, megaflows);
+		}
+	}
+	int cacheEntries = GetIntOrElse(args, "FlowCache", 0);
+	if (cacheEntries > 0) {
+		for (auto& pair : classifiers) {
+			pair.second = new FlowCache(pair.second, cacheEntries);
+		}
+	}
 }
 
 
-vector<int> RunSimulatorClassificationTrial(Simulator& s, const string& name, PacketClassifier& classifier, vector<map<string, string>>& data) {
+vector<int> RunSimulatorClassificationTrial(Simulator& s, const string& name, PacketClassifier& classifier, vector<map<string, string>>& data, const unordered_map<string, string>& args) {
 	map<string, string> d = { { "Classifier", name } };
 	printf("%s\n", name.c_str());
-	auto r = s.PerformOnlyPacketClassification(classifier, d);
+	size_t batchSize = GetIntOrElse(args, "Batch", 1);
+	auto r = s.PerformOnlyPacketClassification(classifier, d, batchSize);
+	if (auto tm = dynamic_cast<TupleMergeOnline*>(&classifier)) {
+		printf("\tCollision limit: %d\n", tm->CollideLimit());
+	}
 	data.push_back(d);
 	return r;
 }
@@ -116,15 +159,163 @@ pair< vector<string>, vector<map<string, string>>>  RunSimulatorOnlyClassificati
 	printf("Classification Simulation\n");
 	Simulator s(rules, packets);
 
-	vector<string> header = { "Classifier", "ConstructionTime(ms)", "ClassificationTime(s)", "Size(bytes)", "MemoryAccess", "Tables", "TableSizes", "TablePriorities", "TableQueries", "AvgQueries" };
+	vector<string> header = { "Classifier", "ConstructionTime(ms)", "ClassificationTime(s)", "dTLBMissesPerPacket", "Size(bytes)", "MemoryAccess", "Tables", "TableSizes", "TablePriorities", "TableQueries", "AvgQueries" };
 	vector<map<string, string>> data;
 
 	unordered_map<string, PacketClassifier*> classifiers;
-	PrepareSimulators(args, tests, classifiers);
+	PrepareSimulators(args, tests, rules, classifiers);
 	
 	for (auto& pair : classifiers) {
-		RunSimulatorClassificationTrial(s, pair.first, *pair.second, data);
+		RunSimulatorClassificationTrial(s, pair.first, *pair.second, data, args);
+		delete pair.second;
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorFlowCache(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Flow Cache Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "Entries", "ClassificationTime(s)", "CachedTime(s)", "HitRate", "Speedup", "Size(bytes)" };
+	vector<map<string, string>> data;
+
+	// Each classifier runs bare, then again as a fresh copy behind the cache
+	int entries = GetIntOrElse(args, "FlowCache", 8192);
+	unordered_map<string, string> bareArgs = args;
+	bareArgs.erase("FlowCache");
+	unordered_map<string, PacketClassifier*> classifiers, copies;
+	PrepareSimulators(bareArgs, tests, rules, classifiers);
+	PrepareSimulators(bareArgs, tests, rules, copies);
+
+	for (auto& pair : classifiers) {
+		map<string, string> d = { { "Classifier", pair.first }, { "Entries", to_string(entries) } };
+		map<string, string> bare, cached;
+		printf("%s\n", pair.first.c_str());
+		s.PerformOnlyPacketClassification(*pair.second, bare);
+		delete pair.second;
+
+		printf("%s with flow cache\n", pair.first.c_str());
+		FlowCache cache(copies[pair.first], entries);
+		s.PerformOnlyPacketClassification(cache, cached);
+
+		double bareTime = stod(bare["ClassificationTime(s)"]);
+		double cachedTime = stod(cached["ClassificationTime(s)"]);
+		printf("\tHit rate: %f\n", cache.HitRate());
+		printf("\tSpeedup: %f\n", bareTime / cachedTime);
+		d["ClassificationTime(s)"] = bare["ClassificationTime(s)"];
+		d["CachedTime(s)"] = cached["ClassificationTime(s)"];
+		d["HitRate"] = to_string(cache.HitRate());
+		d["Speedup"] = to_string(bareTime / cachedTime);
+		d["Size(bytes)"] = cached["Size(bytes)"];
+		data.push_back(d);
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorMegaflow(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Megaflow Cache Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "Entries", "ClassificationTime(s)", "CachedTime(s)", "HitRate", "Speedup", "Megaflows", "Masks", "AvgQueries", "CachedAvgQueries", "Size(bytes)" };
+	vector<map<string, string>> data;
+
+	// As RunSimulatorFlowCache, with the megaflow cache
+	int entries = GetIntOrElse(args, "Megaflow", 65536);
+	unordered_map<string, string> bareArgs = args;
+	bareArgs.erase("Megaflow");
+	bareArgs.erase("FlowCache");
+	unordered_map<string, PacketClassifier*> classifiers, copies;
+	PrepareSimulators(bareArgs, tests, rules, classifiers);
+	PrepareSimulators(bareArgs, tests, rules, copies);
+
+	for (auto& pair : classifiers) {
+		map<string, string> d = { { "Classifier", pair.first }, { "Entries", to_string(entries) } };
+		map<string, string> bare, cached;
+		printf("%s\n", pair.first.c_str());
+		s.PerformOnlyPacketClassification(*pair.second, bare);
+		delete pair.second;
+
+		printf("%s with megaflow cache\n", pair.first.c_str());
+		MegaflowCache cache(copies[pair.first], entries);
+		s.PerformOnlyPacketClassification(cache, cached);
+
+		double bareTime = stod(bare["ClassificationTime(s)"]);
+		double cachedTime = stod(cached["ClassificationTime(s)"]);
+		printf("\tHit rate: %f\n", cache.HitRate());
+		printf("\tMegaflows: %lu in %lu masks\n", cache.NumMegaflows(), cache.NumMasks());
+		printf("\tSpeedup: %f\n", bareTime / cachedTime);
+		d["ClassificationTime(s)"] = bare["ClassificationTime(s)"];
+		d["CachedTime(s)"] = cached["ClassificationTime(s)"];
+		d["HitRate"] = to_string(cache.HitRate());
+		d["Speedup"] = to_string(bareTime / cachedTime);
+		d["Megaflows"] = to_string(cache.NumMegaflows());
+		d["Masks"] = to_string(cache.NumMasks());
+		d["AvgQueries"] = bare["AvgQueries"];
+		d["CachedAvgQueries"] = cached["AvgQueries"];
+		d["Size(bytes)"] = cached["Size(bytes)"];
+		data.push_back(d);
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorFilter(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Table Filter Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "Counters", "ClassificationTime(s)", "FilteredTime(s)", "Speedup", "ProbesAvoided", "Size(bytes)", "FilteredSize(bytes)" };
+	vector<map<string, string>> data;
+
+	// Each TupleMerge classifier runs without table filters, then again as a
+	// fresh copy with them
+	size_t batchSize = GetIntOrElse(args, "Batch", 1);
+	int counters = GetIntOrElse(args, "TM.Filter", 8);
+	unordered_map<string, string> bareArgs = args, filterArgs = args;
+	bareArgs["TM.Filter"] = "0";
+	filterArgs["TM.Filter"] = to_string(counters);
+	unordered_map<string, PacketClassifier*> classifiers, copies;
+	PrepareSimulators(bareArgs, tests, rules, classifiers);
+	PrepareSimulators(filterArgs, tests, rules, copies);
+
+	for (auto& pair : classifiers) {
+		TupleMergeOnline* filtered = dynamic_cast<TupleMergeOnline*>(copies[pair.first]);
+		if (filtered) {
+			map<string, string> d = { { "Classifier", pair.first }, { "Counters", to_string(counters) } };
+			map<string, string> bare, withFilter;
+			printf("%s\n", pair.first.c_str());
+			s.PerformOnlyPacketClassification(*pair.second, bare, batchSize);
+
+			printf("%s with table filters\n", pair.first.c_str());
+			s.PerformOnlyPacketClassification(*filtered, withFilter, batchSize);
+
+			double bareTime = stod(bare["ClassificationTime(s)"]);
+			double filteredTime = stod(withFilter["ClassificationTime(s)"]);
+			printf("\tProbes avoided: %f\n", filtered->FilteredProbes());
+			printf("\tSpeedup: %f\n", bareTime / filteredTime);
+			d["ClassificationTime(s)"] = bare["ClassificationTime(s)"];
+			d["FilteredTime(s)"] = withFilter["ClassificationTime(s)"];
+			d["Speedup"] = to_string(bareTime / filteredTime);
+			d["ProbesAvoided"] = to_string(filtered->FilteredProbes());
+			d["Size(bytes)"] = bare["Size(bytes)"];
+			d["FilteredSize(bytes)"] = withFilter["Size(bytes)"];
+			data.push_back(d);
+		} else {
+			printf("%s: skipped, has no table filters\n", pair.first.c_str());
+		}
 		delete pair.second;
+		delete copies[pair.first];
 	}
 
 	if (outfile != "") {
@@ -133,6 +324,555 @@ pair< vector<string>, vector<map<string, string>>>  RunSimulatorOnlyClassificati
 	return make_pair(header, data);
 }
 
+pair< vector<string>, vector<map<string, string>>> RunSimulatorSnapshot(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Snapshot Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "ConstructionTime(ms)", "SaveTime(ms)", "LoadTime(ms)", "RestoreTime(ms)", "ClassificationTime(s)", "ImageTime(s)", "Mismatches", "SnapshotSize(bytes)" };
+	vector<map<string, string>> data;
+
+	// Each TupleMerge classifier is built from the rules and saved. The
+	// snapshot is then mapped as an image, and restored into a fresh copy
+	// that can take updates; both must classify as the original does.
+	string base = GetOrElse(args, "Snapshot", "classifier");
+	unordered_map<string, PacketClassifier*> classifiers, copies;
+	ClassifierTests saved = ClassifierTests(tests & ~TestForgeImage);
+	PrepareSimulators(args, saved, rules, classifiers);
+	PrepareSimulators(args, saved, rules, copies);
+
+	for (auto& pair : classifiers) {
+		TupleMergeOnline* built = dynamic_cast<TupleMergeOnline*>(pair.second);
+		TupleMergeOnline* restored = dynamic_cast<TupleMergeOnline*>(copies[pair.first]);
+		if (built && restored) {
+			map<string, string> d = { { "Classifier", pair.first } };
+			map<string, string> bare, imaged;
+			printf("%s\n", pair.first.c_str());
+			vector<int> expected = s.PerformOnlyPacketClassification(*built, bare);
+
+			string file = base + "." + pair.first + ".tms";
+			auto start = chrono::steady_clock::now();
+			bool saved = built->SaveSnapshot(file);
+			chrono::duration<double, milli> saveTime = chrono::steady_clock::now() - start;
+			if (!saved) {
+				printf("\tCannot write %s\n", file.c_str());
+				exit(EIO);
+			}
+			printf("\tSaved to %s in %f ms\n", file.c_str(), saveTime.count());
+
+			TupleMergeImage image;
+			start = chrono::steady_clock::now();
+			if (!image.Load(file, rules)) {
+				exit(EINVAL);
+			}
+			chrono::duration<double, milli> loadTime = chrono::steady_clock::now() - start;
+			printf("%s image\n", pair.first.c_str());
+			vector<int> fromImage = s.PerformOnlyPacketClassification(image, imaged);
+
+			start = chrono::steady_clock::now();
+			restored->LoadSnapshot(image);
+			chrono::duration<double, milli> restoreTime = chrono::steady_clock::now() - start;
+
+			size_t mismatches = 0;
+			for (size_t i = 0; i < packets.size(); i++) {
+				if (fromImage[i] != expected[i]) mismatches++;
+				if (restored->ClassifyAPacket(packets[i]) != expected[i]) mismatches++;
+			}
+			printf("\tLoad time: %f ms, restore time: %f ms, construction time: %s ms\n", loadTime.count(), restoreTime.count(), bare["ConstructionTime(ms)"].c_str());
+			printf("\tMismatches: %lu\n", mismatches);
+			d["ConstructionTime(ms)"] = bare["ConstructionTime(ms)"];
+			d["SaveTime(ms)"] = to_string(saveTime.count());
+			d["LoadTime(ms)"] = to_string(loadTime.count());
+			d["RestoreTime(ms)"] = to_string(restoreTime.count());
+			d["ClassificationTime(s)"] = bare["ClassificationTime(s)"];
+			d["ImageTime(s)"] = imaged["ClassificationTime(s)"];
+			d["Mismatches"] = to_string(mismatches);
+			d["SnapshotSize(bytes)"] = to_string(image.MemSizeBytes());
+			data.push_back(d);
+		} else {
+			printf("%s: skipped, cannot be saved\n", pair.first.c_str());
+		}
+		delete pair.second;
+		delete copies[pair.first];
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+// How one hash function does on the tables of a TupleMerge classifier: how
+// fast it hashes packets for them, and how their rules chain under it
+template <class H>
+void RunHashTrial(const vector<const SlottedTable*>& tables, const vector<vector<Rule>>& tableRules, const vector<Packet>& packets, size_t limit, vector<map<string, string>>& data) {
+	printf("%s\n", H::Name());
+	if (!H::Supported()) {
+		printf("\tSkipped, not supported by this CPU\n");
+		return;
+	}
+
+	// Rules with the same key always chain; distinct keys that share a hash
+	// value chain only because of the hash
+	size_t rules = 0, maxChain = 0, sharedKeys = 0, overLimit = 0;
+	double chainSum = 0;
+	for (size_t t = 0; t < tables.size(); t++) {
+		const uint32_t* masks = tables[t]->Masks().data();
+		unordered_map<uint32_t, vector<Packet>> chains;
+		for (const Rule& r : tableRules[t]) {
+			Packet key;
+			for (int d = 0; d < MAXDIMENSIONS; d++) {
+				key[d] = r.range[d][LowDim] & masks[d];
+			}
+			chains[HashPolicy::HashMasked<H>(key, masks)].push_back(key);
+		}
+		for (auto& pair : chains) {
+			vector<Packet>& chain = pair.second;
+			size_t n = chain.size();
+			rules += n;
+			chainSum += n * n;
+			maxChain = max(maxChain, n);
+			if (n > limit) overLimit += n - limit;
+			sort(chain.begin(), chain.end());
+			sharedKeys += unique(chain.begin(), chain.end()) - chain.begin() - 1;
+		}
+	}
+
+	vector<const uint32_t*> masks;
+	for (const SlottedTable* table : tables) {
+		masks.push_back(table->Masks().data());
+	}
+	double best = numeric_limits<double>::max();
+	uint32_t sink = 0;
+	for (int trial = 0; trial < 3; trial++) {
+		auto start = chrono::steady_clock::now();
+		for (const Packet& p : packets) {
+			for (const uint32_t* m : masks) {
+				sink += HashPolicy::HashMasked<H>(p, m);
+			}
+		}
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		best = min(best, elapsed.count());
+	}
+	volatile uint32_t keep = sink;
+	(void)keep;
+	double rate = packets.size() * masks.size() / best / 1e6;
+	double meanChain = rules ? chainSum / rules : 0;
+
+	printf("\tHashes per second: %f million\n", rate);
+	printf("\tChain seen by a rule: %f mean, %lu max\n", meanChain, maxChain);
+	printf("\tKeys sharing a hash: %lu\n", sharedKeys);
+	printf("\tRules over the collision limit: %lu\n", overLimit);
+	map<string, string> d = { { "Hash", H::Name() } };
+	d["MHashesPerSecond"] = to_string(rate);
+	d["MeanChain"] = to_string(meanChain);
+	d["MaxChain"] = to_string(maxChain);
+	d["SharedKeys"] = to_string(sharedKeys);
+	d["OverLimit"] = to_string(overLimit);
+	data.push_back(d);
+}
+
+pair< vector<string>, vector<map<string, string>>> RunSimulatorHash(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, const string& outfile = "") {
+	printf("Hash Function Simulation\n");
+
+	vector<string> header = { "Hash", "MHashesPerSecond", "MeanChain", "MaxChain", "SharedKeys", "OverLimit" };
+	vector<map<string, string>> data;
+
+	// The tables are TMOffline's, built with the compiled-in hash; every
+	// hash function is tried on the same tables and packets
+	TupleMergeOffline tm(args);
+	tm.ConstructClassifier(rules);
+	vector<const SlottedTable*> tables;
+	vector<vector<Rule>> tableRules;
+	for (size_t i = 0; i < tm.NumTables(); i++) {
+		tables.push_back(tm.Table(i));
+		tableRules.push_back(tm.Table(i)->GetRules());
+	}
+	printf("%lu tables, collision limit %d, built with %s\n", tables.size(), tm.CollideLimit(), TupleMergeHash::Name());
+
+	RunHashTrial<HashPolicy::Bernstein>(tables, tableRules, packets, tm.CollideLimit(), data);
+	RunHashTrial<HashPolicy::Murmur>(tables, tableRules, packets, tm.CollideLimit(), data);
+	RunHashTrial<HashPolicy::Crc32>(tables, tableRules, packets, tm.CollideLimit(), data);
+	RunHashTrial<HashPolicy::MultiplyShift>(tables, tableRules, packets, tm.CollideLimit(), data);
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+// Millions of lookups per second for 'probes', repeated until 'lookups' have
+// been made, one hash at a time or in batches of 64 as TupleSpaceSearch does
+double TimeCmapLookups(const cmap& table, vector<uint32_t>& probes, size_t lookups, bool batch) {
+	double best = numeric_limits<double>::max();
+	size_t done = 0, sink = 0;
+	for (int trial = 0; trial < 3; trial++) {
+		auto start = chrono::steady_clock::now();
+		for (done = 0; done < lookups; done += probes.size()) {
+			if (batch) {
+				const cmap_node* nodes[64];
+				for (size_t i = 0; i < probes.size(); i += 64) {
+					sink += __builtin_popcountl(cmap_find_batch(&table, ~0UL, &probes[i], nodes));
+				}
+			} else {
+				for (uint32_t hash : probes) {
+					sink += cmap_find(&table, hash) != nullptr;
+				}
+			}
+		}
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		best = min(best, elapsed.count());
+	}
+	volatile size_t keep = sink;
+	(void)keep;
+	return done / best / 1e6;
+}
+
+pair< vector<string>, vector<map<string, string>>> RunSimulatorCmap(const unordered_map<string, string>& args, const vector<Rule>& rules, const string& outfile = "") {
+	printf("Cmap Lookup Simulation\n");
+
+	vector<string> header = { "Entries", "Buckets", "HitMlps", "MissMlps", "BatchHitMlps", "BatchMissMlps", "Size(bytes)" };
+	vector<map<string, string>> data;
+
+	// Each table holds nodes made from the ruleset's rules under distinct
+	// random hashes; hits look up hashes it holds and misses hashes it doesn't
+	vector<string> sizes;
+	Split(GetOrElse(args, "Cmap.Sizes", "1,10,100,1000,10000,100000,1000000"), ',', sizes);
+	size_t lookups = GetIntOrElse(args, "Cmap.Lookups", 1 << 22);
+	const size_t probeCount = 1 << 16;
+	for (const string& size : sizes) {
+		size_t n = stoul(size);
+		cmap_node_pool pool;
+		struct cmap table;
+		cmap_init_with_capacity(&table, n);
+		unordered_set<uint32_t> used;
+		vector<uint32_t> present;
+		while (present.size() < n) {
+			uint32_t hash = Random::random_unsigned_int();
+			if (used.insert(hash).second) {
+				present.push_back(hash);
+				cmap_insert(&table, pool.make(rules[present.size() % rules.size()]), hash);
+			}
+		}
+		vector<uint32_t> hits, misses;
+		while (misses.size() < probeCount) {
+			hits.push_back(present[Random::random_int(0, n - 1)]);
+			uint32_t hash = Random::random_unsigned_int();
+			if (!used.count(hash)) {
+				misses.push_back(hash);
+			} else {
+				hits.pop_back();
+			}
+		}
+
+		map<string, string> d = { { "Entries", size } };
+		d["Buckets"] = to_string(cmap_array_size(&table));
+		d["HitMlps"] = to_string(TimeCmapLookups(table, hits, lookups, false));
+		d["MissMlps"] = to_string(TimeCmapLookups(table, misses, lookups, false));
+		d["BatchHitMlps"] = to_string(TimeCmapLookups(table, hits, lookups, true));
+		d["BatchMissMlps"] = to_string(TimeCmapLookups(table, misses, lookups, true));
+		d["Size(bytes)"] = to_string(cmap_memory_size(&table));
+		printf("%s entries, %s buckets\n", size.c_str(), d["Buckets"].c_str());
+		printf("\tLookups per second: %s million hit, %s million miss\n", d["HitMlps"].c_str(), d["MissMlps"].c_str());
+		printf("\tBatched: %s million hit, %s million miss\n", d["BatchHitMlps"].c_str(), d["BatchMissMlps"].c_str());
+		data.push_back(d);
+
+		cmap_cursor cursor = cmap_cursor_start(&table);
+		while (cursor.node != nullptr) {
+			cmap_node* node = cursor.node;
+			cmap_cursor_advance(&cursor);
+			delete node;
+		}
+		cmap_destroy(&table);
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+// Keys pair up under the stress hash, so that removals and insertions also
+// run along chains of two
+static inline uint32_t CmapStressHash(int key) {
+	return hash_int(key >> 1, 0);
+}
+
+// Runs once no reader can still hold the node: poisons it first, so that a
+// reader that sees it afterwards is caught
+static void CmapStressReclaim(cmap_node* node) {
+	node->priority = numeric_limits<int>::min();
+	delete node;
+}
+
+pair< vector<string>, vector<map<string, string>>> RunSimulatorCmapStress(const unordered_map<string, string>& args, const vector<Rule>& rules, const string& outfile = "") {
+	printf("Cmap Stress Simulation\n");
+
+	vector<string> header = { "Readers", "Updates", "Resizes", "Lookups", "Lost", "Wrong", "Reclaimed", "UpdateTime(s)" };
+	vector<map<string, string>> data;
+
+	// Stable keys (even) stay in the map throughout and must always be found.
+	// Churn keys (odd) are inserted and removed first-in first-out, the live
+	// set swinging between churnLow and churnHigh so that the map keeps
+	// growing and shrinking through every kind of rehash. Every key is a
+	// rule's priority, and a node must hash as its key does.
+	int readers = GetIntOrElse(args, "threads", max(omp_get_max_threads() - 1, 1));
+	int updates = GetIntOrElse(args, "updates", 1000000);
+	const int stable = 1000, churnLow = 1000, churnHigh = 200000, churnKeys = 1 << 18;
+
+	cmap_node_pool pool;
+	struct cmap table;
+	cmap_init(&table);
+	Rule base = rules.empty() ? Rule() : rules[0];
+	auto insertKey = [&](int key) {
+		Rule r = base;
+		r.priority = r.id = key;
+		cmap_insert(&table, pool.make(r), CmapStressHash(key));
+	};
+	for (int k = 0; k < stable; k++) {
+		insertKey(2 * k);
+	}
+
+	vector<size_t> lookups(readers), lost(readers), wrong(readers), reclaimed(readers);
+	size_t resizes = 0;
+	std::atomic<bool> stop(false);
+	auto start = chrono::steady_clock::now();
+	#pragma omp parallel num_threads(readers + 1)
+	{
+		int t = omp_get_thread_num();
+		if (t == 0) {
+			deque<int> live;
+			int next = 0;
+			bool growing = true;
+			size_t buckets = cmap_array_size(&table);
+			for (int u = 0; u < updates; u++) {
+				if (growing) {
+					int key = 2 * next + 1;
+					next = (next + 1) % churnKeys;
+					insertKey(key);
+					live.push_back(key);
+					growing = live.size() < churnHigh;
+				} else {
+					int key = live.front();
+					live.pop_front();
+					uint32_t hash = CmapStressHash(key);
+					cmap_node* node;
+					for (node = cmap_find_protected(&table, hash); node->priority != key; node = cmap_node_next_protected(node));
+					cmap_remove(&table, node, hash);
+					ovsrcu_postpone(CmapStressReclaim, node);
+					growing = live.size() <= churnLow;
+				}
+				if (cmap_array_size(&table) != buckets) {
+					buckets = cmap_array_size(&table);
+					resizes++;
+				}
+			}
+			stop = true;
+		} else {
+			// Half the probes are for stable keys, half for churn keys that
+			// may or may not be there, one at a time and in batches of 64
+			const int burst = 64;
+			uint32_t seed = 2463534242u * t;
+			auto nextKey = [&]() {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				return (seed & 1) ? 2 * (int)((seed >> 1) % churnKeys) + 1 : 2 * (int)((seed >> 1) % stable);
+			};
+			auto check = [&](int key, const cmap_node* node) {
+				bool found = false;
+				for (; node != nullptr; node = cmap_node_next(node)) {
+					if (node->priority == numeric_limits<int>::min()) {
+						reclaimed[t - 1]++;
+					} else if (CmapStressHash(node->priority) != CmapStressHash(key)) {
+						wrong[t - 1]++;
+					}
+					found |= node->priority == key;
+				}
+				if (!found && key % 2 == 0) {
+					lost[t - 1]++;
+				}
+			};
+			int keys[burst];
+			uint32_t hashes[burst];
+			const cmap_node* nodes[burst];
+			ovsrcu_quiesce_end();
+			for (bool batch = false; !stop.load(std::memory_order_relaxed); batch = !batch) {
+				for (int i = 0; i < burst; i++) {
+					keys[i] = nextKey();
+					hashes[i] = CmapStressHash(keys[i]);
+				}
+				if (batch) {
+					unsigned long found = cmap_find_batch(&table, ~0UL, hashes, nodes);
+					for (int i = 0; i < burst; i++) {
+						check(keys[i], (found >> i) & 1 ? nodes[i] : nullptr);
+					}
+				} else {
+					for (int i = 0; i < burst; i++) {
+						check(keys[i], cmap_find(&table, hashes[i]));
+					}
+				}
+				lookups[t - 1] += burst;
+				ovsrcu_quiesce();
+			}
+			ovsrcu_quiesce_start();
+		}
+	}
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+	map<string, string> d = { { "Readers", to_string(readers) }, { "Updates", to_string(updates) } };
+	d["Resizes"] = to_string(resizes);
+	d["Lookups"] = to_string(accumulate(lookups.begin(), lookups.end(), (size_t)0));
+	d["Lost"] = to_string(accumulate(lost.begin(), lost.end(), (size_t)0));
+	d["Wrong"] = to_string(accumulate(wrong.begin(), wrong.end(), (size_t)0));
+	d["Reclaimed"] = to_string(accumulate(reclaimed.begin(), reclaimed.end(), (size_t)0));
+	d["UpdateTime(s)"] = to_string(elapsed.count());
+	printf("%d readers, %d updates in %f s, %s resizes\n", readers, updates, elapsed.count(), d["Resizes"].c_str());
+	printf("\tLookups: %s\n", d["Lookups"].c_str());
+	printf("\tErrors: %s lost, %s wrong, %s reclaimed\n", d["Lost"].c_str(), d["Wrong"].c_str(), d["Reclaimed"].c_str());
+	data.push_back(d);
+
+	ovsrcu_synchronize();
+	cmap_cursor cursor = cmap_cursor_start(&table);
+	while (cursor.node != nullptr) {
+		cmap_node* node = cursor.node;
+		cmap_cursor_advance(&cursor);
+		delete node;
+	}
+	cmap_destroy(&table);
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+vector<int> RunSimulatorParallelTrial(Simulator& s, const string& name, PacketClassifier& classifier, vector<map<string, string>>& data, const unordered_map<string, string>& args) {
+	map<string, string> d = { { "Classifier", name } };
+	printf("%s\n", name.c_str());
+	int threads = GetIntOrElse(args, "threads", omp_get_max_threads());
+	auto r = s.PerformParallelClassification(classifier, d, threads);
+	data.push_back(d);
+	return r;
+}
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorParallelClassification(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Parallel Classification Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "ConstructionTime(ms)", "Threads", "ClassificationTime(s)", "SingleThreadMpps", "AggregateMpps", "ThreadMpps", "ScalingEfficiency", "Size(bytes)", "Tables", "AvgQueries" };
+	vector<map<string, string>> data;
+
+	unordered_map<string, PacketClassifier*> classifiers;
+	PrepareSimulators(args, tests, rules, classifiers);
+	
+	for (auto& pair : classifiers) {
+		RunSimulatorParallelTrial(s, pair.first, *pair.second, data, args);
+		delete pair.second;
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorConstruction(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Construction Simulation\n");
+
+	vector<string> header = { "Classifier", "Rules", "Threads", "ConstructionTime(ms)", "Size(bytes)", "Tables" };
+	vector<map<string, string>> data;
+
+	// Each size is the ruleset cut down or grown to that many rules
+	vector<string> sizes;
+	Split(GetOrElse(args, "Construct.Sizes", "1000,10000,100000"), ',', sizes);
+	for (const string& size : sizes) {
+		Simulator s(GenerateRulesFromRuleset(rules, stoi(size)), packets);
+
+		unordered_map<string, PacketClassifier*> classifiers;
+		PrepareSimulators(args, tests, rules, classifiers);
+
+		for (auto& pair : classifiers) {
+			map<string, string> d = { { "Classifier", pair.first }, { "Rules", size }, { "Threads", to_string(omp_get_max_threads()) } };
+			printf("%s: %s rules\n", pair.first.c_str(), size.c_str());
+			s.PerformConstruction(*pair.second, d);
+			data.push_back(d);
+			delete pair.second;
+		}
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+vector<int> RunSimulatorConcurrentTrial(Simulator& s, const string& name, PacketClassifier& classifier, vector<map<string, string>>& data, const unordered_map<string, string>& args) {
+	map<string, string> d = { { "Classifier", name } };
+	printf("%s\n", name.c_str());
+	int readers = GetIntOrElse(args, "threads", max(omp_get_max_threads() - 1, 1));
+	int updates = GetIntOrElse(args, "updates", 10000);
+	auto r = s.PerformConcurrentUpdates(classifier, d, readers, updates);
+	if (auto hybrid = dynamic_cast<TupleMergeHybrid*>(&classifier)) {
+		printf("\tRebuilds: %lu\n", hybrid->Rebuilds());
+	}
+	data.push_back(d);
+	return r;
+}
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorConcurrentUpdates(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Concurrent Update Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "ConstructionTime(ms)", "Readers", "Updates", "UpdateTime(s)", "UpdatesPerSec", "ConcurrentMpps", "IdleMpps", "Mismatches", "Size(bytes)", "Tables" };
+	vector<map<string, string>> data;
+
+	unordered_map<string, PacketClassifier*> classifiers;
+	PrepareSimulators(args, tests, rules, classifiers);
+	
+	for (auto& pair : classifiers) {
+		RunSimulatorConcurrentTrial(s, pair.first, *pair.second, data, args);
+		delete pair.second;
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
+
+void RunSimulatorUpdateLatencyTrial(Simulator& s, const string& name, PacketClassifier& classifier, vector<map<string, string>>& data, const unordered_map<string, string>& args) {
+	map<string, string> d = { { "Classifier", name } };
+	printf("%s\n", name.c_str());
+	int updates = GetIntOrElse(args, "updates", 10000);
+	double start = GetDoubleOrElse(args, "Latency.Start", 0.5);
+	double inserts = GetDoubleOrElse(args, "Latency.Inserts", 0.5);
+	s.PerformUpdateLatency(classifier, d, updates, start, inserts);
+	if (auto hybrid = dynamic_cast<TupleMergeHybrid*>(&classifier)) {
+		printf("\tRebuilds: %lu\n", hybrid->Rebuilds());
+	}
+	data.push_back(d);
+}
+
+pair< vector<string>, vector<map<string, string>>>  RunSimulatorUpdateLatency(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests, const string& outfile = "") {
+	printf("Update Latency Simulation\n");
+	Simulator s(rules, packets);
+
+	vector<string> header = { "Classifier", "ConstructionTime(ms)", "Updates", "MeanLatency(us)", "P50Latency(us)", "P99Latency(us)", "P999Latency(us)", "MaxLatency(us)", "Tables" };
+	vector<map<string, string>> data;
+
+	unordered_map<string, PacketClassifier*> classifiers;
+	PrepareSimulators(args, tests, rules, classifiers);
+
+	for (auto& pair : classifiers) {
+		RunSimulatorUpdateLatencyTrial(s, pair.first, *pair.second, data, args);
+		delete pair.second;
+	}
+
+	if (outfile != "") {
+		OutputWriter::WriteCsvFile(outfile, header, data);
+	}
+	return make_pair(header, data);
+}
 
 vector<int> RunSimulatorPartialBuildTrial(Simulator& s, const string& name, PacketClassifier& classifier, vector<map<string, string>>& data, const unordered_map<string, string>& args) {
 	map<string, string> d = { { "Classifier", name } };
@@ -151,7 +891,7 @@ pair< vector<string>, vector<map<string, string>> > RunSimulatorPartialBuildClas
 	vector<map<string, string>> data;
 
 	unordered_map<string, PacketClassifier*> classifiers;
-	PrepareSimulators(args, tests, classifiers);
+	PrepareSimulators(args, tests, rules, classifiers);
 	
 	for (auto& pair : classifiers) {
 		RunSimulatorPartialBuildTrial(s, pair.first, *pair.second, data, args);
@@ -191,7 +931,7 @@ pair< vector<string>, vector<map<string, string>>>  RunSimulatorUpdates(const un
 	const auto req = s.SetupComputation(0, 500000, 500000);
 	
 	unordered_map<string, PacketClassifier*> classifiers;
-	PrepareSimulators(args, tests, classifiers);
+	PrepareSimulators(args, tests, rules, classifiers);
 	
 	for (auto pair : classifiers) {
 		RunSimulatorUpdateTrial(s, pair.first, *pair.second, req, data, repetitions);
@@ -241,7 +981,7 @@ bool Validation(const unordered_map<string, PacketClassifier*> classifiers, cons
 void RunValidation(const unordered_map<string, string>& args, const vector<Packet>& packets, const vector<Rule>& rules, ClassifierTests tests) {
 	printf("Validation Simulation\n");
 	unordered_map<string, PacketClassifier*> classifiers;
-	PrepareSimulators(args, tests, classifiers);
+	PrepareSimulators(args, tests, rules, classifiers);
 
 	printf("Building\n");
 	for (auto& pair : classifiers) {
@@ -319,23 +1059,6 @@ void RunPartitioning(const vector<Rule>& rules, PartitioningMode partition_mode,
 
 
 
-static const struct cmap_node *
-find(const struct cmap *cmap, int key)
-{
-	
-	auto hash_val = hash_int(key, 0);
-	const cmap_node * found_node = cmap_find(cmap, hash_val);
-	 
-
-	while (found_node != nullptr) {
-		if (found_node->key == key) return found_node;
-		found_node = found_node->next;
-	}  
-
-	return nullptr;
-}
-
-
 ClassifierTests ParseClassifier(const string& line) {
 	vector<string> tokens;
 	Split(line, ',', tokens);
@@ -373,6 +1096,15 @@ ClassifierTests ParseClassifier(const string& line) {
 		else if (classifier == "TMOnline") {
 			tests = tests | TestForgeOnline;
 		}
+		else if (classifier == "TMImage") {
+			tests = tests | TestForgeImage;
+		}
+		else if (classifier == "TMHybrid") {
+			tests = tests | TestForgeHybrid;
+		}
+		else if (classifier == "TMHybridOnline") {
+			tests = tests | TestForgeHybridOnline;
+		}
 		else if (classifier == "All") {
 			tests = tests | TestAll;
 		}
@@ -431,6 +1163,39 @@ TestMode ParseMode(const string& mode) {
 	else if (mode == "Validate") {
 		return ModeValidation;
 	}
+	else if (mode == "Parallel") {
+		return ModeParallelClassification;
+	}
+	else if (mode == "Concurrent") {
+		return ModeConcurrentUpdate;
+	}
+	else if (mode == "Construction") {
+		return ModeConstruction;
+	}
+	else if (mode == "UpdateLatency") {
+		return ModeUpdateLatency;
+	}
+	else if (mode == "FlowCache") {
+		return ModeFlowCache;
+	}
+	else if (mode == "Megaflow") {
+		return ModeMegaflow;
+	}
+	else if (mode == "Filter") {
+		return ModeFilter;
+	}
+	else if (mode == "Hash") {
+		return ModeHash;
+	}
+	else if (mode == "Snapshot") {
+		return ModeSnapshot;
+	}
+	else if (mode == "Cmap") {
+		return ModeCmap;
+	}
+	else if (mode == "CmapStress") {
+		return ModeCmapStress;
+	}
 	else {
 		printf("Unknown mode: %s\n", mode.c_str());
 		exit(EINVAL);
@@ -468,6 +1233,7 @@ int main(int argc, char* argv[]) {
 	TestMode mode = ParseMode(GetOrElse(args, "m", "Classification"));
 	PartitioningMode partition_mode = ParseModePartitioning(GetOrElse(args, "b", "PartitionGreedyFieldSelection"));
 	int repeat = GetIntOrElse(args, "r", 1);
+	HugePages::SetPolicy(HugePages::ParsePolicy(GetOrElse(args, "Pages", "Normal")));
 
 	if (GetBoolOrElse(args, "?", false)) {
 		printf("Arguments:\n");
@@ -479,6 +1245,25 @@ int main(int argc, char* argv[]) {
 		printf("\t-r <x> Repeat and average\n");
 		printf("\t-d [<database> Database File]\n");
 		printf("\t-b [<partitioning mode> Partitioning Mode]\n");
+		printf("\t-Batch [<x> Classify packets in bursts of x]\n");
+		printf("\t-threads [<x> Threads for m=Parallel, reader threads for m=Concurrent]\n");
+		printf("\t-updates [<x> Rule insertions and deletions for m=Concurrent and m=UpdateLatency]\n");
+		printf("\t-Latency.Start, -Latency.Inserts [<x> Fraction of the rules m=UpdateLatency builds from, and fraction of its updates that insert]\n");
+		printf("\t-Construct.Sizes [<x,y,...> Ruleset sizes for m=Construction]\n");
+		printf("\t-FlowCache [<x> Put an exact-match cache of x entries in front of each classifier; m=FlowCache compares with and without]\n");
+		printf("\t-Megaflow [<x> Put a wildcarded cache of up to x flows per thread in front of each classifier; m=Megaflow compares with and without]\n");
+		printf("\t-TM.Limit.Collide [<x>|Auto Rules per hash value in a TupleMerge table; Auto picks it by timing sample packets, within -TM.Limit.Auto.Memory bytes if given]\n");
+		printf("\t-Snapshot [<file> Snapshot that c=TMImage classifies from; m=Snapshot saves each TupleMerge classifier to <file>.<classifier>.tms and times loading it against building]\n");
+		printf("\t-m=Hash Compare the tuple table hash functions on TMOffline's tables; TM_HASH and TSS_HASH in the makefile pick the ones built in\n");
+		printf("\t-Pages [<Normal|Advise|HugeTLB> Pages for cmap buckets, cmap nodes and their rules, and red-black tree nodes: the heap, madvise(MADV_HUGEPAGE) or MAP_HUGETLB; m=Classification reports dTLB misses where perf counters allow]\n");
+		printf("\t-m=Cmap Time cmap_find hits and misses on bare cmaps of -Cmap.Sizes [<x,y,...>] entries, -Cmap.Lookups [<x>] lookups each\n");
+		printf("\t-m=CmapStress Race -threads readers against -updates insertions and removals that keep resizing a bare cmap, and count what the readers got wrong\n");
+		printf("\t-TM.Filter [<x> Counters per rule in a Bloom filter in front of each TupleMerge table; m=Filter compares with and without]\n");
+		printf("\t-TM.Compact [1 to let TMOnline updates merge sparse tables; off by default]\n");
+		printf("\t-TM.Compact.Tables, -TM.Compact.Probes [<x> Table count and probes per packet above which TMOnline merges sparse tables]\n");
+		printf("\t-TM.Compact.Checks [<x> Pairs of tables TMOnline checks for a merge per update]\n");
+		printf("\t-TM.Hybrid.Tables, -TM.Hybrid.Probes [<x> Growth in tables and in probes per packet since the last offline build at which TMHybrid rebuilds in the background, and TMHybridOnline in place]\n");
+		printf("\t-TM.Hybrid.Interval [<x> Updates TMHybrid waits after a rebuild before looking again]\n");
 		exit(0);
 	}
 	
@@ -529,6 +1314,39 @@ int main(int argc, char* argv[]) {
 			case ModePartial:
 				RunSimulatorPartialBuildClassification(args, packets, rules, classifier, outputFile);
 				break;
+			case ModeParallelClassification:
+				RunSimulatorParallelClassification(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeConcurrentUpdate:
+				RunSimulatorConcurrentUpdates(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeConstruction:
+				RunSimulatorConstruction(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeUpdateLatency:
+				RunSimulatorUpdateLatency(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeFlowCache:
+				RunSimulatorFlowCache(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeMegaflow:
+				RunSimulatorMegaflow(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeFilter:
+				RunSimulatorFilter(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeHash:
+				RunSimulatorHash(args, packets, rules, outputFile);
+				break;
+			case ModeSnapshot:
+				RunSimulatorSnapshot(args, packets, rules, classifier, outputFile);
+				break;
+			case ModeCmap:
+				RunSimulatorCmap(args, rules, outputFile);
+				break;
+			case ModeCmapStress:
+				RunSimulatorCmapStress(args, rules, outputFile);
+				break;
 			case ModeValidation:
 				RunValidation(args, packets, rules, classifier);
 				break;